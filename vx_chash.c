@@ -0,0 +1,223 @@
+/**
+ * vx_chash.c Copyright Voxaris Inc, George Howitt 2008
+ */
+
+#include <vx_chash.h>
+#include <vx_log.h>
+
+#define VX_CHASH_CACHELINE 64
+
+/**
+ * vx_shard_t: the vx_sync_t lives in the shard rather than behind a
+ * pointer, and shards sit stride bytes apart (sizeof rounded up to a cache
+ * line) in an aligned array, so neighbouring shard locks never share a line
+ */
+typedef struct vx_shard
+{
+   vx_sync_t sync;
+   vx_hash_t *hash;
+} vx_shard_t;
+
+struct vx_chash
+{
+   size_t nshards;
+   int shift;
+   size_t stride;
+   vx_shard_t *shards;
+};
+
+static inline vx_shard_t * vx_chash_at (vx_chash_t *chash, size_t index)
+{
+   return ((vx_shard_t *) ((char *) chash->shards + index * chash->stride));
+}
+
+/**
+ * vx_shard_sync_init: vx_sync_create for a vx_sync_t held in place
+ */
+static vx_status_t vx_shard_sync_init (vx_sync_t *sync)
+{
+   int rc;
+
+   if ((rc = pthread_mutex_init (&sync->mutex, NULL)))
+   {
+      vxlog (LOG_ERR, "{%s:%d} pthread_mutex_init failed: %d",
+         __func__, __LINE__, rc);
+      return (VX_FAILURE);
+   }
+   if ((rc = pthread_cond_init (&sync->cond, NULL)))
+   {
+      vxlog (LOG_ERR, "{%s:%d} pthread_cond_init failed: %d",
+         __func__, __LINE__, rc);
+      pthread_mutex_destroy (&sync->mutex);
+      return (VX_FAILURE);
+   }
+   sync->waiters = 0;
+   return (VX_SUCCESS);
+}
+
+static inline vx_shard_t * vx_chash_shard (vx_chash_t *chash, uint32_t hash_value)
+{
+   if (chash->shift == 32)
+      return (chash->shards);
+   return (vx_chash_at (chash, hash_value >> chash->shift));
+}
+
+vx_status_t vx_chash_create (vx_chash_t **chash, size_t nshards, size_t size, size_t key_size, int flags)
+{
+   vx_status_t rc;
+   vx_shard_t *shard;
+   size_t index;
+
+   (*chash) = (vx_chash_t *) calloc (1, sizeof (vx_chash_t));
+   if ((*chash) == NULL)
+      return (VX_ENOMEM);
+
+   (*chash)->nshards = 1;
+   (*chash)->shift = 32;
+   while ((*chash)->nshards < nshards)
+   {
+      (*chash)->nshards <<= 1;
+      (*chash)->shift--;
+   }
+
+   (*chash)->stride = (sizeof (vx_shard_t) + VX_CHASH_CACHELINE - 1) & ~(size_t) (VX_CHASH_CACHELINE - 1);
+   if (posix_memalign ((void **) &(*chash)->shards, VX_CHASH_CACHELINE,
+         (*chash)->nshards * (*chash)->stride))
+   {
+      free (*chash);
+      return (VX_ENOMEM);
+   }
+
+   for (index = 0; index < (*chash)->nshards; index++)
+   {
+      shard = vx_chash_at (*chash, index);
+      if ((shard->hash = vx_hash_create (size, key_size, flags)) == NULL)
+         rc = VX_ENOMEM;
+      else if ((rc = vx_shard_sync_init (&shard->sync)) != VX_SUCCESS)
+         vx_hash_destroy (shard->hash);
+      else
+         continue;
+      (*chash)->nshards = index;
+      vx_chash_destroy (*chash);
+      return (rc);
+   }
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_chash_destroy (vx_chash_t *chash)
+{
+   vx_shard_t *shard;
+   size_t index;
+   for (index = 0; index < chash->nshards; index++)
+   {
+      shard = vx_chash_at (chash, index);
+      vx_hash_destroy (shard->hash);
+      pthread_cond_destroy (&shard->sync.cond);
+      pthread_mutex_destroy (&shard->sync.mutex);
+   }
+   free (chash->shards);
+   free (chash);
+   return (VX_SUCCESS);
+}
+
+void vx_chash_set_hash_func (vx_chash_t *chash, vx_hash_func_t hash_func)
+{
+   size_t index;
+   for (index = 0; index < chash->nshards; index++)
+      vx_hash_set_hash_func (vx_chash_at (chash, index)->hash, hash_func);
+}
+
+void vx_chash_set_algo (vx_chash_t *chash, vx_hash_algo_t algo)
+{
+   size_t index;
+   vx_hash_set_algo (chash->shards->hash, algo);
+   for (index = 1; index < chash->nshards; index++)
+   {
+      vx_hash_set_seed (vx_chash_at (chash, index)->hash, vx_hash_get_seed (chash->shards->hash));
+      vx_hash_set_algo (vx_chash_at (chash, index)->hash, algo);
+   }
+}
+
+void vx_chash_set_free_func (vx_chash_t *chash, vx_hash_free_func_t free_func)
+{
+   size_t index;
+   for (index = 0; index < chash->nshards; index++)
+      vx_hash_set_free_func (vx_chash_at (chash, index)->hash, free_func);
+}
+
+void * vx_chash_put (vx_chash_t *chash, void *key, void *value)
+{
+   uint32_t hash_value = vx_hash_hash (chash->shards->hash, key);
+   vx_shard_t *shard = vx_chash_shard (chash, hash_value);
+
+   vx_sync_lock (&shard->sync);
+   value = vx_hash_put_hashed (shard->hash, key, value, hash_value);
+   vx_sync_unlock (&shard->sync);
+   return (value);
+}
+
+void * vx_chash_get (vx_chash_t *chash, void *key)
+{
+   uint32_t hash_value = vx_hash_hash (chash->shards->hash, key);
+   vx_shard_t *shard = vx_chash_shard (chash, hash_value);
+   void *value;
+
+   vx_sync_lock (&shard->sync);
+   value = vx_hash_get_hashed (shard->hash, key, hash_value);
+   vx_sync_unlock (&shard->sync);
+   return (value);
+}
+
+void * vx_chash_delete (vx_chash_t *chash, void *key)
+{
+   uint32_t hash_value = vx_hash_hash (chash->shards->hash, key);
+   vx_shard_t *shard = vx_chash_shard (chash, hash_value);
+   void *value;
+
+   vx_sync_lock (&shard->sync);
+   value = vx_hash_delete_hashed (shard->hash, key, hash_value);
+   vx_sync_unlock (&shard->sync);
+   return (value);
+}
+
+void * vx_chash_compute_if_absent (vx_chash_t *chash, void *key, vx_chash_compute_func_t func, void *arg)
+{
+   uint32_t hash_value = vx_hash_hash (chash->shards->hash, key);
+   vx_shard_t *shard = vx_chash_shard (chash, hash_value);
+   void *value;
+
+   vx_sync_lock (&shard->sync);
+   value = vx_hash_get_hashed (shard->hash, key, hash_value);
+   if (value == NULL && (value = func (key, arg)) != NULL)
+      vx_hash_put_hashed (shard->hash, key, value, hash_value);
+   vx_sync_unlock (&shard->sync);
+   return (value);
+}
+
+void vx_chash_foreach (vx_chash_t *chash, vx_chash_foreach_func_t func, void *arg)
+{
+   size_t index;
+   void *key, *value, *ptr;
+   int more = 1;
+
+   for (index = 0; more && index < chash->nshards; index++)
+   {
+      vx_sync_lock (&vx_chash_at (chash, index)->sync);
+      ptr = NULL;
+      while (more && vx_hash_get_next (vx_chash_at (chash, index)->hash, &key, &value, &ptr))
+         more = func (key, value, arg);
+      vx_sync_unlock (&vx_chash_at (chash, index)->sync);
+   }
+}
+
+size_t vx_chash_count (vx_chash_t *chash)
+{
+   size_t index, count = 0;
+   for (index = 0; index < chash->nshards; index++)
+   {
+      vx_sync_lock (&vx_chash_at (chash, index)->sync);
+      count += vx_hash_count (vx_chash_at (chash, index)->hash);
+      vx_sync_unlock (&vx_chash_at (chash, index)->sync);
+   }
+   return (count);
+}
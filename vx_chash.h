@@ -0,0 +1,100 @@
+/**
+ * vx_chash.h Copyright Voxaris Inc, George Howitt 2008
+ */
+
+#ifndef _VX_CHASH_H_
+#define _VX_CHASH_H_
+
+#include <vx_hash.h>
+#include <vx_sync.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * vx_chash_compute_func_t: builds the value for an absent key, called with
+ * the shard locked
+ */
+typedef void * (*vx_chash_compute_func_t) (const void *key, void *arg);
+
+/**
+ * vx_chash_foreach_func_t: called per entry with the shard locked, return
+ * 0 to stop the walk
+ */
+typedef int (*vx_chash_foreach_func_t) (void *key, void *value, void *arg);
+
+struct vx_chash;
+/**
+ * vx_chash_t: opaque pointer to a sharded, thread safe hash table
+ */
+typedef struct vx_chash vx_chash_t;
+
+/**
+ * vx_chash_create: nshards (rounded up to a power of 2) vx_hash_t tables
+ * of size bins each, every one behind its own vx_sync_t. The shard is
+ * picked by the high bits of the hash, the bin by the low bits.
+ */
+vx_status_t vx_chash_create (vx_chash_t **chash, size_t nshards, size_t size, size_t key_size, int flags);
+
+/**
+ *
+ */
+vx_status_t vx_chash_destroy (vx_chash_t *chash);
+
+/**
+ *
+ */
+void vx_chash_set_hash_func (vx_chash_t *chash, vx_hash_func_t hash_func);
+
+/**
+ * vx_chash_set_algo: as vx_hash_set_algo, one seed shared by all shards
+ */
+void vx_chash_set_algo (vx_chash_t *chash, vx_hash_algo_t algo);
+
+/**
+ *
+ */
+void vx_chash_set_free_func (vx_chash_t *chash, vx_hash_free_func_t free_func);
+
+/**
+ *
+ */
+void * vx_chash_put (vx_chash_t *chash, void *key, void *value);
+
+/**
+ * vx_chash_get: the value is returned after the shard is unlocked, so its
+ * lifetime is up to the caller as with vx_hash_get
+ */
+void * vx_chash_get (vx_chash_t *chash, void *key);
+
+/**
+ *
+ */
+void * vx_chash_delete (vx_chash_t *chash, void *key);
+
+/**
+ * vx_chash_compute_if_absent: return the value for key, creating it with
+ * func and inserting it atomically if key is absent. A NULL from func
+ * inserts nothing.
+ */
+void * vx_chash_compute_if_absent (vx_chash_t *chash, void *key, vx_chash_compute_func_t func, void *arg);
+
+/**
+ * vx_chash_foreach: walk the shards one at a time, each under its lock.
+ * Every shard is seen consistently, the table as a whole is not. func must
+ * not call back into chash.
+ */
+void vx_chash_foreach (vx_chash_t *chash, vx_chash_foreach_func_t func, void *arg);
+
+/**
+ * vx_chash_count: sum of the shard counts, taken one lock at a time
+ */
+size_t vx_chash_count (vx_chash_t *chash);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,164 @@
+/**
+ * vx_epoch.c Copyright Voxaris Inc, George Howitt 2008
+ */
+
+#include <vx_epoch.h>
+
+#define VX_EPOCH_CACHELINE 64
+#define VX_EPOCH_OFFLINE   0
+
+/**
+ * vx_reader_t: a reader writes only its own slot, one per cache line
+ */
+typedef struct vx_reader
+{
+   uint64_t epoch;
+   int used;
+   char pad[VX_EPOCH_CACHELINE - sizeof (uint64_t) - sizeof (int)];
+} vx_reader_t;
+
+typedef struct vx_retired
+{
+   void *ptr;
+   vx_epoch_free_func_t func;
+   void *arg;
+   uint64_t epoch;
+} vx_retired_t;
+
+struct vx_epoch
+{
+   vx_reader_t readers[VX_EPOCH_READERS];
+   uint64_t global;
+   char pad[VX_EPOCH_CACHELINE - sizeof (uint64_t)];
+   pthread_mutex_t lock;
+   vx_retired_t *retired;
+   size_t nretired;
+   size_t retired_size;
+};
+
+vx_epoch_t * vx_epoch_create (void)
+{
+   vx_epoch_t *epoch;
+   if (posix_memalign ((void **) &epoch, VX_EPOCH_CACHELINE, sizeof (vx_epoch_t)))
+      return (NULL);
+   memset (epoch, 0, sizeof (vx_epoch_t));
+   epoch->global = 1;
+   pthread_mutex_init (&epoch->lock, NULL);
+   return (epoch);
+}
+
+void vx_epoch_destroy (vx_epoch_t *epoch)
+{
+   size_t ndx;
+   for (ndx = 0; ndx < epoch->nretired; ndx++)
+      epoch->retired[ndx].func (epoch->retired[ndx].arg, epoch->retired[ndx].ptr);
+   free (epoch->retired);
+   pthread_mutex_destroy (&epoch->lock);
+   free (epoch);
+}
+
+int vx_epoch_register (vx_epoch_t *epoch)
+{
+   int reader;
+   pthread_mutex_lock (&epoch->lock);
+   for (reader = 0; reader < VX_EPOCH_READERS; reader++)
+   {
+      if (!epoch->readers[reader].used)
+      {
+         epoch->readers[reader].used = 1;
+         vx_epoch_online (epoch, reader);
+         pthread_mutex_unlock (&epoch->lock);
+         return (reader);
+      }
+   }
+   pthread_mutex_unlock (&epoch->lock);
+   return (-1);
+}
+
+void vx_epoch_unregister (vx_epoch_t *epoch, int reader)
+{
+   pthread_mutex_lock (&epoch->lock);
+   __atomic_store_n (&epoch->readers[reader].epoch, VX_EPOCH_OFFLINE, __ATOMIC_RELEASE);
+   epoch->readers[reader].used = 0;
+   pthread_mutex_unlock (&epoch->lock);
+}
+
+void vx_epoch_quiescent (vx_epoch_t *epoch, int reader)
+{
+   __atomic_store_n (&epoch->readers[reader].epoch,
+      __atomic_load_n (&epoch->global, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+void vx_epoch_offline (vx_epoch_t *epoch, int reader)
+{
+   __atomic_store_n (&epoch->readers[reader].epoch, VX_EPOCH_OFFLINE, __ATOMIC_RELEASE);
+}
+
+void vx_epoch_online (vx_epoch_t *epoch, int reader)
+{
+   __atomic_store_n (&epoch->readers[reader].epoch,
+      __atomic_load_n (&epoch->global, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+   /* the slot must be visible before this reader loads anything shared */
+   __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+void vx_epoch_lock (vx_epoch_t *epoch)
+{
+   pthread_mutex_lock (&epoch->lock);
+}
+
+void vx_epoch_unlock (vx_epoch_t *epoch)
+{
+   pthread_mutex_unlock (&epoch->lock);
+}
+
+void vx_epoch_retire (vx_epoch_t *epoch, void *ptr, vx_epoch_free_func_t func, void *arg)
+{
+   vx_retired_t *retired;
+
+   if (epoch->nretired == epoch->retired_size)
+   {
+      epoch->retired_size = epoch->retired_size ? epoch->retired_size * 2 : 64;
+      epoch->retired = realloc (epoch->retired, epoch->retired_size * sizeof (vx_retired_t));
+      assert (epoch->retired != NULL);
+   }
+   retired = &epoch->retired[epoch->nretired++];
+   retired->ptr = ptr;
+   retired->func = func;
+   retired->arg = arg;
+   retired->epoch = epoch->global;
+}
+
+void vx_epoch_reclaim (vx_epoch_t *epoch)
+{
+   uint64_t min, seen;
+   size_t ndx, kept;
+   int reader;
+
+   if (epoch->nretired == 0)
+      return;
+
+   /* everything retired so far was unlinked before this increment */
+   min = __atomic_add_fetch (&epoch->global, 1, __ATOMIC_SEQ_CST);
+
+   for (reader = 0; reader < VX_EPOCH_READERS; reader++)
+   {
+      seen = __atomic_load_n (&epoch->readers[reader].epoch, __ATOMIC_ACQUIRE);
+      if (seen != VX_EPOCH_OFFLINE && seen < min)
+         min = seen;
+   }
+
+   for (ndx = 0, kept = 0; ndx < epoch->nretired; ndx++)
+   {
+      if (epoch->retired[ndx].epoch < min)
+         epoch->retired[ndx].func (epoch->retired[ndx].arg, epoch->retired[ndx].ptr);
+      else
+         epoch->retired[kept++] = epoch->retired[ndx];
+   }
+   epoch->nretired = kept;
+}
+
+size_t vx_epoch_pending (vx_epoch_t *epoch)
+{
+   return (epoch->nretired);
+}
@@ -0,0 +1,107 @@
+/**
+ * vx_epoch.h Copyright Voxaris Inc, George Howitt 2008
+ */
+
+#ifndef _VX_EPOCH_H_
+#define _VX_EPOCH_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * maximum number of registered reader threads per vx_epoch_t
+ */
+#define VX_EPOCH_READERS 128
+
+/**
+ * vx_epoch_free_func_t: releases a retired pointer, arg is the one given
+ * to vx_epoch_retire
+ */
+typedef void (*vx_epoch_free_func_t) (void *arg, void *ptr);
+
+struct vx_epoch;
+/**
+ * vx_epoch_t: quiescent state based reclamation. Readers never write while
+ * reading; between reads they announce the epoch they last saw with
+ * vx_epoch_quiescent. Writers are serialized by vx_epoch_lock and retire
+ * memory that is freed once every online reader has moved past it.
+ */
+typedef struct vx_epoch vx_epoch_t;
+
+/**
+ *
+ */
+vx_epoch_t * vx_epoch_create (void);
+
+/**
+ * vx_epoch_destroy: frees everything still retired, no readers may remain
+ */
+void vx_epoch_destroy (vx_epoch_t *epoch);
+
+/**
+ * vx_epoch_register: returns the reader slot for the calling thread, online,
+ * or -1 if all VX_EPOCH_READERS slots are taken
+ */
+int vx_epoch_register (vx_epoch_t *epoch);
+
+/**
+ *
+ */
+void vx_epoch_unregister (vx_epoch_t *epoch, int reader);
+
+/**
+ * vx_epoch_quiescent: reader holds no pointers into the protected data
+ */
+void vx_epoch_quiescent (vx_epoch_t *epoch, int reader);
+
+/**
+ * vx_epoch_offline: reader will not read for a while (e.g. before blocking),
+ * so writers need not wait on it until vx_epoch_online
+ */
+void vx_epoch_offline (vx_epoch_t *epoch, int reader);
+
+/**
+ *
+ */
+void vx_epoch_online (vx_epoch_t *epoch, int reader);
+
+/**
+ *
+ */
+void vx_epoch_lock (vx_epoch_t *epoch);
+
+/**
+ *
+ */
+void vx_epoch_unlock (vx_epoch_t *epoch);
+
+/**
+ * vx_epoch_retire: hand ptr over to be freed by func once it is
+ * unreachable by all readers, called with the epoch locked
+ */
+void vx_epoch_retire (vx_epoch_t *epoch, void *ptr, vx_epoch_free_func_t func, void *arg);
+
+/**
+ * vx_epoch_reclaim: advance the epoch and free whatever no reader can still
+ * see, called with the epoch locked
+ */
+void vx_epoch_reclaim (vx_epoch_t *epoch);
+
+/**
+ * vx_epoch_pending: number of retired pointers not yet freed
+ */
+size_t vx_epoch_pending (vx_epoch_t *epoch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,16 +4,160 @@
 
 #include <vx_hash.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined (Linux)
+#include <sys/random.h>
+#endif
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#define VX_FLAT_GROUP   16
+#define VX_FLAT_EMPTY   0x80
+#define VX_FLAT_DELETED 0xFE
+#define VX_FLAT_H1(h)   ((h) >> 7)
+#define VX_FLAT_H2(h)   ((uint8_t) ((h) & 0x7f))
+
+/**
+ * old bins moved into the new array per put/get/delete while an
+ * incremental resize is in progress
+ */
+#define VX_HASH_MIGRATE_STEP 4
+
+/**
+ * retired nodes batched up before an epoch mode writer tries to free them
+ */
+#define VX_HASH_RECLAIM_BATCH 64
+
+/**
+ * wyhash secret and xxh64 primes
+ */
+#define VX_WY0 0xa0761d6478bd642fULL
+#define VX_WY1 0xe7037ed1a0b428dbULL
+#define VX_WY2 0x8ebc6af09c88c6e3ULL
+#define VX_WY3 0x589965cc75374cc3ULL
+#define VX_XX1 11400714785074694791ULL
+#define VX_XX2 14029467366897019727ULL
+#define VX_XX3 1609587929392839161ULL
+#define VX_XX4 9650029242287828579ULL
+#define VX_XX5 2870177450012600261ULL
+
+/**
+ * keys hashed and prefetched together by the batch calls
+ */
+#define VX_HASH_BATCH 16
+
+/**
+ * snapshot images, see vx_image_t
+ */
+#define VX_IMAGE_MAGIC    "vxhash\0"
+#define VX_IMAGE_VERSION  1
+#define VX_IMAGE_ORDER    0x01020304
+#define VX_IMAGE_ALIGN(n) (((n) + 7) & ~(uint64_t) 7)
+
+/**
+ * entries per thread below which vx_hash_build does not start threads
+ */
+#define VX_HASH_BUILD_MIN 16384
+
+/**
+ * ranges per thread in vx_hash_foreach_parallel, so a thread that finishes
+ * early picks up more work
+ */
+#define VX_HASH_RANGES 8
+
 typedef struct vx_node
 {
    void *key;
    void *value;
    uint32_t hashval;
+   uint32_t charge;
    struct vx_node *link;
    struct vx_node *next;
    struct vx_node *prev;
 } vx_node_t;
 
+/**
+ * vx_entry_t: flat mode entry, kept in insertion order in entries[]
+ */
+typedef struct vx_entry
+{
+   void *key;
+   void *value;
+   uint32_t hashval;
+   uint32_t deleted;
+} vx_entry_t;
+
+/**
+ * vx_flat_t: flat mode storage. ctrl[] holds the low 7 bits of the hash
+ * for a full slot (or EMPTY/DELETED), slots[] the index into entries[].
+ */
+typedef struct vx_flat
+{
+   uint8_t *ctrl;
+   uint32_t *slots;
+   vx_entry_t *entries;
+   size_t nentries;
+   size_t entries_size;
+   size_t growth_left;
+} vx_flat_t;
+
+/**
+ * vx_table_t: epoch mode publishes the bin array and its size together
+ */
+typedef struct vx_table
+{
+   size_t size;
+   vx_node_t **bins;
+} vx_table_t;
+
+/**
+ * vx_chain_t: the nodes replaced by an epoch mode rehash, freed as a batch
+ */
+typedef struct vx_chain
+{
+   vx_node_t *first;
+   size_t count;
+} vx_chain_t;
+
+/**
+ * vx_image_t: snapshot header, followed by size bin offsets and then one
+ * vx_record_t per entry in iteration order. Offsets count from the start of
+ * the image so it maps anywhere; 0 ends a chain. Integers are in the byte
+ * order of the writer, order tells a reader when that is not its own.
+ */
+typedef struct vx_image
+{
+   char magic[8];
+   uint32_t version;
+   uint32_t order;
+   uint64_t key_size;
+   uint64_t count;
+   uint64_t size;
+   uint64_t algo;
+   uint64_t seed;
+   uint64_t bins;
+   uint64_t records;
+   uint64_t end;
+} vx_image_t;
+
+/**
+ * vx_record_t: followed by the key and the value, each padded to 8 bytes
+ */
+typedef struct vx_record
+{
+   uint64_t link;
+   uint32_t hashval;
+   uint32_t key_len;
+   uint64_t value_len;
+} vx_record_t;
+
 struct vx_hash
 {
    size_t key_size;
@@ -21,12 +165,103 @@ struct vx_hash
    size_t count;
    int flags;
    vx_node_t **bins;
+   vx_node_t **old_bins;
+   size_t old_size;
+   size_t migrate;
    vx_node_t *sentry;
    vx_hash_func_t hash_func;
    vx_hash_cmp_func_t cmp_func;
    vx_hash_free_func_t free_func;
+   vx_hash_algo_t algo;
+   uint64_t seed;
+   vx_flat_t flat;
+   vx_epoch_t *epoch;
+   vx_table_t *table;
+   vx_slab_t *node_slab;
+   vx_slab_t *key_slab;
+   vx_arena_t *key_arena;
+   size_t key_bytes;
+   vx_image_t *image;
+   size_t image_size;
+   vx_hash_size_func_t size_func;
+   size_t max_entries;
+   size_t max_bytes;
+   size_t bytes;
+   vx_hash_stats_t stats;
+   uint64_t rehash_ns;
 };
 
+static size_t hash_size (size_t size);
+static void vx_flat_create (vx_hash_t *hash);
+static void vx_flat_destroy (vx_hash_t *hash);
+static void * vx_flat_put (vx_hash_t *hash, void *key, void *value, uint32_t hash_value);
+static void * vx_flat_get (vx_hash_t *hash, void *key, uint32_t hash_value);
+static void * vx_flat_delete (vx_hash_t *hash, void *key, uint32_t hash_value);
+static int vx_flat_get_next (vx_hash_t *hash, void **key, void **value, void **ptr);
+static void vx_flat_resize (vx_hash_t *hash, size_t size);
+static size_t vx_flat_capacity (size_t count);
+static inline uint32_t vx_flat_match (const uint8_t *ctrl, uint8_t c);
+static void vx_hash_migrate (vx_hash_t *hash, size_t nbins);
+static void vx_hash_rehash_begin (vx_hash_t *hash);
+static void vx_hash_resize (vx_hash_t *hash, size_t size);
+static void vx_hash_resize_epoch (vx_hash_t *hash, size_t size);
+static void * vx_hash_chain_put (vx_hash_t *hash, void *key, void *value, uint32_t hash_value);
+static void * vx_hash_chain_delete (vx_hash_t *hash, void *key, uint32_t hash_value);
+static void * vx_image_get (vx_hash_t *hash, const void *key, uint32_t hash_value);
+static void vx_lru_evict (vx_hash_t *hash, vx_node_t *keep);
+
+/**
+ * vx_hash_probe: count a key lookup, free enough to leave in
+ */
+static inline void vx_hash_probe (vx_hash_t *hash, int hit, size_t probes)
+{
+#ifndef VX_HASH_NO_STATS
+   if (hit)
+   {
+      hash->stats.hits++;
+      hash->stats.hit_probes += probes;
+   }
+   else
+   {
+      hash->stats.misses++;
+      hash->stats.miss_probes += probes;
+   }
+#endif
+}
+
+static inline uint64_t vx_hash_clock (void)
+{
+#ifndef VX_HASH_NO_STATS
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+#else
+   return (0);
+#endif
+}
+
+/**
+ * vx_hash_rehashed: charge the time since start to the current rehash,
+ * which is over once done is set
+ */
+static inline void vx_hash_rehashed (vx_hash_t *hash, uint64_t start, int done)
+{
+#ifndef VX_HASH_NO_STATS
+   uint64_t ns = vx_hash_clock () - start;
+
+   hash->stats.rehash_ns += ns;
+   hash->rehash_ns += ns;
+   if (!done)
+      return;
+   hash->stats.rehashes++;
+   hash->stats.rehash_last_ns = hash->rehash_ns;
+   if (hash->rehash_ns > hash->stats.rehash_max_ns)
+      hash->stats.rehash_max_ns = hash->rehash_ns;
+   hash->rehash_ns = 0;
+#endif
+}
+static int vx_image_get_next (vx_hash_t *hash, void **key, void **value, void **ptr);
+
 vx_hash_t * vx_hash_create (size_t size, size_t key_size, int flags)
 {
    vx_hash_t *hash;
@@ -35,17 +270,90 @@ vx_hash_t * vx_hash_create (size_t size, size_t key_size, int flags)
    hash->size = hash_size(size);
    hash->key_size = key_size;
    hash->flags = flags;
+   hash->count = 0;
+   hash->hash_func = vx_hash_func;
+   hash->cmp_func = vx_hash_cmp_func;
+   if (flags & VX_HASH_SLAB)
+   {
+      if (key_size)
+         hash->key_slab = vx_slab_create (key_size);
+      else
+         hash->key_arena = vx_arena_create ();
+      if (!(flags & VX_HASH_FLAT))
+         hash->node_slab = vx_slab_create (sizeof (vx_node_t));
+   }
+   assert (!((flags & VX_HASH_FLAT) && (flags & VX_HASH_INCREMENTAL)));
+   assert (!((flags & VX_HASH_EPOCH) && (flags & (VX_HASH_FLAT | VX_HASH_INCREMENTAL))));
+   assert (!((flags & VX_HASH_LRU) && (flags & (VX_HASH_FLAT | VX_HASH_EPOCH))));
+   if (flags & VX_HASH_FLAT)
+   {
+      vx_flat_create (hash);
+      return (hash);
+   }
    hash->bins = calloc (hash->size, sizeof(vx_node_t *));
    assert (hash->bins != NULL);
    hash->sentry = calloc (1, sizeof(vx_node_t));
    assert (hash->sentry != NULL);
    hash->sentry->next = hash->sentry->prev = hash->sentry;
-   hash->count = 0;
-   hash->hash_func = vx_hash_func;
-   hash->cmp_func = vx_hash_cmp_func;
+   if (flags & VX_HASH_EPOCH)
+   {
+      hash->epoch = vx_epoch_create ();
+      assert (hash->epoch != NULL);
+      hash->table = malloc (sizeof (vx_table_t));
+      assert (hash->table != NULL);
+      hash->table->size = hash->size;
+      hash->table->bins = hash->bins;
+   }
    return (hash);
 }
 
+vx_epoch_t * vx_hash_epoch (vx_hash_t *hash)
+{
+   return (hash->epoch);
+}
+
+static vx_node_t * vx_hash_node_alloc (vx_hash_t *hash)
+{
+   vx_node_t *node;
+   if (hash->flags & VX_HASH_SLAB)
+   {
+      node = (vx_node_t *) vx_slab_alloc (hash->node_slab);
+      memset (node, 0, sizeof (vx_node_t));
+      return (node);
+   }
+   node = (vx_node_t *) calloc (1, sizeof (vx_node_t));
+   assert (node != NULL);
+   return (node);
+}
+
+static void vx_hash_node_free (vx_hash_t *hash, vx_node_t *node)
+{
+   if (hash->flags & VX_HASH_SLAB)
+      vx_slab_free (hash->node_slab, node);
+   else
+      free (node);
+}
+
+/**
+ * vx_hash_key_free: key_bytes is only read by vx_hash_memory for malloc'd
+ * keys (the slab and arena keep their own counts), so string keys are only
+ * measured when that count is kept or the arena needs the size back
+ */
+static void vx_hash_key_free (vx_hash_t *hash, void *key)
+{
+   if (!(hash->flags & VX_HASH_SLAB))
+   {
+#ifndef VX_HASH_NO_STATS
+      hash->key_bytes -= hash->key_size ? hash->key_size : strlen ((char *) key) + 1;
+#endif
+      free (key);
+   }
+   else if (hash->key_size)
+      vx_slab_free (hash->key_slab, key);
+   else
+      vx_arena_free (hash->key_arena, key, strlen ((char *) key) + 1);
+}
+
 vx_hash_t *vx_hash_new (void)
 {
    return (vx_hash_create (16, 0, VX_HASH_COPY_KEYS));
@@ -54,214 +362,1428 @@ vx_hash_t *vx_hash_new (void)
 void vx_hash_set_hash_func (vx_hash_t *hash, vx_hash_func_t hash_func)
 {
    hash->hash_func = hash_func;
+   hash->algo = VX_HASH_ALGO_FUNC;
 }
 
-void vx_hash_set_free_func (vx_hash_t *hash, vx_hash_free_func_t free_func)
+void vx_hash_set_algo (vx_hash_t *hash, vx_hash_algo_t algo)
 {
-   hash->free_func = free_func;
+   struct timespec ts;
+
+   hash->algo = algo;
+   if (algo == VX_HASH_ALGO_FUNC || hash->seed)
+      return;
+
+#if defined (Linux)
+   if (getrandom (&hash->seed, sizeof (hash->seed), GRND_NONBLOCK) == sizeof (hash->seed))
+      return;
+#endif
+   clock_gettime (CLOCK_REALTIME, &ts);
+   hash->seed = vx_hash_wy (&ts, sizeof (ts), (uint64_t) (uintptr_t) hash);
 }
 
-void * vx_hash_put (vx_hash_t *hash, void *key, void *value)
+void vx_hash_set_seed (vx_hash_t *hash, uint64_t seed)
 {
-   uint32_t hash_value, bindex;
-   vx_node_t *node;
+   hash->seed = seed;
+}
 
-   if (hash->count > hash->size)
-      vx_hash_rehash (hash);
+uint64_t vx_hash_get_seed (vx_hash_t *hash)
+{
+   return (hash->seed);
+}
 
-   hash_value = hash->hash_func (key, hash->key_size);
-   bindex = hash_value & (hash->size - 1);
+/**
+ * vx_hash_key_eq: the default compare for 4 and 8 byte keys is a single
+ * load and compare rather than a memcmp call
+ */
+static inline int vx_hash_key_eq (vx_hash_t *hash, const void *foo, const void *bar)
+{
+   uint64_t a8, b8;
+   uint32_t a4, b4;
 
-   for (node = hash->bins[bindex]; node ; node = node->link)
+   if (hash->cmp_func == vx_hash_cmp_func)
    {
-      if (hash->cmp_func (node->key, key, hash->key_size))
+      switch (hash->key_size)
       {
-         if ((hash->flags & VX_HASH_FREE_VALUE) && hash->free_func)
-            hash->free_func (node->value);
-         node->value = value;
-         return (value);
+      case 8:
+         memcpy (&a8, foo, 8);
+         memcpy (&b8, bar, 8);
+         return (a8 == b8);
+      case 4:
+         memcpy (&a4, foo, 4);
+         memcpy (&b4, bar, 4);
+         return (a4 == b4);
       }
    }
+   return (hash->cmp_func (foo, bar, hash->key_size));
+}
 
-   node = (vx_node_t *) calloc (1, sizeof(vx_node_t));
-
-   node->hashval = hash_value;
-
-   if (hash->flags & VX_HASH_COPY_KEYS)
-      node->key = vx_hash_key_dup (hash, key);
-   else
-      node->key = key;
-   
-   node->value = value;
+void vx_hash_set_free_func (vx_hash_t *hash, vx_hash_free_func_t free_func)
+{
+   hash->free_func = free_func;
+}
 
-   if (hash->bins[bindex] != NULL)
-      node->link = hash->bins[bindex];
-   else
-      node->link = NULL;
+void vx_hash_set_capacity (vx_hash_t *hash, size_t entries, size_t bytes)
+{
+   hash->max_entries = entries;
+   hash->max_bytes = bytes;
+   if (hash->flags & VX_HASH_LRU)
+      vx_lru_evict (hash, NULL);
+}
 
-   hash->bins[bindex] = node;
+void vx_hash_set_size_func (vx_hash_t *hash, vx_hash_size_func_t size_func)
+{
+   hash->size_func = size_func;
+}
 
+/**
+ * vx_lru_touch: move node to the most recently used end of the list
+ */
+static inline void vx_lru_touch (vx_hash_t *hash, vx_node_t *node)
+{
+   if (node->next == hash->sentry)
+      return;
+   node->prev->next = node->next;
+   node->next->prev = node->prev;
    node->next = hash->sentry;
    node->prev = hash->sentry->prev;
    hash->sentry->prev->next = node;
    hash->sentry->prev = node;
+}
 
-   hash->count++;
+/**
+ * vx_lru_charge: bytes a node counts against max_bytes, set when its value is
+ */
+static void vx_lru_charge (vx_hash_t *hash, vx_node_t *node)
+{
+   size_t charge = hash->key_size ? hash->key_size : strlen ((char *) node->key) + 1;
 
-   return (value);
+   if (hash->size_func)
+      charge += hash->size_func (node->value);
+   if (charge > UINT32_MAX)
+      charge = UINT32_MAX;
+   hash->bytes += charge - node->charge;
+   node->charge = (uint32_t) charge;
 }
 
-void * vx_hash_get (vx_hash_t *hash, void *key)
+/**
+ * vx_lru_evict: drop least recently used nodes, other than keep, until the
+ * table is within its capacity
+ */
+static void vx_lru_evict (vx_hash_t *hash, vx_node_t *keep)
 {
-   uint32_t hash_value;
-   uint32_t bindex;
    vx_node_t *node;
-   if (hash == NULL)
-      return (NULL);
-   hash_value = hash->hash_func (key, hash->key_size);
-   bindex = hash_value & (hash->size - 1);
-
-   assert (bindex < hash->size);
+   void *value;
 
-   for (node = hash->bins[bindex]; node ; node = node->link)
+   while ((node = hash->sentry->next) != hash->sentry && node != keep &&
+          ((hash->max_entries && hash->count > hash->max_entries) ||
+           (hash->max_bytes && hash->bytes > hash->max_bytes)))
    {
-      if (hash->cmp_func (node->key, key, hash->key_size))
-         return (node->value);
+      value = vx_hash_chain_delete (hash, node->key, node->hashval);
+      if (hash->free_func)
+         hash->free_func (value);
    }
-   return (NULL);
 }
 
-void * vx_hash_delete (vx_hash_t *hash, void *key)
+/**
+ * vx_hash_find: the link pointing at the node for key, or NULL. While an
+ * incremental resize is running, bins not yet migrated are searched too.
+ */
+static vx_node_t ** vx_hash_find (vx_hash_t *hash, const void *key, uint32_t hash_value)
 {
-   uint32_t hash_value;
-   uint32_t bindex;
-   vx_node_t *node, *prev;
-   void * value;
-   if (hash == NULL) return (NULL);
-
-   hash_value = hash->hash_func (key, hash->key_size);
-   bindex = hash_value & (hash->size - 1);
-
-   assert (bindex < hash->size);
+   vx_node_t **link;
+   size_t bindex, probes = 0;
 
-   for (node = hash->bins[bindex], prev = NULL; node ; prev = node, node = node->link)
+   for (link = &hash->bins[hash_value & (hash->size - 1)]; *link; link = &(*link)->link)
    {
-      if (hash->cmp_func (node->key, key, hash->key_size))
+      probes++;
+      if ((*link)->hashval == hash_value && vx_hash_key_eq (hash, (*link)->key, key))
       {
-         value = node->value;
-         if (prev)
-            prev->link = node->link;
-         else
-            //hash->bins[bindex] = node->link;
-            hash->bins[bindex] = NULL;
+         vx_hash_probe (hash, 1, probes);
+         return (link);
+      }
+   }
 
-         node->prev->next = node->next;
-         node->next->prev = node->prev;
-   
-         if (hash->flags & VX_HASH_COPY_KEYS)
-            free (node->key);
-         free (node);
-         hash->count--;
-         return (value);
+   if (hash->old_bins)
+   {
+      bindex = hash_value & (hash->old_size - 1);
+      for (link = &hash->old_bins[bindex]; bindex >= hash->migrate && *link; link = &(*link)->link)
+      {
+         probes++;
+         if ((*link)->hashval == hash_value && vx_hash_key_eq (hash, (*link)->key, key))
+         {
+            vx_hash_probe (hash, 1, probes);
+            return (link);
+         }
       }
    }
+   vx_hash_probe (hash, 0, probes);
    return (NULL);
 }
 
-int vx_hash_get_next (vx_hash_t *hash, void **key, void **value, void **ptr)
-{
-   vx_node_t *node = (vx_node_t *) (*ptr);
+static inline uint64_t vx_wy_int (uint64_t key, uint64_t seed);
 
-   if (hash == NULL) 
-      return (0);
+/**
+ * vx_hash_hash: 4 and 8 byte keys skip the byte loop of the seeded
+ * algorithms and go through a single multiply-fold mix
+ */
+uint32_t vx_hash_hash (vx_hash_t *hash, const void *key)
+{
+   uint64_t h, k8;
+   uint32_t k4;
 
-   if (node == NULL) 
-      node = hash->sentry->next;
+   if (hash->algo == VX_HASH_ALGO_FUNC)
+      return (hash->hash_func (key, hash->key_size));
 
-   if (node == hash->sentry)
+   if (hash->key_size == 8)
    {
-      *key = *value = *ptr = NULL;
-      return (0);
+      memcpy (&k8, key, 8);
+      h = vx_wy_int (k8, hash->seed);
    }
+   else if (hash->key_size == 4)
+   {
+      memcpy (&k4, key, 4);
+      h = vx_wy_int (k4, hash->seed);
+   }
+   else if (hash->algo == VX_HASH_ALGO_XXH64)
+      h = vx_hash_xxh64 (key, hash->key_size, hash->seed);
+   else
+      h = vx_hash_wy (key, hash->key_size, hash->seed);
 
-   *key = node->key;
-   *value = node->value;
-   *ptr = (void *) node->next;
-
-   return (1);
+   return ((uint32_t) (h ^ (h >> 32)));
 }
 
-void vx_hash_rehash (vx_hash_t *hash)
+void * vx_hash_put (vx_hash_t *hash, void *key, void *value)
 {
-   vx_node_t **newbins;
-   vx_node_t *node;
-   size_t bindex;
-
-   hash->size *= 2;
-   newbins = calloc (hash->size, sizeof (vx_node_t *));
-   assert (newbins != NULL);
-
-   node = hash->sentry;
-   while ((node = node->next) != hash->sentry)
-   {
-      bindex = node->hashval & (hash->size -1);
-      if (newbins[bindex] != NULL)
-         node->link = newbins[bindex];
-      else
-         node->link = NULL;
-
-      newbins[bindex] = node;
-   }
-   free(hash->bins);
-   hash->bins = newbins;
+   return (vx_hash_put_hashed (hash, key, value, vx_hash_hash (hash, key)));
 }
 
-uint32_t vx_hash_func (const void *key, size_t key_size)
+void * vx_hash_put_hashed (vx_hash_t *hash, void *key, void *value, uint32_t hash_value)
 {
-   register const unsigned char *str = (unsigned char *) key;
-   register uint32_t hash = 0;
-
-   if (key_size == 0)
-      key_size = strlen ((char *) key);
+   if (hash->flags & VX_HASH_MAPPED)
+      return (NULL);
+   if (hash->flags & VX_HASH_FLAT)
+      return (vx_flat_put (hash, key, value, hash_value));
 
-   while (key_size--)
+   if (hash->flags & VX_HASH_EPOCH)
    {
-      hash += *str++;
-      hash += (hash << 10);
-      hash ^= (hash >> 6);
+      vx_epoch_lock (hash->epoch);
+      value = vx_hash_chain_put (hash, key, value, hash_value);
+      if (vx_epoch_pending (hash->epoch) >= VX_HASH_RECLAIM_BATCH)
+         vx_epoch_reclaim (hash->epoch);
+      vx_epoch_unlock (hash->epoch);
+      return (value);
    }
-   hash += (hash << 3);
-   hash ^= (hash >> 11);
-   hash += (hash << 15);
+   return (vx_hash_chain_put (hash, key, value, hash_value));
+}
 
-   return (hash);
+static void vx_hash_retire_value (void *arg, void *value)
+{
+   ((vx_hash_t *) arg)->free_func (value);
 }
 
-int vx_hash_cmp_func (const void * foo, const void * bar, size_t key_size)
+static void vx_hash_retire_node (void *arg, void *ptr)
 {
-   if (key_size == 0)
-      return (strcmp((char *) foo, (char *) bar) == 0);
-   else
-      return (memcmp(foo, bar, key_size)) == 0;
+   vx_hash_t *hash = (vx_hash_t *) arg;
+   vx_node_t *node = (vx_node_t *) ptr;
+   if (hash->flags & VX_HASH_COPY_KEYS)
+      vx_hash_key_free (hash, node->key);
+   vx_hash_node_free (hash, node);
 }
 
-void * vx_hash_key_dup (vx_hash_t *hash, void *key)
+static void vx_hash_retire_chain (void *arg, void *ptr)
 {
-   void *ptr = NULL;
-   if (hash->key_size == 0)
-      ptr = (void *) strdup((const char *) key);
-   else
+   vx_chain_t *chain = (vx_chain_t *) ptr;
+   vx_node_t *node, *next;
+
+   for (node = chain->first; chain->count--; node = next)
    {
-      ptr = malloc (hash->key_size);
-      memcpy(ptr, key, hash->key_size);
+      next = node->next;
+      vx_hash_node_free ((vx_hash_t *) arg, node);
    }
-
-   return (ptr);
+   free (chain);
 }
 
-static uint32_t hash_size (uint32_t size)
+static void vx_hash_retire_table (void *arg, void *ptr)
 {
-   uint32_t foo = 1;
+   free (((vx_table_t *) ptr)->bins);
+   free (ptr);
+}
+
+/**
+ * vx_build_t: shared state of a vx_hash_build. Each thread hashes a range
+ * of the input and counts it per owner (counts is nthreads x nthreads),
+ * then scatters its indices into order[] grouped by owner, then inserts the
+ * keys of its own bin range. New nodes land in nodes[] by input index so
+ * the insertion order list can be linked in input order afterwards.
+ */
+typedef struct vx_build
+{
+   vx_hash_t *hash;
+   void **keys;
+   void **values;
+   size_t n;
+   size_t nthreads;
+   uint32_t *hv;
+   size_t *order;
+   size_t *counts;
+   vx_node_t **nodes;
+} vx_build_t;
+
+typedef struct vx_builder
+{
+   vx_build_t *build;
+   size_t id;
+   int phase;
+   size_t added;
+   size_t key_bytes;
+   pthread_t thread;
+} vx_builder_t;
+
+static inline size_t vx_build_owner (vx_build_t *build, uint32_t hash_value)
+{
+   return ((size_t) (((uint64_t) (hash_value & (build->hash->size - 1)) * build->nthreads) /
+                     build->hash->size));
+}
+
+/**
+ * vx_build_insert: put for keys whose bins only this thread touches; no
+ * stats, no shared counters, nothing linked into the insertion order yet
+ */
+static void vx_build_insert (vx_builder_t *builder, size_t ndx)
+{
+   vx_build_t *build = builder->build;
+   vx_hash_t *hash = build->hash;
+   vx_node_t *node, **bin = &hash->bins[build->hv[ndx] & (hash->size - 1)];
+   void *key = build->keys[ndx];
+   size_t size;
+
+   for (node = *bin; node; node = node->link)
+   {
+      if (node->hashval == build->hv[ndx] && vx_hash_key_eq (hash, node->key, key))
+      {
+         if ((hash->flags & VX_HASH_FREE_VALUE) && hash->free_func)
+            hash->free_func (node->value);
+         node->value = build->values[ndx];
+         return;
+      }
+   }
+
+   node = (vx_node_t *) calloc (1, sizeof (vx_node_t));
+   assert (node != NULL);
+   node->hashval = build->hv[ndx];
+   node->value = build->values[ndx];
+   if (hash->flags & VX_HASH_COPY_KEYS)
+   {
+      size = hash->key_size ? hash->key_size : strlen ((char *) key) + 1;
+      node->key = malloc (size);
+      assert (node->key != NULL);
+      memcpy (node->key, key, size);
+      builder->key_bytes += size;
+   }
+   else
+      node->key = key;
+   node->link = *bin;
+   *bin = node;
+   build->nodes[ndx] = node;
+   builder->added++;
+}
+
+static void * vx_build_run (void *arg)
+{
+   vx_builder_t *builder = (vx_builder_t *) arg;
+   vx_build_t *build = builder->build;
+   size_t lo = build->n * builder->id / build->nthreads;
+   size_t hi = build->n * (builder->id + 1) / build->nthreads;
+   size_t *counts = build->counts + builder->id * build->nthreads;
+   size_t ndx;
+
+   switch (builder->phase)
+   {
+   case 0:
+      for (ndx = lo; ndx < hi; ndx++)
+      {
+         build->hv[ndx] = vx_hash_hash (build->hash, build->keys[ndx]);
+         counts[vx_build_owner (build, build->hv[ndx])]++;
+      }
+      break;
+   case 1:
+      for (ndx = lo; ndx < hi; ndx++)
+         build->order[counts[vx_build_owner (build, build->hv[ndx])]++] = ndx;
+      break;
+   default:
+      /* counts now holds where each owner's run of order[] ends */
+      hi = build->counts[(build->nthreads - 1) * build->nthreads + builder->id];
+      lo = builder->id ? build->counts[(build->nthreads - 1) * build->nthreads + builder->id - 1] : 0;
+      for (ndx = lo; ndx < hi; ndx++)
+         vx_build_insert (builder, build->order[ndx]);
+      break;
+   }
+   return (NULL);
+}
+
+/**
+ * vx_build_phase: run one phase on every thread; if a thread can't be
+ * started its share runs on the caller
+ */
+static void vx_build_phase (vx_builder_t *builders, size_t nthreads, int phase)
+{
+   size_t ndx;
+   int *started = calloc (nthreads, sizeof (int));
+
+   assert (started != NULL);
+   for (ndx = 0; ndx < nthreads; ndx++)
+   {
+      builders[ndx].phase = phase;
+      started[ndx] = pthread_create (&builders[ndx].thread, NULL, vx_build_run, &builders[ndx]) == 0;
+   }
+   for (ndx = 0; ndx < nthreads; ndx++)
+   {
+      if (started[ndx])
+         pthread_join (builders[ndx].thread, NULL);
+      else
+         vx_build_run (&builders[ndx]);
+   }
+   free (started);
+}
+
+/**
+ * vx_hash_chain_put: links and values are stored with release semantics so
+ * that epoch mode readers only ever see fully built nodes
+ */
+static void * vx_hash_chain_put (vx_hash_t *hash, void *key, void *value, uint32_t hash_value)
+{
+   uint32_t bindex;
+   vx_node_t *node, **link;
+
+   if (hash->old_bins)
+      vx_hash_migrate (hash, VX_HASH_MIGRATE_STEP);
+
+   if (hash->count > hash->size)
+   {
+      if (hash->flags & VX_HASH_INCREMENTAL)
+         vx_hash_rehash_begin (hash);
+      else
+         vx_hash_resize (hash, hash->size * 2);
+   }
+
+   bindex = hash_value & (hash->size - 1);
+
+   if ((link = vx_hash_find (hash, key, hash_value)) != NULL)
+   {
+      node = *link;
+      if ((hash->flags & VX_HASH_FREE_VALUE) && hash->free_func)
+      {
+         if (hash->flags & VX_HASH_EPOCH)
+            vx_epoch_retire (hash->epoch, node->value, vx_hash_retire_value, hash);
+         else
+            hash->free_func (node->value);
+      }
+      __atomic_store_n (&node->value, value, __ATOMIC_RELEASE);
+      if (hash->flags & VX_HASH_LRU)
+      {
+         vx_lru_touch (hash, node);
+         vx_lru_charge (hash, node);
+         vx_lru_evict (hash, node);
+      }
+      return (value);
+   }
+
+   node = vx_hash_node_alloc (hash);
+
+   node->hashval = hash_value;
+
+   if (hash->flags & VX_HASH_COPY_KEYS)
+      node->key = vx_hash_key_dup (hash, key);
+   else
+      node->key = key;
+   
+   node->value = value;
+
+   if (hash->bins[bindex] != NULL)
+      node->link = hash->bins[bindex];
+   else
+      node->link = NULL;
+
+   __atomic_store_n (&hash->bins[bindex], node, __ATOMIC_RELEASE);
+
+   node->next = hash->sentry;
+   node->prev = hash->sentry->prev;
+   hash->sentry->prev->next = node;
+   hash->sentry->prev = node;
+
+   hash->count++;
+
+   if (hash->flags & VX_HASH_LRU)
+   {
+      vx_lru_charge (hash, node);
+      vx_lru_evict (hash, node);
+   }
+
+   return (value);
+}
+
+void * vx_hash_get (vx_hash_t *hash, void *key)
+{
+   if (hash == NULL)
+      return (NULL);
+   return (vx_hash_get_hashed (hash, key, vx_hash_hash (hash, key)));
+}
+
+/**
+ * vx_hash_epoch_get: lock free lookup, no stores of any kind. The bins and
+ * size come from one published vx_table_t; nodes reachable from it stay
+ * allocated until this reader's next vx_epoch_quiescent.
+ */
+static void * vx_hash_epoch_get (vx_hash_t *hash, const void *key, uint32_t hash_value)
+{
+   vx_table_t *table = __atomic_load_n (&hash->table, __ATOMIC_ACQUIRE);
+   vx_node_t *node;
+
+   node = __atomic_load_n (&table->bins[hash_value & (table->size - 1)], __ATOMIC_ACQUIRE);
+   for (; node; node = __atomic_load_n (&node->link, __ATOMIC_ACQUIRE))
+   {
+      if (node->hashval == hash_value && vx_hash_key_eq (hash, node->key, key))
+         return (__atomic_load_n (&node->value, __ATOMIC_ACQUIRE));
+   }
+   return (NULL);
+}
+
+void * vx_hash_get_hashed (vx_hash_t *hash, void *key, uint32_t hash_value)
+{
+   vx_node_t **link;
+   if (hash->flags & VX_HASH_MAPPED)
+      return (vx_image_get (hash, key, hash_value));
+   if (hash->flags & VX_HASH_FLAT)
+      return (vx_flat_get (hash, key, hash_value));
+   if (hash->flags & VX_HASH_EPOCH)
+      return (vx_hash_epoch_get (hash, key, hash_value));
+   if (hash->old_bins)
+      vx_hash_migrate (hash, VX_HASH_MIGRATE_STEP);
+
+   link = vx_hash_find (hash, key, hash_value);
+   if (link == NULL)
+      return (NULL);
+   if (hash->flags & VX_HASH_LRU)
+      vx_lru_touch (hash, *link);
+   return ((*link)->value);
+}
+
+/**
+ * vx_hash_prefetch: hash up to VX_HASH_BATCH keys and walk them down the
+ * table a level at a time (bin, node, then up to two chain links or the
+ * matching key), issuing a prefetch per key per level so the cache misses
+ * of the whole batch overlap. Nothing is decided here, the
+ * lookups that follow are the ordinary *_hashed calls. With VX_HASH_EPOCH
+ * the walk reads the table and nodes, so the caller must be a registered
+ * reader or hold the writer lock.
+ */
+static void vx_hash_prefetch (vx_hash_t *hash, void **keys, uint32_t *hv, size_t n)
+{
+   const void *addr[VX_HASH_BATCH];
+   const vx_node_t *node;
+   vx_node_t **bins;
+   vx_table_t *table;
+   const vx_record_t *record;
+   const uint64_t *offs;
+   size_t ndx, mask, pos;
+   uint32_t bits;
+   int level;
+
+   for (ndx = 0; ndx < n; ndx++)
+      hv[ndx] = vx_hash_hash (hash, keys[ndx]);
+
+   if (hash->flags & VX_HASH_FLAT)
+   {
+      mask = hash->size / VX_FLAT_GROUP - 1;
+      for (ndx = 0; ndx < n; ndx++)
+      {
+         addr[ndx] = hash->flat.ctrl + (VX_FLAT_H1(hv[ndx]) & mask) * VX_FLAT_GROUP;
+         __builtin_prefetch (addr[ndx]);
+      }
+      for (ndx = 0; ndx < n; ndx++)
+      {
+         bits = vx_flat_match ((const uint8_t *) addr[ndx], VX_FLAT_H2(hv[ndx]));
+         pos = (const uint8_t *) addr[ndx] - hash->flat.ctrl + (bits ? __builtin_ctz (bits) : 0);
+         addr[ndx] = bits ? &hash->flat.slots[pos] : NULL;
+         if (addr[ndx])
+            __builtin_prefetch (addr[ndx]);
+      }
+      for (ndx = 0; ndx < n; ndx++)
+      {
+         if (addr[ndx])
+            __builtin_prefetch (&hash->flat.entries[*(const uint32_t *) addr[ndx]]);
+      }
+      return;
+   }
+
+   if (hash->flags & VX_HASH_MAPPED)
+   {
+      offs = (const uint64_t *) ((const char *) hash->image + hash->image->bins);
+      for (ndx = 0; ndx < n; ndx++)
+         __builtin_prefetch (&offs[hv[ndx] & (hash->size - 1)]);
+      for (ndx = 0; ndx < n; ndx++)
+      {
+         if (offs[hv[ndx] & (hash->size - 1)] == 0)
+            continue;
+         record = (const vx_record_t *) ((const char *) hash->image + offs[hv[ndx] & (hash->size - 1)]);
+         __builtin_prefetch (record);
+      }
+      return;
+   }
+
+   if (hash->flags & VX_HASH_EPOCH)
+   {
+      table = __atomic_load_n (&hash->table, __ATOMIC_ACQUIRE);
+      bins = table->bins;
+      mask = table->size - 1;
+   }
+   else
+   {
+      bins = hash->bins;
+      mask = hash->size - 1;
+   }
+
+   for (ndx = 0; ndx < n; ndx++)
+   {
+      addr[ndx] = &bins[hv[ndx] & mask];
+      __builtin_prefetch (addr[ndx]);
+   }
+   for (ndx = 0; ndx < n; ndx++)
+   {
+      addr[ndx] = __atomic_load_n ((vx_node_t **) addr[ndx], __ATOMIC_ACQUIRE);
+      if (addr[ndx])
+         __builtin_prefetch (addr[ndx]);
+   }
+   for (level = 0; level < 2; level++)
+   {
+      for (ndx = 0; ndx < n; ndx++)
+      {
+         if ((node = (const vx_node_t *) addr[ndx]) == NULL)
+            continue;
+         if (node->hashval == hv[ndx])
+         {
+            __builtin_prefetch (node->key);
+            addr[ndx] = NULL;
+         }
+         else if ((addr[ndx] = __atomic_load_n (&node->link, __ATOMIC_ACQUIRE)) != NULL)
+            __builtin_prefetch (addr[ndx]);
+      }
+   }
+}
+
+size_t vx_hash_get_batch (vx_hash_t *hash, void **keys, void **values, size_t n)
+{
+   uint32_t hv[VX_HASH_BATCH];
+   size_t base, ndx, count, found = 0;
+
+   for (base = 0; base < n; base += count)
+   {
+      count = n - base < VX_HASH_BATCH ? n - base : VX_HASH_BATCH;
+      vx_hash_prefetch (hash, keys + base, hv, count);
+      for (ndx = 0; ndx < count; ndx++)
+      {
+         values[base + ndx] = vx_hash_get_hashed (hash, keys[base + ndx], hv[ndx]);
+         if (values[base + ndx])
+            found++;
+      }
+   }
+   return (found);
+}
+
+void vx_hash_put_batch (vx_hash_t *hash, void **keys, void **values, size_t n)
+{
+   uint32_t hv[VX_HASH_BATCH];
+   size_t base, ndx, count;
+
+   for (base = 0; base < n; base += count)
+   {
+      count = n - base < VX_HASH_BATCH ? n - base : VX_HASH_BATCH;
+      /* a writer need not be a registered reader: hold off retired nodes */
+      if (hash->flags & VX_HASH_EPOCH)
+         vx_epoch_lock (hash->epoch);
+      vx_hash_prefetch (hash, keys + base, hv, count);
+      if (hash->flags & VX_HASH_EPOCH)
+         vx_epoch_unlock (hash->epoch);
+      for (ndx = 0; ndx < count; ndx++)
+         vx_hash_put_hashed (hash, keys[base + ndx], values[base + ndx], hv[ndx]);
+   }
+}
+
+void * vx_hash_delete (vx_hash_t *hash, void *key)
+{
+   if (hash == NULL) return (NULL);
+   return (vx_hash_delete_hashed (hash, key, vx_hash_hash (hash, key)));
+}
+
+void * vx_hash_delete_hashed (vx_hash_t *hash, void *key, uint32_t hash_value)
+{
+   void *value;
+   if (hash->flags & VX_HASH_MAPPED)
+      return (NULL);
+   if (hash->flags & VX_HASH_FLAT)
+      return (vx_flat_delete (hash, key, hash_value));
+   if (hash->flags & VX_HASH_EPOCH)
+   {
+      vx_epoch_lock (hash->epoch);
+      value = vx_hash_chain_delete (hash, key, hash_value);
+      if (vx_epoch_pending (hash->epoch) >= VX_HASH_RECLAIM_BATCH)
+         vx_epoch_reclaim (hash->epoch);
+      vx_epoch_unlock (hash->epoch);
+      return (value);
+   }
+   return (vx_hash_chain_delete (hash, key, hash_value));
+}
+
+static void * vx_hash_chain_delete (vx_hash_t *hash, void *key, uint32_t hash_value)
+{
+   vx_node_t *node, **link;
+   void * value;
+   if (hash->old_bins)
+      vx_hash_migrate (hash, VX_HASH_MIGRATE_STEP);
+
+   link = vx_hash_find (hash, key, hash_value);
+   if (link == NULL)
+      return (NULL);
+
+   node = *link;
+   value = node->value;
+   __atomic_store_n (link, node->link, __ATOMIC_RELEASE);
+
+   node->prev->next = node->next;
+   node->next->prev = node->prev;
+   hash->bytes -= node->charge;
+
+   if (hash->flags & VX_HASH_EPOCH)
+      vx_epoch_retire (hash->epoch, node, vx_hash_retire_node, hash);
+   else
+   {
+      if (hash->flags & VX_HASH_COPY_KEYS)
+         vx_hash_key_free (hash, node->key);
+      vx_hash_node_free (hash, node);
+   }
+   hash->count--;
+   return (value);
+}
+
+int vx_hash_get_next (vx_hash_t *hash, void **key, void **value, void **ptr)
+{
+   vx_node_t *node = (vx_node_t *) (*ptr);
+
+   if (hash == NULL) 
+      return (0);
+
+   if (hash->flags & VX_HASH_MAPPED)
+      return (vx_image_get_next (hash, key, value, ptr));
+
+   if (hash->flags & VX_HASH_FLAT)
+      return (vx_flat_get_next (hash, key, value, ptr));
+
+   if (node == NULL) 
+      node = hash->sentry->next;
+
+   if (node == hash->sentry)
+   {
+      *key = *value = *ptr = NULL;
+      return (0);
+   }
+
+   *key = node->key;
+   *value = node->value;
+   *ptr = (void *) node->next;
+
+   return (1);
+}
+
+size_t vx_hash_split (vx_hash_t *hash, vx_hash_range_t *ranges, size_t k)
+{
+   size_t ndx, units;
+
+   if (hash->old_bins)
+      vx_hash_migrate (hash, hash->old_size);
+
+   units = (hash->flags & VX_HASH_FLAT) ? hash->flat.nentries : hash->size;
+   if (k > units)
+      k = units;
+   for (ndx = 0; ndx < k; ndx++)
+   {
+      ranges[ndx].begin = ranges[ndx].pos = units * ndx / k;
+      ranges[ndx].end = units * (ndx + 1) / k;
+      ranges[ndx].node = NULL;
+   }
+   return (k);
+}
+
+/**
+ * vx_hash_range_next: pos is the next bin (flat: entry) to start on, node
+ * the rest of the chain being walked (mapped: its record offset)
+ */
+int vx_hash_range_next (vx_hash_t *hash, vx_hash_range_t *range, void **key, void **value)
+{
+   vx_node_t *node = (vx_node_t *) range->node;
+   const char *base = (const char *) hash->image;
+   const uint64_t *offs;
+   vx_record_t *record;
+   vx_entry_t *entry;
+   uint64_t off;
+
+   if (hash->flags & VX_HASH_FLAT)
+   {
+      for (; range->pos < range->end; range->pos++)
+      {
+         entry = &hash->flat.entries[range->pos];
+         if (entry->deleted)
+            continue;
+         *key = entry->key;
+         *value = entry->value;
+         range->pos++;
+         return (1);
+      }
+      return (0);
+   }
+
+   if (hash->flags & VX_HASH_MAPPED)
+   {
+      offs = (const uint64_t *) (base + hash->image->bins);
+      off = (uint64_t) (uintptr_t) range->node;
+      while (off == 0)
+      {
+         if (range->pos >= range->end)
+            return (0);
+         off = offs[range->pos++];
+      }
+      record = (vx_record_t *) (base + off);
+      *key = record + 1;
+      *value = (char *) (record + 1) + VX_IMAGE_ALIGN (record->key_len);
+      range->node = (void *) (uintptr_t) record->link;
+      return (1);
+   }
+
+   while (node == NULL)
+   {
+      if (range->pos >= range->end)
+         return (0);
+      node = hash->bins[range->pos++];
+   }
+   *key = node->key;
+   *value = node->value;
+   range->node = node->link;
+   return (1);
+}
+
+/**
+ * vx_sweep_t: shared state of a vx_hash_foreach_parallel, threads claim
+ * ranges by bumping next
+ */
+typedef struct vx_sweep
+{
+   vx_hash_t *hash;
+   vx_hash_foreach_func_t func;
+   void *arg;
+   vx_hash_range_t *ranges;
+   size_t nranges;
+   size_t next;
+   int stop;
+} vx_sweep_t;
+
+static void * vx_sweep_run (void *arg)
+{
+   vx_sweep_t *sweep = (vx_sweep_t *) arg;
+   vx_hash_range_t *range;
+   void *key, *value;
+   size_t ndx;
+
+   while (!__atomic_load_n (&sweep->stop, __ATOMIC_RELAXED) &&
+          (ndx = __atomic_fetch_add (&sweep->next, 1, __ATOMIC_RELAXED)) < sweep->nranges)
+   {
+      range = &sweep->ranges[ndx];
+      while (vx_hash_range_next (sweep->hash, range, &key, &value))
+      {
+         if (!sweep->func (key, value, sweep->arg))
+         {
+            __atomic_store_n (&sweep->stop, 1, __ATOMIC_RELAXED);
+            break;
+         }
+      }
+   }
+   return (NULL);
+}
+
+void vx_hash_foreach_parallel (vx_hash_t *hash, vx_hash_foreach_func_t func, void *arg, int nthreads)
+{
+   vx_sweep_t sweep;
+   pthread_t *threads;
+   int *started;
+   int ndx;
+
+   if (nthreads <= 0)
+      nthreads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+   if (nthreads < 1)
+      nthreads = 1;
+
+   sweep.hash = hash;
+   sweep.func = func;
+   sweep.arg = arg;
+   sweep.next = 0;
+   sweep.stop = 0;
+   sweep.ranges = malloc (nthreads * VX_HASH_RANGES * sizeof (vx_hash_range_t));
+   threads = malloc (nthreads * sizeof (pthread_t));
+   started = calloc (nthreads, sizeof (int));
+   assert (sweep.ranges && threads && started);
+   sweep.nranges = vx_hash_split (hash, sweep.ranges, nthreads * VX_HASH_RANGES);
+
+   /* the caller is one of the threads */
+   for (ndx = 1; ndx < nthreads; ndx++)
+      started[ndx] = pthread_create (&threads[ndx], NULL, vx_sweep_run, &sweep) == 0;
+   vx_sweep_run (&sweep);
+   for (ndx = 1; ndx < nthreads; ndx++)
+   {
+      if (started[ndx])
+         pthread_join (threads[ndx], NULL);
+   }
+
+   free (started);
+   free (threads);
+   free (sweep.ranges);
+}
+
+void vx_hash_rehash (vx_hash_t *hash)
+{
+   if (hash->flags & VX_HASH_MAPPED)
+      return;
+   if (hash->flags & VX_HASH_FLAT)
+      vx_flat_resize (hash, hash->size * 2);
+   else if (hash->flags & VX_HASH_EPOCH)
+   {
+      vx_epoch_lock (hash->epoch);
+      vx_hash_resize (hash, hash->size * 2);
+      vx_epoch_reclaim (hash->epoch);
+      vx_epoch_unlock (hash->epoch);
+   }
+   else
+      vx_hash_resize (hash, hash->size * 2);
+}
+
+/**
+ * vx_hash_fit: resize to size bins (flat: slots) and entries[] to at least
+ * count, finishing any incremental resize first
+ */
+static void vx_hash_fit (vx_hash_t *hash, size_t size, size_t count)
+{
+   vx_flat_t *flat = &hash->flat;
+
+   if (hash->flags & VX_HASH_FLAT)
+   {
+      vx_flat_resize (hash, size);
+      count = count > flat->nentries ? count : flat->nentries;
+      flat->entries_size = count > VX_FLAT_GROUP ? count : VX_FLAT_GROUP;
+      flat->entries = realloc (flat->entries, flat->entries_size * sizeof (vx_entry_t));
+      assert (flat->entries != NULL);
+      return;
+   }
+   if (hash->flags & VX_HASH_EPOCH)
+   {
+      vx_epoch_lock (hash->epoch);
+      vx_hash_resize (hash, size);
+      vx_epoch_reclaim (hash->epoch);
+      vx_epoch_unlock (hash->epoch);
+      return;
+   }
+   if (hash->old_bins)
+      vx_hash_migrate (hash, hash->old_size);
+   vx_hash_resize (hash, size);
+}
+
+void vx_hash_reserve (vx_hash_t *hash, size_t count)
+{
+   size_t size;
+
+   if (hash->flags & VX_HASH_MAPPED)
+      return;
+   if (hash->flags & VX_HASH_FLAT)
+   {
+      size = vx_flat_capacity (count);
+      if (size > hash->size || count > hash->flat.entries_size)
+         vx_hash_fit (hash, size > hash->size ? size : hash->size, count);
+      return;
+   }
+   if ((size = hash_size (count)) > hash->size)
+      vx_hash_fit (hash, size, count);
+}
+
+void vx_hash_shrink (vx_hash_t *hash)
+{
+   if (hash->flags & VX_HASH_MAPPED)
+      return;
+   if (hash->flags & VX_HASH_FLAT)
+      vx_hash_fit (hash, vx_flat_capacity (hash->count), hash->count);
+   else if (hash_size (hash->count) < hash->size || hash->old_bins)
+      vx_hash_fit (hash, hash_size (hash->count), hash->count);
+}
+
+void vx_hash_build (vx_hash_t *hash, void **keys, void **values, size_t n, int nthreads)
+{
+   vx_build_t build;
+   vx_builder_t *builders;
+   vx_node_t *node;
+   size_t ndx, owner, off, count;
+
+   if (nthreads <= 0)
+      nthreads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+   if ((size_t) nthreads > n / VX_HASH_BUILD_MIN)
+      nthreads = (int) (n / VX_HASH_BUILD_MIN);
+
+   vx_hash_reserve (hash, hash->count + n);
+
+   /* only plain chained tables are split up, the rest hash in bulk and put */
+   if (nthreads < 2 ||
+       (hash->flags & (VX_HASH_FLAT | VX_HASH_EPOCH | VX_HASH_LRU | VX_HASH_SLAB | VX_HASH_MAPPED)))
+   {
+      vx_hash_put_batch (hash, keys, values, n);
+      return;
+   }
+   if (hash->old_bins)
+      vx_hash_migrate (hash, hash->old_size);
+
+   build.hash = hash;
+   build.keys = keys;
+   build.values = values;
+   build.n = n;
+   build.nthreads = (size_t) nthreads;
+   build.hv = malloc (n * sizeof (uint32_t));
+   build.order = malloc (n * sizeof (size_t));
+   build.counts = calloc (build.nthreads * build.nthreads, sizeof (size_t));
+   build.nodes = calloc (n, sizeof (vx_node_t *));
+   builders = calloc (build.nthreads, sizeof (vx_builder_t));
+   assert (build.hv && build.order && build.counts && build.nodes && builders);
+   for (ndx = 0; ndx < build.nthreads; ndx++)
+   {
+      builders[ndx].build = &build;
+      builders[ndx].id = ndx;
+   }
+
+   vx_build_phase (builders, build.nthreads, 0);
+
+   /* per thread counts become offsets: owner runs in order, threads within */
+   for (owner = 0, off = 0; owner < build.nthreads; owner++)
+   {
+      for (ndx = 0; ndx < build.nthreads; ndx++)
+      {
+         count = build.counts[ndx * build.nthreads + owner];
+         build.counts[ndx * build.nthreads + owner] = off;
+         off += count;
+      }
+   }
+
+   vx_build_phase (builders, build.nthreads, 1);
+   vx_build_phase (builders, build.nthreads, 2);
+
+   for (ndx = 0; ndx < build.nthreads; ndx++)
+   {
+      hash->count += builders[ndx].added;
+#ifndef VX_HASH_NO_STATS
+      hash->key_bytes += builders[ndx].key_bytes;
+#endif
+   }
+   for (ndx = 0; ndx < n; ndx++)
+   {
+      if ((node = build.nodes[ndx]) == NULL)
+         continue;
+      node->next = hash->sentry;
+      node->prev = hash->sentry->prev;
+      hash->sentry->prev->next = node;
+      hash->sentry->prev = node;
+   }
+
+   free (builders);
+   free (build.nodes);
+   free (build.counts);
+   free (build.order);
+   free (build.hv);
+}
+
+/**
+ * vx_hash_resize: rebuild the chains over size bins in one go
+ */
+static void vx_hash_resize (vx_hash_t *hash, size_t size)
+{
+   vx_node_t **newbins;
+   vx_node_t *node;
+   size_t bindex;
+   uint64_t start = vx_hash_clock ();
+
+   if (hash->flags & VX_HASH_EPOCH)
+   {
+      vx_hash_resize_epoch (hash, size);
+      vx_hash_rehashed (hash, start, 1);
+      return;
+   }
+
+   /* close out a pending migration so old_size, migrate and its timing
+      are settled before the rebuild */
+   if (hash->old_bins)
+      vx_hash_migrate (hash, hash->old_size);
+
+   hash->size = size;
+   newbins = calloc (hash->size, sizeof (vx_node_t *));
+   assert (newbins != NULL);
+
+   node = hash->sentry;
+   while ((node = node->next) != hash->sentry)
+   {
+      bindex = node->hashval & (hash->size -1);
+      if (newbins[bindex] != NULL)
+         node->link = newbins[bindex];
+      else
+         node->link = NULL;
+
+      newbins[bindex] = node;
+   }
+   free(hash->bins);
+   hash->bins = newbins;
+   vx_hash_rehashed (hash, start, 1);
+}
+
+/**
+ * vx_hash_resize_epoch: readers may be walking the current chains, so
+ * rather than relinking nodes in place every node is copied into a new
+ * table which is then published; the old table and nodes are retired
+ */
+static void vx_hash_resize_epoch (vx_hash_t *hash, size_t size)
+{
+   vx_table_t *table, *old = hash->table;
+   vx_chain_t *chain;
+   vx_node_t *node, *copy, *tail;
+   size_t bindex;
+
+   table = malloc (sizeof (vx_table_t));
+   assert (table != NULL);
+   table->size = size;
+   table->bins = calloc (table->size, sizeof (vx_node_t *));
+   assert (table->bins != NULL);
+
+   chain = malloc (sizeof (vx_chain_t));
+   assert (chain != NULL);
+   chain->first = hash->sentry->next;
+   chain->count = hash->count;
+
+   /* old nodes keep their next pointers, so the walk is unaffected */
+   tail = hash->sentry;
+   for (node = chain->first; node != hash->sentry; node = node->next)
+   {
+      copy = vx_hash_node_alloc (hash);
+      *copy = *node;
+      bindex = copy->hashval & (table->size - 1);
+      copy->link = table->bins[bindex];
+      table->bins[bindex] = copy;
+      copy->prev = tail;
+      tail->next = copy;
+      tail = copy;
+   }
+   tail->next = hash->sentry;
+   hash->sentry->prev = tail;
+
+   __atomic_store_n (&hash->table, table, __ATOMIC_RELEASE);
+   hash->bins = table->bins;
+   hash->size = table->size;
+
+   vx_epoch_retire (hash->epoch, old, vx_hash_retire_table, hash);
+   vx_epoch_retire (hash->epoch, chain, vx_hash_retire_chain, hash);
+}
+
+/**
+ * vx_hash_rehash_begin: swap in a doubled bin array and leave the old one
+ * to be drained VX_HASH_MIGRATE_STEP bins at a time by later operations
+ */
+static void vx_hash_rehash_begin (vx_hash_t *hash)
+{
+   uint64_t start;
+
+   if (hash->old_bins)
+      vx_hash_migrate (hash, hash->old_size);
+
+   start = vx_hash_clock ();
+   hash->old_bins = hash->bins;
+   hash->old_size = hash->size;
+   hash->migrate = 0;
+
+   hash->size *= 2;
+   hash->bins = calloc (hash->size, sizeof (vx_node_t *));
+   assert (hash->bins != NULL);
+   vx_hash_rehashed (hash, start, 0);
+}
+
+static void vx_hash_migrate (vx_hash_t *hash, size_t nbins)
+{
+   vx_node_t *node, *next;
+   size_t bindex;
+   uint64_t start = vx_hash_clock ();
+
+   for (; nbins && hash->migrate < hash->old_size; nbins--, hash->migrate++)
+   {
+      for (node = hash->old_bins[hash->migrate]; node; node = next)
+      {
+         next = node->link;
+         bindex = node->hashval & (hash->size - 1);
+         node->link = hash->bins[bindex];
+         hash->bins[bindex] = node;
+      }
+      hash->old_bins[hash->migrate] = NULL;
+   }
+
+   if (hash->migrate == hash->old_size)
+   {
+      free (hash->old_bins);
+      hash->old_bins = NULL;
+      hash->old_size = 0;
+      hash->migrate = 0;
+   }
+   vx_hash_rehashed (hash, start, hash->old_bins == NULL);
+}
+
+uint32_t vx_hash_func (const void *key, size_t key_size)
+{
+   register const unsigned char *str = (unsigned char *) key;
+   register uint32_t hash = 0;
+
+   if (key_size == 0)
+      key_size = strlen ((char *) key);
+
+   while (key_size--)
+   {
+      hash += *str++;
+      hash += (hash << 10);
+      hash ^= (hash >> 6);
+   }
+   hash += (hash << 3);
+   hash ^= (hash >> 11);
+   hash += (hash << 15);
+
+   return (hash);
+}
+
+#ifdef __SIZEOF_INT128__
+__extension__ typedef unsigned __int128 vx_u128_t;
+#endif
+
+/**
+ * vx_wy_mum: 64x64 -> 128 bit multiply, low and high halves in a and b
+ */
+static inline void vx_wy_mum (uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+   vx_u128_t r = (vx_u128_t) *a * *b;
+   *a = (uint64_t) r;
+   *b = (uint64_t) (r >> 64);
+#else
+   uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t) *a, lb = (uint32_t) *b;
+   uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+   uint64_t t = rl + (rm0 << 32), lo, hi;
+   uint64_t c = t < rl;
+   lo = t + (rm1 << 32);
+   c += lo < t;
+   hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+   *a = lo;
+   *b = hi;
+#endif
+}
+
+static inline uint64_t vx_wy_mix (uint64_t a, uint64_t b)
+{
+   vx_wy_mum (&a, &b);
+   return (a ^ b);
+}
+
+static inline uint64_t vx_r8 (const uint8_t *p)
+{
+   uint64_t v;
+   memcpy (&v, p, 8);
+   return (v);
+}
+
+static inline uint64_t vx_r4 (const uint8_t *p)
+{
+   uint32_t v;
+   memcpy (&v, p, 4);
+   return (v);
+}
+
+static inline uint64_t vx_rotl (uint64_t x, int r)
+{
+   return ((x << r) | (x >> (64 - r)));
+}
+
+static inline uint64_t vx_wy_int (uint64_t key, uint64_t seed)
+{
+   uint64_t a = key ^ VX_WY0, b = seed ^ VX_WY1;
+   vx_wy_mum (&a, &b);
+   return (vx_wy_mix (a ^ VX_WY0, b ^ VX_WY1));
+}
+
+/**
+ * vx_hash_wy: wyhash, 48 bytes per step over three lanes
+ */
+uint64_t vx_hash_wy (const void *key, size_t key_size, uint64_t seed)
+{
+   const uint8_t *p = (const uint8_t *) key;
+   uint64_t a, b, see1, see2;
+   size_t i;
+
+   if (key_size == 0)
+      key_size = strlen ((const char *) key);
+
+   seed ^= vx_wy_mix (seed ^ VX_WY0, VX_WY1);
+   if (key_size <= 16)
+   {
+      if (key_size >= 4)
+      {
+         a = (vx_r4 (p) << 32) | vx_r4 (p + ((key_size >> 3) << 2));
+         b = (vx_r4 (p + key_size - 4) << 32) | vx_r4 (p + key_size - 4 - ((key_size >> 3) << 2));
+      }
+      else if (key_size > 0)
+      {
+         a = ((uint64_t) p[0] << 16) | ((uint64_t) p[key_size >> 1] << 8) | p[key_size - 1];
+         b = 0;
+      }
+      else
+         a = b = 0;
+   }
+   else
+   {
+      i = key_size;
+      if (i > 48)
+      {
+         see1 = see2 = seed;
+         do
+         {
+            seed = vx_wy_mix (vx_r8 (p) ^ VX_WY1, vx_r8 (p + 8) ^ seed);
+            see1 = vx_wy_mix (vx_r8 (p + 16) ^ VX_WY2, vx_r8 (p + 24) ^ see1);
+            see2 = vx_wy_mix (vx_r8 (p + 32) ^ VX_WY3, vx_r8 (p + 40) ^ see2);
+            p += 48;
+            i -= 48;
+         } while (i > 48);
+         seed ^= see1 ^ see2;
+      }
+      while (i > 16)
+      {
+         seed = vx_wy_mix (vx_r8 (p) ^ VX_WY1, vx_r8 (p + 8) ^ seed);
+         i -= 16;
+         p += 16;
+      }
+      a = vx_r8 (p + i - 16);
+      b = vx_r8 (p + i - 8);
+   }
+   a ^= VX_WY1;
+   b ^= seed;
+   vx_wy_mum (&a, &b);
+   return (vx_wy_mix (a ^ VX_WY0 ^ key_size, b ^ VX_WY1));
+}
+
+static inline uint64_t vx_xx_round (uint64_t acc, uint64_t input)
+{
+   acc += input * VX_XX2;
+   acc = vx_rotl (acc, 31);
+   return (acc * VX_XX1);
+}
+
+static inline uint64_t vx_xx_merge (uint64_t acc, uint64_t val)
+{
+   acc ^= vx_xx_round (0, val);
+   return (acc * VX_XX1 + VX_XX4);
+}
+
+/**
+ * vx_hash_xxh64: xxHash64, 32 bytes per step over four lanes
+ */
+uint64_t vx_hash_xxh64 (const void *key, size_t key_size, uint64_t seed)
+{
+   const uint8_t *p = (const uint8_t *) key;
+   const uint8_t *end;
+   uint64_t h, v1, v2, v3, v4;
+
+   if (key_size == 0)
+      key_size = strlen ((const char *) key);
+   end = p + key_size;
+
+   if (key_size >= 32)
+   {
+      v1 = seed + VX_XX1 + VX_XX2;
+      v2 = seed + VX_XX2;
+      v3 = seed;
+      v4 = seed - VX_XX1;
+      do
+      {
+         v1 = vx_xx_round (v1, vx_r8 (p));
+         v2 = vx_xx_round (v2, vx_r8 (p + 8));
+         v3 = vx_xx_round (v3, vx_r8 (p + 16));
+         v4 = vx_xx_round (v4, vx_r8 (p + 24));
+         p += 32;
+      } while (p + 32 <= end);
+      h = vx_rotl (v1, 1) + vx_rotl (v2, 7) + vx_rotl (v3, 12) + vx_rotl (v4, 18);
+      h = vx_xx_merge (h, v1);
+      h = vx_xx_merge (h, v2);
+      h = vx_xx_merge (h, v3);
+      h = vx_xx_merge (h, v4);
+   }
+   else
+      h = seed + VX_XX5;
+
+   h += key_size;
+   for (; p + 8 <= end; p += 8)
+   {
+      h ^= vx_xx_round (0, vx_r8 (p));
+      h = vx_rotl (h, 27) * VX_XX1 + VX_XX4;
+   }
+   if (p + 4 <= end)
+   {
+      h ^= vx_r4 (p) * VX_XX1;
+      h = vx_rotl (h, 23) * VX_XX2 + VX_XX3;
+      p += 4;
+   }
+   for (; p < end; p++)
+   {
+      h ^= *p * VX_XX5;
+      h = vx_rotl (h, 11) * VX_XX1;
+   }
+   h ^= h >> 33;
+   h *= VX_XX2;
+   h ^= h >> 29;
+   h *= VX_XX3;
+   h ^= h >> 32;
+   return (h);
+}
+
+int vx_hash_cmp_func (const void * foo, const void * bar, size_t key_size)
+{
+   if (key_size == 0)
+      return (strcmp((char *) foo, (char *) bar) == 0);
+   else
+      return (memcmp(foo, bar, key_size)) == 0;
+}
+
+void * vx_hash_key_dup (vx_hash_t *hash, void *key)
+{
+   void *ptr = NULL;
+   size_t size = hash->key_size ? hash->key_size : strlen ((char *) key) + 1;
+
+   if (!(hash->flags & VX_HASH_SLAB))
+      ptr = malloc (size);
+   else if (hash->key_size)
+      ptr = vx_slab_alloc (hash->key_slab);
+   else
+      ptr = vx_arena_alloc (hash->key_arena, size);
+   assert (ptr != NULL);
+   memcpy(ptr, key, size);
+#ifndef VX_HASH_NO_STATS
+   if (!(hash->flags & VX_HASH_SLAB))
+      hash->key_bytes += size;
+#endif
+
+   return (ptr);
+}
+
+static size_t hash_size (size_t size)
+{
+   size_t foo = 1;
    while (foo < size)
       foo <<= 1;
    return foo;
@@ -277,92 +1799,624 @@ size_t vx_hash_size (vx_hash_t *hash)
    return (hash->size);
 }
 
+void vx_hash_memory (vx_hash_t *hash, size_t *used, size_t *reserved)
+{
+   size_t base = sizeof (vx_hash_t), u, r;
+
+   if (hash->flags & VX_HASH_MAPPED)
+   {
+      *used = *reserved = base + hash->image_size;
+      return;
+   }
+
+   if (hash->flags & VX_HASH_FLAT)
+      base += hash->size * (1 + sizeof (uint32_t)) + hash->flat.entries_size * sizeof (vx_entry_t);
+   else
+      base += (hash->size + hash->old_size) * sizeof (vx_node_t *) + sizeof (vx_node_t);
+
+   if (!(hash->flags & VX_HASH_SLAB))
+   {
+      *used = *reserved = base + hash->key_bytes +
+         ((hash->flags & VX_HASH_FLAT) ? 0 : hash->count * sizeof (vx_node_t));
+      return;
+   }
+
+   *used = *reserved = base;
+   if (hash->node_slab)
+   {
+      vx_slab_stats (hash->node_slab, &u, &r);
+      *used += u;
+      *reserved += r;
+   }
+   if (hash->key_slab)
+      vx_slab_stats (hash->key_slab, &u, &r);
+   else
+      vx_arena_stats (hash->key_arena, &u, &r);
+   *used += u;
+   *reserved += r;
+}
+
+static void vx_hash_hist_chains (vx_hash_stats_t *stats, vx_node_t **bins, size_t from, size_t to)
+{
+   vx_node_t *node;
+   size_t len;
+
+   for (; from < to; from++)
+   {
+      for (len = 0, node = bins[from]; node; node = node->link)
+         len++;
+      stats->hist[len < VX_HASH_HIST ? len : VX_HASH_HIST - 1]++;
+   }
+}
+
+/**
+ * vx_hash_hist_flat: steps along the probe sequence from each entry's home
+ * group to the group it sits in
+ */
+static void vx_hash_hist_flat (vx_hash_t *hash, vx_hash_stats_t *stats)
+{
+   size_t mask = hash->size / VX_FLAT_GROUP - 1;
+   size_t pos, group, step;
+
+   for (pos = 0; pos < hash->size; pos++)
+   {
+      if (hash->flat.ctrl[pos] & 0x80)
+         continue;
+      group = VX_FLAT_H1(hash->flat.entries[hash->flat.slots[pos]].hashval) & mask;
+      for (step = 0; group != pos / VX_FLAT_GROUP; )
+         group = (group + ++step) & mask;
+      stats->hist[step < VX_HASH_HIST ? step : VX_HASH_HIST - 1]++;
+   }
+}
+
+static void vx_hash_hist_image (vx_hash_t *hash, vx_hash_stats_t *stats)
+{
+   const char *base = (const char *) hash->image;
+   const uint64_t *bins = (const uint64_t *) (base + hash->image->bins);
+   uint64_t off;
+   size_t ndx, len;
+
+   for (ndx = 0; ndx < hash->size; ndx++)
+   {
+      for (len = 0, off = bins[ndx]; off; off = ((const vx_record_t *) (base + off))->link)
+         len++;
+      stats->hist[len < VX_HASH_HIST ? len : VX_HASH_HIST - 1]++;
+   }
+}
+
+void vx_hash_stats (vx_hash_t *hash, vx_hash_stats_t *stats)
+{
+   if (hash->flags & VX_HASH_EPOCH)
+      vx_epoch_lock (hash->epoch);
+
+   *stats = hash->stats;
+   stats->count = hash->count;
+   stats->size = hash->size;
+   memset (stats->hist, 0, sizeof (stats->hist));
+   if (hash->flags & VX_HASH_MAPPED)
+      vx_hash_hist_image (hash, stats);
+   else if (hash->flags & VX_HASH_FLAT)
+      vx_hash_hist_flat (hash, stats);
+   else
+   {
+      vx_hash_hist_chains (stats, hash->bins, 0, hash->size);
+      if (hash->old_bins)
+         vx_hash_hist_chains (stats, hash->old_bins, hash->migrate, hash->old_size);
+   }
+   vx_hash_memory (hash, &stats->used, &stats->reserved);
+
+   if (hash->flags & VX_HASH_EPOCH)
+      vx_epoch_unlock (hash->epoch);
+
+   stats->probes_per_hit = stats->hits ? (double) stats->hit_probes / stats->hits : 0;
+   stats->probes_per_miss = stats->misses ? (double) stats->miss_probes / stats->misses : 0;
+}
+
+void vx_hash_stats_reset (vx_hash_t *hash)
+{
+   memset (&hash->stats, 0, sizeof (hash->stats));
+}
+
 void vx_hash_destroy(vx_hash_t *hash)
 {
+   vx_node_t *node, *next;
+
+   if (hash->flags & VX_HASH_MAPPED)
+      munmap (hash->image, hash->image_size);
+   else if (hash->flags & VX_HASH_FLAT)
+      vx_flat_destroy (hash);
+   else
+   {
+      if (hash->flags & VX_HASH_EPOCH)
+      {
+         vx_epoch_destroy (hash->epoch);
+         free (hash->table);
+      }
+
+      /* slab mode hands whole chunks back below instead */
+      for (node = hash->sentry->next;
+           !(hash->flags & VX_HASH_SLAB) && node != hash->sentry; node = next)
+      {
+         next = node->next;
+         if (hash->flags & VX_HASH_COPY_KEYS)
+            free (node->key);
+         free (node);
+      }
+   }
+   if (hash->flags & VX_HASH_SLAB)
+   {
+      if (hash->node_slab)
+         vx_slab_destroy (hash->node_slab);
+      if (hash->key_slab)
+         vx_slab_destroy (hash->key_slab);
+      if (hash->key_arena)
+         vx_arena_destroy (hash->key_arena);
+   }
    free (hash->bins);
+   free (hash->old_bins);
    free (hash->sentry);
    free (hash);
 }
-   
-int main (int argc, char *argv[])
+
+int vx_hash_save (vx_hash_t *hash, const char *path, vx_hash_size_func_t value_size)
+{
+   static const char zero[8];
+   vx_image_t image;
+   vx_record_t record;
+   uint64_t *bins, off;
+   size_t bindex, key_len, key_pad, value_pad;
+   void *key, *value, *ptr;
+   char *tmp;
+   FILE *fp;
+   int ok, err;
+
+   memset (&image, 0, sizeof (image));
+   memcpy (image.magic, VX_IMAGE_MAGIC, sizeof (image.magic));
+   image.version = VX_IMAGE_VERSION;
+   image.order = VX_IMAGE_ORDER;
+   image.key_size = hash->key_size;
+   image.count = hash->count;
+   image.size = hash_size (hash->count);
+   image.algo = hash->algo;
+   image.seed = hash->seed;
+   image.bins = sizeof (image);
+   image.records = image.bins + image.size * sizeof (uint64_t);
+
+   tmp = malloc (strlen (path) + sizeof (".tmp"));
+   assert (tmp != NULL);
+   sprintf (tmp, "%s.tmp", path);
+   if ((fp = fopen (tmp, "wb")) == NULL)
+   {
+      free (tmp);
+      return (-1);
+   }
+   bins = calloc (image.size, sizeof (uint64_t));
+   assert (bins != NULL);
+
+   /* header and bins are written again once the records are placed */
+   ok = fwrite (&image, sizeof (image), 1, fp) == 1 &&
+        fwrite (bins, sizeof (uint64_t), image.size, fp) == image.size;
+
+   off = image.records;
+   ptr = NULL;
+   while (ok && vx_hash_get_next (hash, &key, &value, &ptr))
+   {
+      key_len = hash->key_size ? hash->key_size : strlen ((char *) key) + 1;
+      record.hashval = vx_hash_hash (hash, key);
+      record.key_len = (uint32_t) key_len;
+      record.value_len = value_size (value);
+      bindex = record.hashval & (image.size - 1);
+      record.link = bins[bindex];
+      bins[bindex] = off;
+      key_pad = VX_IMAGE_ALIGN (key_len) - key_len;
+      value_pad = VX_IMAGE_ALIGN (record.value_len) - record.value_len;
+
+      ok = fwrite (&record, sizeof (record), 1, fp) == 1 &&
+           fwrite (key, 1, key_len, fp) == key_len &&
+           fwrite (zero, 1, key_pad, fp) == key_pad &&
+           fwrite (value, 1, record.value_len, fp) == record.value_len &&
+           fwrite (zero, 1, value_pad, fp) == value_pad;
+      off += sizeof (record) + key_len + key_pad + record.value_len + value_pad;
+   }
+   image.end = off;
+
+   ok = ok && fseek (fp, 0, SEEK_SET) == 0 &&
+        fwrite (&image, sizeof (image), 1, fp) == 1 &&
+        fwrite (bins, sizeof (uint64_t), image.size, fp) == image.size &&
+        fflush (fp) == 0 && fsync (fileno (fp)) == 0;
+   if (fclose (fp) != 0)
+      ok = 0;
+   if (!ok || rename (tmp, path) != 0)
+   {
+      err = errno;
+      unlink (tmp);
+      errno = err;
+      ok = 0;
+   }
+   free (bins);
+   free (tmp);
+   return (ok ? 0 : -1);
+}
+
+vx_hash_t * vx_hash_map (const char *path)
 {
-   char key[64];
-   char *foo;
-   char bar[64];
-   int ndx;
    vx_hash_t *hash;
-   void *ptr;
-   char *k, *v;
-   uint32_t ikey, ik;
+   vx_image_t *image;
+   struct stat st;
+   void *base;
+   int fd;
 
-   hash = vx_hash_new();
-   printf ("hash count: %d size: %d\n", vx_hash_count(hash), vx_hash_size(hash));
-   for (ndx = 0; ndx < 256; ndx++)
+   if ((fd = open (path, O_RDONLY)) < 0)
+      return (NULL);
+   if (fstat (fd, &st) < 0)
    {
-      sprintf (key, "key%03d", ndx);
-      sprintf (bar, "value%03d", ndx);
-      foo = strdup (bar);
-      vx_hash_put (hash, key, foo);
-      printf ("vx_hash_put: %s -> %s\n", key, foo); 
+      close (fd);
+      return (NULL);
    }
-   printf ("hash count: %d\n", vx_hash_count(hash));
-   for (ndx = 0; ndx < 256; ndx++)
+   if ((size_t) st.st_size < sizeof (vx_image_t))
    {
-      sprintf (key, "key%03d", ndx);
-      foo = (char *) vx_hash_get (hash, key);
-      printf ("vx_hash_get: %s -> %s\n", key, foo); 
+      close (fd);
+      errno = EINVAL;
+      return (NULL);
    }
-   printf ("hash count: %d size: %d\n", vx_hash_count(hash), vx_hash_size(hash));
-   
-   ptr = NULL;
-   while (vx_hash_get_next(hash, (void **) &k, (void **) &v, &ptr))
+   base = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close (fd);
+   if (base == MAP_FAILED)
+      return (NULL);
+
+   image = (vx_image_t *) base;
+   if (memcmp (image->magic, VX_IMAGE_MAGIC, sizeof (image->magic)) ||
+       image->version != VX_IMAGE_VERSION || image->order != VX_IMAGE_ORDER ||
+       image->size == 0 || (image->size & (image->size - 1)) ||
+       image->bins != sizeof (vx_image_t) ||
+       image->records != image->bins + image->size * sizeof (uint64_t) ||
+       image->end < image->records || image->end != (uint64_t) st.st_size)
+   {
+      munmap (base, st.st_size);
+      errno = EINVAL;
+      return (NULL);
+   }
+   /* lookups land anywhere in the image, read ahead would be wasted */
+   madvise (base, st.st_size, MADV_RANDOM);
+
+   hash = calloc (1, sizeof (vx_hash_t));
+   assert (hash != NULL);
+   hash->flags = VX_HASH_MAPPED;
+   hash->key_size = image->key_size;
+   hash->size = image->size;
+   hash->count = image->count;
+   hash->hash_func = vx_hash_func;
+   hash->cmp_func = vx_hash_cmp_func;
+   hash->algo = (vx_hash_algo_t) image->algo;
+   hash->seed = image->seed;
+   hash->image = image;
+   hash->image_size = st.st_size;
+   return (hash);
+}
+
+/**
+ * vx_image_get: walk the bin's chain of records, nothing is touched but
+ * the pages on the way
+ */
+static void * vx_image_get (vx_hash_t *hash, const void *key, uint32_t hash_value)
+{
+   const char *base = (const char *) hash->image;
+   const uint64_t *bins = (const uint64_t *) (base + hash->image->bins);
+   const vx_record_t *record;
+   uint64_t off;
+
+   for (off = bins[hash_value & (hash->size - 1)]; off; off = record->link)
    {
-      printf ("vx_hash_get_next: %s -> %s\n", k, v); 
+      record = (const vx_record_t *) (base + off);
+      if (record->hashval == hash_value && vx_hash_key_eq (hash, record + 1, key))
+         return ((void *) ((const char *) (record + 1) + VX_IMAGE_ALIGN (record->key_len)));
    }
+   return (NULL);
+}
+
+/**
+ * vx_image_get_next: *ptr holds the offset of the next record
+ */
+static int vx_image_get_next (vx_hash_t *hash, void **key, void **value, void **ptr)
+{
+   uint64_t off = *ptr ? (uint64_t) (uintptr_t) (*ptr) : hash->image->records;
+   vx_record_t *record;
 
-   for (ndx = 0; ndx < 256; ndx++)
+   if (off >= hash->image->end)
    {
-      sprintf (key, "key%03d", ndx);
-      foo = (char *) vx_hash_delete (hash, key);
-      printf ("vx_hash_delete: deleted %s -> %s\n", key, foo); 
-      free (foo);
+      *key = *value = *ptr = NULL;
+      return (0);
    }
-   printf ("hash count: %d size: %d\n", vx_hash_count(hash), vx_hash_size(hash));
 
-   vx_hash_destroy (hash);
+   record = (vx_record_t *) ((char *) hash->image + off);
+   *key = record + 1;
+   *value = (char *) (record + 1) + VX_IMAGE_ALIGN (record->key_len);
+   *ptr = (void *) (uintptr_t) (off + sizeof (vx_record_t) +
+                                VX_IMAGE_ALIGN (record->key_len) + VX_IMAGE_ALIGN (record->value_len));
+   return (1);
+}
+
+/**
+ * vx_flat_match: bitmask of the slots in a group whose control byte is c
+ */
+static inline uint32_t vx_flat_match (const uint8_t *ctrl, uint8_t c)
+{
+#ifdef __SSE2__
+   __m128i group = _mm_loadu_si128 ((const __m128i *) ctrl);
+   return ((uint32_t) _mm_movemask_epi8 (_mm_cmpeq_epi8 (group, _mm_set1_epi8 ((char) c))));
+#else
+   uint32_t bits = 0;
+   int ndx;
+   for (ndx = 0; ndx < VX_FLAT_GROUP; ndx++)
+      if (ctrl[ndx] == c)
+         bits |= 1u << ndx;
+   return (bits);
+#endif
+}
+
+/**
+ * vx_flat_match_free: bitmask of the EMPTY or DELETED slots in a group
+ */
+static inline uint32_t vx_flat_match_free (const uint8_t *ctrl)
+{
+#ifdef __SSE2__
+   return ((uint32_t) _mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *) ctrl)));
+#else
+   uint32_t bits = 0;
+   int ndx;
+   for (ndx = 0; ndx < VX_FLAT_GROUP; ndx++)
+      if (ctrl[ndx] & 0x80)
+         bits |= 1u << ndx;
+   return (bits);
+#endif
+}
+
+static size_t vx_flat_capacity (size_t count)
+{
+   size_t size = VX_FLAT_GROUP;
+   while (count >= size - size / 8)
+      size <<= 1;
+   return (size);
+}
+
+static void vx_flat_alloc (vx_hash_t *hash, size_t size)
+{
+   hash->size = size;
+   hash->flat.ctrl = malloc (size);
+   assert (hash->flat.ctrl != NULL);
+   memset (hash->flat.ctrl, VX_FLAT_EMPTY, size);
+   hash->flat.slots = malloc (size * sizeof (uint32_t));
+   assert (hash->flat.slots != NULL);
+   hash->flat.growth_left = size - size / 8;
+}
 
-   hash = vx_hash_create (16, sizeof(uint32_t), VX_HASH_COPY_KEYS);
+static void vx_flat_create (vx_hash_t *hash)
+{
+   if (hash->size < VX_FLAT_GROUP)
+      hash->size = VX_FLAT_GROUP;
+   vx_flat_alloc (hash, hash->size);
+   hash->flat.nentries = 0;
+   hash->flat.entries_size = VX_FLAT_GROUP;
+   hash->flat.entries = malloc (hash->flat.entries_size * sizeof (vx_entry_t));
+   assert (hash->flat.entries != NULL);
+}
 
-   for (ikey = 0; ikey < 256; ikey++)
+static void vx_flat_destroy (vx_hash_t *hash)
+{
+   size_t ndx;
+   if ((hash->flags & VX_HASH_COPY_KEYS) && !(hash->flags & VX_HASH_SLAB))
    {
-      sprintf (bar, "value%03d", ndx);
-      foo = strdup (bar);
-      vx_hash_put (hash, &ikey, foo);
-      printf ("vx_hash_put(uint32_t): %d -> %s\n", ikey, foo); 
+      for (ndx = 0; ndx < hash->flat.nentries; ndx++)
+         if (!hash->flat.entries[ndx].deleted)
+            free (hash->flat.entries[ndx].key);
    }
-   printf ("hash count: %d size: %d\n", vx_hash_count(hash), vx_hash_size(hash));
+   free (hash->flat.ctrl);
+   free (hash->flat.slots);
+   free (hash->flat.entries);
+}
+
+/**
+ * vx_flat_find: probe for key, returns the slot or -1 if absent
+ */
+static ssize_t vx_flat_find (vx_hash_t *hash, const void *key, uint32_t hash_value)
+{
+   vx_flat_t *flat = &hash->flat;
+   size_t mask = hash->size / VX_FLAT_GROUP - 1;
+   size_t group = VX_FLAT_H1(hash_value) & mask;
+   size_t step = 0, base;
+   uint32_t bits;
+   vx_entry_t *entry;
 
-   for (ikey = 0; ikey < 256; ikey++)
+   for (;;)
    {
-      foo = (char *) vx_hash_get (hash, &ikey);
-      printf ("vx_hash_get(uint32_t): %d -> %s\n", ikey, foo); 
+      base = group * VX_FLAT_GROUP;
+      bits = vx_flat_match (flat->ctrl + base, VX_FLAT_H2(hash_value));
+      while (bits)
+      {
+         entry = &flat->entries[flat->slots[base + __builtin_ctz (bits)]];
+         if (entry->hashval == hash_value && vx_hash_key_eq (hash, entry->key, key))
+         {
+            vx_hash_probe (hash, 1, step + 1);
+            return ((ssize_t) (base + __builtin_ctz (bits)));
+         }
+         bits &= bits - 1;
+      }
+      if (vx_flat_match (flat->ctrl + base, VX_FLAT_EMPTY))
+      {
+         vx_hash_probe (hash, 0, step + 1);
+         return (-1);
+      }
+      group = (group + ++step) & mask;
    }
-   printf ("hash count: %d size: %d\n", vx_hash_count(hash), vx_hash_size(hash));
-   
-   ptr = NULL;
-   while (vx_hash_get_next(hash, (void **) &ik, (void **) &v, &ptr))
+}
+
+/**
+ * vx_flat_insert_slot: first EMPTY or DELETED slot on the probe sequence
+ */
+static size_t vx_flat_insert_slot (vx_hash_t *hash, uint32_t hash_value)
+{
+   size_t mask = hash->size / VX_FLAT_GROUP - 1;
+   size_t group = VX_FLAT_H1(hash_value) & mask;
+   size_t step = 0;
+   uint32_t bits;
+
+   while ((bits = vx_flat_match_free (hash->flat.ctrl + group * VX_FLAT_GROUP)) == 0)
+      group = (group + ++step) & mask;
+   return (group * VX_FLAT_GROUP + __builtin_ctz (bits));
+}
+
+/**
+ * vx_flat_resize: rebuild the control bytes for size slots, dropping
+ * tombstones and compacting entries[] (insertion order is preserved)
+ */
+static void vx_flat_resize (vx_hash_t *hash, size_t size)
+{
+   vx_flat_t *flat = &hash->flat;
+   size_t ndx, live, pos;
+   uint64_t start = vx_hash_clock ();
+
+   if (size < vx_flat_capacity (hash->count))
+      size = vx_flat_capacity (hash->count);
+
+   free (flat->ctrl);
+   free (flat->slots);
+   vx_flat_alloc (hash, size);
+
+   for (ndx = 0, live = 0; ndx < flat->nentries; ndx++)
+   {
+      if (flat->entries[ndx].deleted)
+         continue;
+      flat->entries[live] = flat->entries[ndx];
+      pos = vx_flat_insert_slot (hash, flat->entries[live].hashval);
+      flat->ctrl[pos] = VX_FLAT_H2(flat->entries[live].hashval);
+      flat->slots[pos] = (uint32_t) live;
+      live++;
+   }
+   flat->nentries = live;
+   flat->growth_left -= live;
+   vx_hash_rehashed (hash, start, 1);
+}
+
+static void * vx_flat_put (vx_hash_t *hash, void *key, void *value, uint32_t hash_value)
+{
+   vx_flat_t *flat = &hash->flat;
+   ssize_t found;
+   size_t pos;
+   vx_entry_t *entry;
+
+   if ((found = vx_flat_find (hash, key, hash_value)) >= 0)
+   {
+      entry = &flat->entries[flat->slots[found]];
+      if ((hash->flags & VX_HASH_FREE_VALUE) && hash->free_func)
+         hash->free_func (entry->value);
+      entry->value = value;
+      return (value);
+   }
+
+   if (flat->growth_left == 0)
+   {
+      /* mostly tombstones: rebuild in place, otherwise grow */
+      if (hash->count < (hash->size - hash->size / 8) / 2)
+         vx_flat_resize (hash, hash->size);
+      else
+         vx_flat_resize (hash, hash->size * 2);
+   }
+
+   /* delete/put churn leaves holes in entries[]: squeeze them out first */
+   if (flat->nentries == flat->entries_size && hash->count <= flat->entries_size / 2)
+      vx_flat_resize (hash, hash->size);
+   if (flat->nentries == flat->entries_size)
+   {
+      flat->entries_size *= 2;
+      flat->entries = realloc (flat->entries, flat->entries_size * sizeof (vx_entry_t));
+      assert (flat->entries != NULL);
+   }
+
+   pos = vx_flat_insert_slot (hash, hash_value);
+   if (flat->ctrl[pos] == VX_FLAT_EMPTY)
+      flat->growth_left--;
+   flat->ctrl[pos] = VX_FLAT_H2(hash_value);
+   flat->slots[pos] = (uint32_t) flat->nentries;
+
+   entry = &flat->entries[flat->nentries++];
+   entry->hashval = hash_value;
+   entry->deleted = 0;
+   if (hash->flags & VX_HASH_COPY_KEYS)
+      entry->key = vx_hash_key_dup (hash, key);
+   else
+      entry->key = key;
+   entry->value = value;
+
+   hash->count++;
+
+   return (value);
+}
+
+static void * vx_flat_get (vx_hash_t *hash, void *key, uint32_t hash_value)
+{
+   ssize_t found;
+
+   found = vx_flat_find (hash, key, hash_value);
+   if (found < 0)
+      return (NULL);
+   return (hash->flat.entries[hash->flat.slots[found]].value);
+}
+
+static void * vx_flat_delete (vx_hash_t *hash, void *key, uint32_t hash_value)
+{
+   vx_flat_t *flat = &hash->flat;
+   ssize_t found;
+   vx_entry_t *entry;
+   size_t base;
+
+   found = vx_flat_find (hash, key, hash_value);
+   if (found < 0)
+      return (NULL);
+
+   entry = &flat->entries[flat->slots[found]];
+   entry->deleted = 1;
+   if (hash->flags & VX_HASH_COPY_KEYS)
+      vx_hash_key_free (hash, entry->key);
+
+   /**
+    * a group that still has an EMPTY slot never overflowed, so no probe
+    * sequence runs through it and the slot can go straight back to EMPTY
+    */
+   base = found - found % VX_FLAT_GROUP;
+   if (vx_flat_match (flat->ctrl + base, VX_FLAT_EMPTY))
    {
-      printf ("vx_hash_get_next(uint32_t): %d -> %s\n", ik, v); 
+      flat->ctrl[found] = VX_FLAT_EMPTY;
+      flat->growth_left++;
    }
+   else
+      flat->ctrl[found] = VX_FLAT_DELETED;
+
+   hash->count--;
+   return (entry->value);
+}
+
+/**
+ * vx_flat_get_next: *ptr holds the next entries[] index plus one
+ */
+static int vx_flat_get_next (vx_hash_t *hash, void **key, void **value, void **ptr)
+{
+   size_t ndx = (size_t) (uintptr_t) (*ptr);
+
+   if (ndx)
+      ndx--;
+
+   while (ndx < hash->flat.nentries && hash->flat.entries[ndx].deleted)
+      ndx++;
 
-   for (ikey = 0; ikey < 256; ikey++)
+   if (ndx >= hash->flat.nentries)
    {
-      foo = (char *) vx_hash_delete (hash, &ikey);
-      printf ("vx_hash_delete(uint32_t): deleted %d -> %s\n", ikey, foo); 
-      free (foo);
+      *key = *value = *ptr = NULL;
+      return (0);
    }
-   printf ("hash count: %d size: %d\n", vx_hash_count(hash), vx_hash_size(hash));
-   vx_hash_destroy(hash);
 
-   return(0);
+   *key = hash->flat.entries[ndx].key;
+   *value = hash->flat.entries[ndx].value;
+   *ptr = (void *) (uintptr_t) (ndx + 2);
+
+   return (1);
 }
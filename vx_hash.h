@@ -10,6 +10,8 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <vx_epoch.h>
+#include <vx_slab.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -19,9 +21,28 @@ extern "C"
 typedef enum hash_flag
 {
    VX_HASH_COPY_KEYS = 1,
-   VX_HASH_FREE_VALUE = 1<<1
+   VX_HASH_FREE_VALUE = 1<<1,
+   VX_HASH_FLAT = 1<<2,
+   VX_HASH_INCREMENTAL = 1<<3,
+   VX_HASH_EPOCH = 1<<4,
+   VX_HASH_SLAB = 1<<5,
+   VX_HASH_MAPPED = 1<<6,
+   VX_HASH_LRU = 1<<7
 } vx_hash_flag_t;
 
+/**
+ * vx_hash_algo_t: built in hash algorithms. VX_HASH_ALGO_FUNC uses the
+ * table's vx_hash_func_t (vx_hash_func, Jenkins one-at-a-time, unless set
+ * otherwise); the others are seeded and process 16-48 (wyhash) or 32
+ * (xxh64) bytes per step, with a single mix for 4 and 8 byte keys.
+ */
+typedef enum vx_hash_algo
+{
+   VX_HASH_ALGO_FUNC = 0,
+   VX_HASH_ALGO_WY,
+   VX_HASH_ALGO_XXH64
+} vx_hash_algo_t;
+
 /**
  * vx_hash_func_t: function prototype for hashing functions
  */
@@ -37,6 +58,57 @@ typedef void (*vx_hash_free_func_t) (void * value);
  */
 typedef int (*vx_hash_cmp_func_t) (const void * foo, const void * bar, size_t key_size);
 
+/**
+ * vx_hash_size_func_t: number of bytes behind a value, for vx_hash_save
+ */
+typedef size_t (*vx_hash_size_func_t) (const void * value);
+
+/**
+ * chain lengths counted separately in vx_hash_stats_t, the last bucket
+ * takes everything longer
+ */
+#define VX_HASH_HIST 16
+
+/**
+ * vx_hash_stats_t: see vx_hash_stats
+ */
+typedef struct vx_hash_stats
+{
+   size_t count;
+   size_t size;
+   size_t hist[VX_HASH_HIST];
+   uint64_t hits;
+   uint64_t misses;
+   uint64_t hit_probes;
+   uint64_t miss_probes;
+   double probes_per_hit;
+   double probes_per_miss;
+   uint64_t rehashes;
+   uint64_t rehash_ns;
+   uint64_t rehash_last_ns;
+   uint64_t rehash_max_ns;
+   size_t used;
+   size_t reserved;
+} vx_hash_stats_t;
+
+/**
+ * vx_hash_range_t: one slice of a table from vx_hash_split, walked with
+ * vx_hash_range_next
+ */
+typedef struct vx_hash_range
+{
+   size_t begin;
+   size_t end;
+   size_t pos;
+   void *node;
+} vx_hash_range_t;
+
+/**
+ * vx_hash_foreach_func_t: called per entry by vx_hash_foreach_parallel,
+ * return 0 to stop the walk
+ */
+typedef int (*vx_hash_foreach_func_t) (void *key, void *value, void *arg);
+
 struct vx_hash;
 /**
  * vx_hash_t: opaque pointer to a hash table
@@ -51,28 +123,55 @@ uint32_t vx_hash_func (const void * key, size_t key_size);
 /**
  *
  */
-int vx_hash_cmp_func (const void * foo, const void * bar, size_t key_size);
+uint64_t vx_hash_wy (const void *key, size_t key_size, uint64_t seed);
 
 /**
  *
  */
-void vx_hash_free_func (const void * value);
+uint64_t vx_hash_xxh64 (const void *key, size_t key_size, uint64_t seed);
 
 /**
  *
  */
-static size_t hash_size (size_t size);
+int vx_hash_cmp_func (const void * foo, const void * bar, size_t key_size);
 
 /**
  *
  */
-void * vx_hash_key_dup (vx_hash_t *hash, void *key);
+void vx_hash_free_func (const void * value);
 
 /**
  *
  */
+void * vx_hash_key_dup (vx_hash_t *hash, void *key);
+
+/**
+ * vx_hash_rehash: double the table in one go, completing any incremental
+ * resize that is still in progress
+ */
 void vx_hash_rehash (vx_hash_t *hash);
 
+/**
+ * vx_hash_reserve: size the table so that it holds count entries without
+ * rehashing, it never shrinks
+ */
+void vx_hash_reserve (vx_hash_t *hash, size_t count);
+
+/**
+ * vx_hash_shrink: resize to the smallest table for the current count
+ */
+void vx_hash_shrink (vx_hash_t *hash);
+
+/**
+ * vx_hash_build: vx_hash_put (hash, keys[i], values[i]) for n entries,
+ * reserving for them up front. Chained tables without EPOCH, LRU or SLAB
+ * are built by nthreads threads (0 for one per cpu), each hashing a slice of
+ * the input and then inserting the keys that fall in its own range of bins;
+ * the result, including iteration order, is that of the puts in order.
+ * hash_func and free_func are then called from those threads.
+ */
+void vx_hash_build (vx_hash_t *hash, void **keys, void **values, size_t n, int nthreads);
+
 
 /**
  *
@@ -80,20 +179,72 @@ void vx_hash_rehash (vx_hash_t *hash);
 vx_hash_t * vx_hash_new(void);
 
 /**
- *
+ * vx_hash_create: create a table with at least size bins. key_size of 0
+ * means nul terminated string keys. VX_HASH_FLAT selects open addressing
+ * (control bytes probed 16 at a time) instead of chained bins; both modes
+ * share the same api and iterate in insertion order. VX_HASH_INCREMENTAL
+ * (chained only) spreads each doubling over the following operations
+ * instead of rebuilding every chain inside one put. VX_HASH_EPOCH (chained,
+ * not incremental) makes vx_hash_get lock free and safe against concurrent
+ * writers, see vx_hash_epoch. VX_HASH_SLAB takes nodes and copied keys from
+ * per table slabs so destroy releases them a chunk at a time. VX_HASH_LRU
+ * (chained, not epoch) turns the table into a cache bounded by
+ * vx_hash_set_capacity, see there.
  */
 vx_hash_t * vx_hash_create (size_t size, size_t key_size, int flags);
 
+/**
+ * vx_hash_epoch: the reclamation domain of a VX_HASH_EPOCH table. Threads
+ * calling vx_hash_get register with it and call vx_epoch_quiescent between
+ * lookups; returned values must not be used after that unless the caller
+ * owns them. put/delete/rehash serialize on the epoch lock themselves.
+ * vx_hash_get_next is not safe against concurrent writers.
+ */
+vx_epoch_t * vx_hash_epoch (vx_hash_t *hash);
+
 /**
  *
  */
 void vx_hash_set_hash_func (vx_hash_t *hash, vx_hash_func_t hash_func);
 
+/**
+ * vx_hash_set_algo: pick a built in hash, before the first put. Seeded
+ * algorithms get a random per table seed unless vx_hash_set_seed was
+ * called first.
+ */
+void vx_hash_set_algo (vx_hash_t *hash, vx_hash_algo_t algo);
+
+/**
+ *
+ */
+void vx_hash_set_seed (vx_hash_t *hash, uint64_t seed);
+
+/**
+ *
+ */
+uint64_t vx_hash_get_seed (vx_hash_t *hash);
+
 /**
  *
  */
 void vx_hash_set_free_func (vx_hash_t *hash, vx_hash_free_func_t free_func);
 
+/**
+ * vx_hash_set_capacity: bound a VX_HASH_LRU table to entries entries and
+ * bytes bytes (0 for no bound), evicting at once if it is over. get and
+ * put move an entry to the most recently used end of the iteration order,
+ * put evicts from the other end until the table fits again, always keeping
+ * the entry just put. Evicted values go to free_func when one is set.
+ */
+void vx_hash_set_capacity (vx_hash_t *hash, size_t entries, size_t bytes);
+
+/**
+ * vx_hash_set_size_func: bytes charged against the capacity per value, on
+ * top of the key length; without one only keys are counted. Set it before
+ * the first put, an entry is charged when its value is put.
+ */
+void vx_hash_set_size_func (vx_hash_t *hash, vx_hash_size_func_t size_func);
+
 /**
  *
  */
@@ -114,11 +265,65 @@ void * vx_hash_get (vx_hash_t *hash, void *key);
  */
 void * vx_hash_delete (vx_hash_t *hash, void *key);
 
+/**
+ * vx_hash_get_batch: values[i] = vx_hash_get (hash, keys[i]) for n keys,
+ * hashing and prefetching them in groups so their cache misses overlap.
+ * Returns the number of keys found.
+ */
+size_t vx_hash_get_batch (vx_hash_t *hash, void **keys, void **values, size_t n);
+
+/**
+ * vx_hash_put_batch: vx_hash_put (hash, keys[i], values[i]) in order
+ */
+void vx_hash_put_batch (vx_hash_t *hash, void **keys, void **values, size_t n);
+
+/**
+ * vx_hash_hash: hash a key the way the table does, for use with the
+ * *_hashed variants below when the caller needs the hash value anyway
+ */
+uint32_t vx_hash_hash (vx_hash_t *hash, const void *key);
+
+/**
+ * vx_hash_put_hashed: vx_hash_put with hash_value = vx_hash_hash (hash, key)
+ */
+void * vx_hash_put_hashed (vx_hash_t *hash, void *key, void *value, uint32_t hash_value);
+
+/**
+ *
+ */
+void * vx_hash_get_hashed (vx_hash_t *hash, void *key, uint32_t hash_value);
+
+/**
+ *
+ */
+void * vx_hash_delete_hashed (vx_hash_t *hash, void *key, uint32_t hash_value);
+
 /**
  *
  */
 int vx_hash_get_next (vx_hash_t *hash, void **key, void **value, void **ptr);
 
+/**
+ * vx_hash_split: fill up to k ranges that together cover every entry once,
+ * by bin (flat: by entry) so each holds about count / k. Ranges can be
+ * walked from separate threads at once; like vx_hash_get_next they are not
+ * safe against writers, and they do not follow insertion order. Any
+ * incremental resize is finished first. Returns the number of ranges.
+ */
+size_t vx_hash_split (vx_hash_t *hash, vx_hash_range_t *ranges, size_t k);
+
+/**
+ * vx_hash_range_next: vx_hash_get_next within one range
+ */
+int vx_hash_range_next (vx_hash_t *hash, vx_hash_range_t *range, void **key, void **value);
+
+/**
+ * vx_hash_foreach_parallel: call func for every entry from nthreads threads
+ * (0 for one per cpu), each taking ranges of the table in turn until none
+ * are left or func returned 0. func runs concurrently with itself.
+ */
+void vx_hash_foreach_parallel (vx_hash_t *hash, vx_hash_foreach_func_t func, void *arg, int nthreads);
+
 /**
  *
  */
@@ -129,6 +334,49 @@ size_t vx_hash_count (vx_hash_t *hash);
  */
 size_t vx_hash_size (vx_hash_t *hash);
 
+/**
+ * vx_hash_memory: bytes used by the table, nodes and copied keys versus
+ * bytes reserved for them (the same unless VX_HASH_SLAB is set). Without
+ * VX_HASH_SLAB, copied keys are left out when built with VX_HASH_NO_STATS.
+ */
+void vx_hash_memory (vx_hash_t *hash, size_t *used, size_t *reserved);
+
+/**
+ * vx_hash_stats: snapshot of the table's shape and counters. hist[n] is the
+ * number of bins holding n nodes, or for VX_HASH_FLAT the number of entries
+ * n probe steps from their home group; it is gathered by walking the table.
+ * Probes are nodes compared (chained) or groups scanned (flat) per key
+ * lookup, including those inside put and delete; lock free epoch mode gets
+ * and mapped tables are not counted. Rehash times cover a whole doubling,
+ * incremental ones from start to the last bin migrated. Building with
+ * VX_HASH_NO_STATS leaves the counters at 0.
+ */
+void vx_hash_stats (vx_hash_t *hash, vx_hash_stats_t *stats);
+
+/**
+ * vx_hash_stats_reset: zero the probe and rehash counters
+ */
+void vx_hash_stats_reset (vx_hash_t *hash);
+
+/**
+ * vx_hash_save: write the table to path as a relocatable image that
+ * vx_hash_map can query in place. Keys are copied as key_size bytes (or up
+ * to the nul for string keys), values as value_size (value) bytes. The file
+ * is written beside path and renamed over it, so tables already mapped from
+ * the old image are unaffected. Returns 0, or -1 with errno set.
+ */
+int vx_hash_save (vx_hash_t *hash, const char *path, vx_hash_size_func_t value_size);
+
+/**
+ * vx_hash_map: map an image written by vx_hash_save read only and return it
+ * as a VX_HASH_MAPPED table, or NULL with errno set. vx_hash_get and
+ * vx_hash_get_next return pointers into the mapping (values 8 byte aligned,
+ * not writable) and pages are read in as keys touch them; put and delete
+ * return NULL. Images of tables with their own hash or cmp function need
+ * the same ones set again after mapping. vx_hash_destroy unmaps.
+ */
+vx_hash_t * vx_hash_map (const char *path);
+
 #ifdef __cplusplus
 }
 #endif
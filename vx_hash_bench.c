@@ -0,0 +1,347 @@
+/**
+ * vx_hash_bench.c Copyright Voxaris Inc, George Howitt 2008
+ *
+ * vx_hash throughput and latency benchmark. Every run prints one JSON
+ * object per line:
+ *
+ *    vx_hash_bench                        all modes, key types and workloads
+ *    vx_hash_bench -m flat -k int -w get  one run, e.g. to compare maxrss_kb
+ *
+ * maxrss_kb is the peak of the whole process so far, only meaningful when
+ * a single run is selected; table_bytes is the table's own vx_hash_memory.
+ */
+
+#include <vx_hash.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define VX_BENCH_ZIPF 0.99
+
+typedef struct vx_bench_mode
+{
+   const char *name;
+   int flags;
+} vx_bench_mode_t;
+
+static const vx_bench_mode_t vx_bench_modes[] =
+{
+   { "chained", VX_HASH_COPY_KEYS },
+   { "flat", VX_HASH_COPY_KEYS | VX_HASH_FLAT },
+   { "incremental", VX_HASH_COPY_KEYS | VX_HASH_INCREMENTAL },
+   { "epoch", VX_HASH_COPY_KEYS | VX_HASH_EPOCH },
+   { "slab", VX_HASH_COPY_KEYS | VX_HASH_SLAB },
+   { NULL, 0 }
+};
+
+enum
+{
+   VX_BENCH_GROW,
+   VX_BENCH_GET,
+   VX_BENCH_CHURN
+};
+
+static const char *vx_bench_workloads[] = { "grow", "get", "churn", NULL };
+
+/**
+ * vx_bench_t: one run's settings and the keys it draws from. keys[0..n)
+ * are put before a get or churn run, keys[n..2n) are never put and serve
+ * as misses and as churn's fresh keys.
+ */
+typedef struct vx_bench
+{
+   const vx_bench_mode_t *mode;
+   int workload;
+   int strings;
+   int zipf;
+   int hit;
+   size_t n;
+   size_t ops;
+   size_t interval;
+   uint64_t seed;
+   void **keys;
+   double *cdf;
+   uint32_t *samples;
+   size_t nsamples;
+} vx_bench_t;
+
+static inline uint64_t vx_bench_rand (uint64_t *state)
+{
+   uint64_t x = *state;
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   *state = x;
+   return (x * 0x2545f4914f6cdd1dULL);
+}
+
+static inline uint64_t vx_bench_clock (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/**
+ * vx_bench_zipf_init: cumulative zipf weights of ranks 0..n-1
+ */
+static double * vx_bench_zipf_init (size_t n)
+{
+   double *cdf = malloc (n * sizeof (double)), sum = 0;
+   size_t ndx;
+
+   assert (cdf != NULL);
+   for (ndx = 0; ndx < n; ndx++)
+   {
+      sum += 1.0 / pow ((double) (ndx + 1), VX_BENCH_ZIPF);
+      cdf[ndx] = sum;
+   }
+   for (ndx = 0; ndx < n; ndx++)
+      cdf[ndx] /= sum;
+   return (cdf);
+}
+
+/**
+ * vx_bench_pick: index of the next key in [0, n), uniform or zipf; zipf
+ * ranks are scattered so the hot keys don't share bins or cache lines
+ */
+static size_t vx_bench_pick (vx_bench_t *bench, uint64_t *state)
+{
+   double u;
+   size_t lo, hi, mid;
+
+   if (!bench->zipf)
+      return ((size_t) (vx_bench_rand (state) % bench->n));
+
+   u = (double) (vx_bench_rand (state) >> 11) / (double) (1ULL << 53);
+   for (lo = 0, hi = bench->n - 1; lo < hi; )
+   {
+      mid = (lo + hi) / 2;
+      if (bench->cdf[mid] < u)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   return ((size_t) ((lo * 0x9e3779b97f4a7c15ULL) % bench->n));
+}
+
+static void vx_bench_keys (vx_bench_t *bench)
+{
+   uint64_t *ints, state = bench->seed;
+   char *strs;
+   size_t ndx, total = bench->n * 2;
+
+   bench->keys = malloc (total * sizeof (void *));
+   assert (bench->keys != NULL);
+   if (bench->strings)
+   {
+      strs = malloc (total * 24);
+      assert (strs != NULL);
+      for (ndx = 0; ndx < total; ndx++)
+      {
+         bench->keys[ndx] = strs + ndx * 24;
+         sprintf (strs + ndx * 24, "key:%016llx", (unsigned long long) vx_bench_rand (&state));
+      }
+   }
+   else
+   {
+      ints = malloc (total * sizeof (uint64_t));
+      assert (ints != NULL);
+      for (ndx = 0; ndx < total; ndx++)
+      {
+         ints[ndx] = vx_bench_rand (&state);
+         bench->keys[ndx] = &ints[ndx];
+      }
+   }
+}
+
+static int vx_bench_cmp (const void *foo, const void *bar)
+{
+   uint32_t a = *(const uint32_t *) foo, b = *(const uint32_t *) bar;
+   return ((a > b) - (a < b));
+}
+
+static uint32_t vx_bench_pct (vx_bench_t *bench, double pct)
+{
+   size_t ndx;
+
+   if (bench->nsamples == 0)
+      return (0);
+   ndx = (size_t) (pct * (bench->nsamples - 1));
+   return (bench->samples[ndx]);
+}
+
+/**
+ * vx_bench_op: one timed or untimed operation of the current workload
+ */
+static inline void vx_bench_op (vx_bench_t *bench, vx_hash_t *hash, size_t op,
+                                uint64_t *state, size_t *live, void **value)
+{
+   size_t ndx;
+
+   if (bench->workload == VX_BENCH_GROW)
+      vx_hash_put (hash, bench->keys[op], bench->keys[op]);
+   else if (bench->workload == VX_BENCH_GET)
+   {
+      ndx = vx_bench_pick (bench, state);
+      if ((int) (vx_bench_rand (state) % 100) >= bench->hit)
+         ndx += bench->n;
+      *value = vx_hash_get (hash, bench->keys[ndx]);
+   }
+   else
+   {
+      /* churn: swap a live key out for one from the other half */
+      ndx = vx_bench_pick (bench, state);
+      if (vx_hash_delete (hash, bench->keys[ndx + live[ndx] * bench->n]) != NULL)
+      {
+         live[ndx] ^= 1;
+         vx_hash_put (hash, bench->keys[ndx + live[ndx] * bench->n], bench->keys[ndx]);
+      }
+   }
+}
+
+static void vx_bench_run (vx_bench_t *bench)
+{
+   vx_hash_t *hash;
+   struct rusage usage;
+   uint64_t state = bench->seed ^ 0x5bd1e995, start, end, t0;
+   size_t op, ops, *live = NULL, used, reserved;
+   void *value = NULL;
+
+   hash = vx_hash_create (16, bench->strings ? 0 : sizeof (uint64_t), bench->mode->flags);
+   vx_hash_set_algo (hash, VX_HASH_ALGO_WY);
+
+   ops = bench->ops;
+   if (bench->workload == VX_BENCH_GROW)
+      ops = bench->n;
+   else
+   {
+      for (op = 0; op < bench->n; op++)
+         vx_hash_put (hash, bench->keys[op], bench->keys[op]);
+      if (bench->workload == VX_BENCH_CHURN)
+      {
+         live = calloc (bench->n, sizeof (size_t));
+         assert (live != NULL);
+      }
+   }
+
+   bench->nsamples = 0;
+   start = vx_bench_clock ();
+   for (op = 0; op < ops; op++)
+   {
+      if (op % bench->interval)
+      {
+         vx_bench_op (bench, hash, op, &state, live, &value);
+         continue;
+      }
+      t0 = vx_bench_clock ();
+      vx_bench_op (bench, hash, op, &state, live, &value);
+      bench->samples[bench->nsamples++] = (uint32_t) (vx_bench_clock () - t0);
+   }
+   end = vx_bench_clock ();
+
+   qsort (bench->samples, bench->nsamples, sizeof (uint32_t), vx_bench_cmp);
+   vx_hash_memory (hash, &used, &reserved);
+   getrusage (RUSAGE_SELF, &usage);
+
+   printf ("{\"workload\":\"%s\",\"mode\":\"%s\",\"keys\":\"%s\",\"dist\":\"%s\","
+           "\"hit_pct\":%d,\"n\":%zu,\"ops\":%zu,\"ops_per_sec\":%.0f,"
+           "\"p50_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u,\"count\":%zu,\"size\":%zu,"
+           "\"table_bytes\":%zu,\"maxrss_kb\":%ld}\n",
+           vx_bench_workloads[bench->workload], bench->mode->name, bench->strings ? "string" : "int",
+           bench->zipf ? "zipf" : "uniform", bench->hit, bench->n, ops,
+           ops / ((end - start) / 1e9), vx_bench_pct (bench, 0.5), vx_bench_pct (bench, 0.99),
+           vx_bench_pct (bench, 0.999), vx_hash_count (hash), vx_hash_size (hash),
+           reserved, usage.ru_maxrss);
+   fflush (stdout);
+
+   free (live);
+   vx_hash_destroy (hash);
+}
+
+static void vx_bench_usage (const char *prog)
+{
+   fprintf (stderr, "usage: %s [-m mode] [-k int|string] [-w grow|get|churn] [-d uniform|zipf]\n"
+                    "          [-h hit%%] [-n keys] [-o ops] [-i sample interval] [-s seed]\n", prog);
+   exit (1);
+}
+
+int main (int argc, char *argv[])
+{
+   vx_bench_t bench;
+   const vx_bench_mode_t *mode;
+   const char *only_mode = NULL, *only_workload = NULL, *only_dist = NULL;
+   int opt, only_keys = -1, strings, workload, zipf, hit;
+   int hits[2] = { 100, 50 }, nhits = 2;
+
+   memset (&bench, 0, sizeof (bench));
+   bench.n = 1000000;
+   bench.ops = 2000000;
+   bench.interval = 16;
+   bench.seed = 0x9e3779b97f4a7c15ULL;
+
+   while ((opt = getopt (argc, argv, "m:k:w:d:h:n:o:i:s:")) != -1)
+   {
+      switch (opt)
+      {
+      case 'm': only_mode = optarg; break;
+      case 'k': only_keys = strcmp (optarg, "int") != 0; break;
+      case 'w': only_workload = optarg; break;
+      case 'd': only_dist = optarg; break;
+      case 'h': hits[0] = atoi (optarg); nhits = 1; break;
+      case 'n': bench.n = strtoul (optarg, NULL, 0); break;
+      case 'o': bench.ops = strtoul (optarg, NULL, 0); break;
+      case 'i': bench.interval = strtoul (optarg, NULL, 0); break;
+      case 's': bench.seed = strtoull (optarg, NULL, 0); break;
+      default: vx_bench_usage (argv[0]);
+      }
+   }
+   if (bench.n == 0 || bench.interval == 0)
+      vx_bench_usage (argv[0]);
+
+   bench.cdf = vx_bench_zipf_init (bench.n);
+   bench.samples = malloc (((bench.n > bench.ops ? bench.n : bench.ops) / bench.interval + 1) *
+                           sizeof (uint32_t));
+   assert (bench.samples != NULL);
+
+   for (strings = 0; strings < 2; strings++)
+   {
+      if (only_keys >= 0 && only_keys != strings)
+         continue;
+      bench.strings = strings;
+      vx_bench_keys (&bench);
+      for (mode = vx_bench_modes; mode->name; mode++)
+      {
+         if (only_mode && strcmp (only_mode, mode->name))
+            continue;
+         bench.mode = mode;
+         for (workload = 0; vx_bench_workloads[workload]; workload++)
+         {
+            if (only_workload && strcmp (only_workload, vx_bench_workloads[workload]))
+               continue;
+            bench.workload = workload;
+            for (zipf = 0; zipf < 2; zipf++)
+            {
+               if ((only_dist && strcmp (only_dist, zipf ? "zipf" : "uniform")) ||
+                   (zipf && workload == VX_BENCH_GROW))
+                  continue;
+               bench.zipf = zipf;
+               /* hit ratios only change what get does */
+               for (hit = 0; hit < (workload == VX_BENCH_GET ? nhits : 1); hit++)
+               {
+                  bench.hit = hits[hit];
+                  vx_bench_run (&bench);
+               }
+            }
+         }
+      }
+      free (bench.keys[0]);
+      free (bench.keys);
+   }
+
+   free (bench.samples);
+   free (bench.cdf);
+   return (0);
+}
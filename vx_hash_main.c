@@ -0,0 +1,223 @@
+/**
+ * vx_hash_main.c Copyright Voxaris Inc, George Howitt 2008
+ */
+
+#include <vx_hash.h>
+
+#define VX_CHURN_KEYS 10000
+#define VX_CHURN_OPS  400000
+
+/**
+ * vx_churn: random put/delete/get churn on a chained and a flat table in
+ * lock step; every call must agree, and the flat table must not keep
+ * growing once the key population is steady
+ */
+static void vx_churn (void)
+{
+   vx_hash_t *chained, *flat;
+   uint64_t state = 0x9e3779b97f4a7c15ULL, key;
+   size_t op, used, filled, reserved;
+   void *foo, *bar;
+
+   chained = vx_hash_create (16, sizeof (uint64_t), VX_HASH_COPY_KEYS);
+   flat = vx_hash_create (16, sizeof (uint64_t), VX_HASH_COPY_KEYS | VX_HASH_FLAT);
+   for (key = 0; key < VX_CHURN_KEYS; key++)
+   {
+      vx_hash_put (chained, &key, (void *) (uintptr_t) (key + 1));
+      vx_hash_put (flat, &key, (void *) (uintptr_t) (key + 1));
+   }
+   vx_hash_memory (flat, &used, &filled);
+
+   for (op = 0; op < VX_CHURN_OPS; op++)
+   {
+      state ^= state >> 12;
+      state ^= state << 25;
+      state ^= state >> 27;
+      key = (state * 0x2545f4914f6cdd1dULL) % (2 * VX_CHURN_KEYS);
+      switch (op % 3)
+      {
+      case 0:
+         foo = vx_hash_delete (chained, &key);
+         bar = vx_hash_delete (flat, &key);
+         break;
+      case 1:
+         foo = vx_hash_put (chained, &key, (void *) (uintptr_t) (op + 1));
+         bar = vx_hash_put (flat, &key, (void *) (uintptr_t) (op + 1));
+         break;
+      default:
+         foo = vx_hash_get (chained, &key);
+         bar = vx_hash_get (flat, &key);
+      }
+      assert (foo == bar);
+      assert (vx_hash_count (chained) == vx_hash_count (flat));
+   }
+
+   vx_hash_memory (flat, &used, &reserved);
+   printf ("churn: %d ops agree, count: %zu flat bytes: %zu after fill, %zu after churn\n",
+           VX_CHURN_OPS, vx_hash_count (flat), filled, reserved);
+   assert (reserved <= 4 * filled);
+   vx_hash_destroy (chained);
+   vx_hash_destroy (flat);
+}
+
+/**
+ * vx_churn_long_keys: put/delete churn on string keys longer than
+ * VX_ARENA_MAX in a VX_HASH_SLAB table; with the population steady the
+ * key arena must not keep growing
+ */
+static void vx_churn_long_keys (void)
+{
+   vx_hash_t *hash;
+   uint64_t state = 0x9e3779b97f4a7c15ULL;
+   size_t op, used, filled, reserved;
+   char key[2 * VX_ARENA_MAX];
+   int len;
+
+   hash = vx_hash_create (16, 0, VX_HASH_COPY_KEYS | VX_HASH_SLAB);
+   memset (key, 'k', sizeof (key) - 1);
+   key[sizeof (key) - 1] = '\0';
+   for (op = 0; op < VX_CHURN_KEYS / 10; op++)
+   {
+      len = sprintf (key, "%06zu", op);
+      key[len] = 'k';
+      vx_hash_put (hash, key, (void *) (uintptr_t) (op + 1));
+   }
+   vx_hash_memory (hash, &used, &filled);
+
+   for (op = 0; op < VX_CHURN_OPS / 4; op++)
+   {
+      state ^= state >> 12;
+      state ^= state << 25;
+      state ^= state >> 27;
+      len = sprintf (key, "%06zu", (size_t) ((state * 0x2545f4914f6cdd1dULL) % (VX_CHURN_KEYS / 5)));
+      key[len] = 'k';
+      if (op % 2)
+         vx_hash_delete (hash, key);
+      else
+         vx_hash_put (hash, key, (void *) (uintptr_t) (op + 1));
+   }
+
+   vx_hash_memory (hash, &used, &reserved);
+   printf ("long key churn: count: %zu slab bytes: %zu after fill, %zu after churn\n",
+           vx_hash_count (hash), filled, reserved);
+   assert (reserved <= 4 * filled);
+   vx_hash_destroy (hash);
+}
+
+/**
+ * vx_rehash_midway: vx_hash_rehash on an incremental table, at counts that
+ * leave a migration pending, must end up the same shape as a plain table
+ */
+static void vx_rehash_midway (void)
+{
+   vx_hash_t *incr, *plain;
+   uint64_t key;
+   size_t count, iused, pused, reserved;
+
+   for (count = 100; count < 5000; count += 37)
+   {
+      incr = vx_hash_create (16, sizeof (uint64_t), VX_HASH_COPY_KEYS | VX_HASH_INCREMENTAL);
+      plain = vx_hash_create (16, sizeof (uint64_t), VX_HASH_COPY_KEYS);
+      for (key = 0; key < count; key++)
+      {
+         vx_hash_put (incr, &key, (void *) (uintptr_t) (key + 1));
+         vx_hash_put (plain, &key, (void *) (uintptr_t) (key + 1));
+      }
+      vx_hash_rehash (incr);
+      vx_hash_rehash (plain);
+      vx_hash_memory (incr, &iused, &reserved);
+      vx_hash_memory (plain, &pused, &reserved);
+      assert (vx_hash_size (incr) == vx_hash_size (plain));
+      assert (iused == pused);
+      vx_hash_destroy (incr);
+      vx_hash_destroy (plain);
+   }
+   printf ("rehash midway: incremental and plain tables agree\n");
+}
+
+int main (int argc, char *argv[])
+{
+   char key[64];
+   char *foo;
+   char bar[64];
+   int ndx;
+   vx_hash_t *hash;
+   void *ptr;
+   char *k, *v;
+   uint32_t ikey, *ik;
+
+   hash = vx_hash_new();
+   printf ("hash count: %zu size: %zu\n", vx_hash_count(hash), vx_hash_size(hash));
+   for (ndx = 0; ndx < 256; ndx++)
+   {
+      sprintf (key, "key%03d", ndx);
+      sprintf (bar, "value%03d", ndx);
+      foo = strdup (bar);
+      vx_hash_put (hash, key, foo);
+      printf ("vx_hash_put: %s -> %s\n", key, foo); 
+   }
+   printf ("hash count: %zu\n", vx_hash_count(hash));
+   for (ndx = 0; ndx < 256; ndx++)
+   {
+      sprintf (key, "key%03d", ndx);
+      foo = (char *) vx_hash_get (hash, key);
+      printf ("vx_hash_get: %s -> %s\n", key, foo); 
+   }
+   printf ("hash count: %zu size: %zu\n", vx_hash_count(hash), vx_hash_size(hash));
+   
+   ptr = NULL;
+   while (vx_hash_get_next(hash, (void **) &k, (void **) &v, &ptr))
+   {
+      printf ("vx_hash_get_next: %s -> %s\n", k, v); 
+   }
+
+   for (ndx = 0; ndx < 256; ndx++)
+   {
+      sprintf (key, "key%03d", ndx);
+      foo = (char *) vx_hash_delete (hash, key);
+      printf ("vx_hash_delete: deleted %s -> %s\n", key, foo); 
+      free (foo);
+   }
+   printf ("hash count: %zu size: %zu\n", vx_hash_count(hash), vx_hash_size(hash));
+
+   vx_hash_destroy (hash);
+
+   hash = vx_hash_create (16, sizeof(uint32_t), VX_HASH_COPY_KEYS);
+
+   for (ikey = 0; ikey < 256; ikey++)
+   {
+      sprintf (bar, "value%03d", ikey);
+      foo = strdup (bar);
+      vx_hash_put (hash, &ikey, foo);
+      printf ("vx_hash_put(uint32_t): %d -> %s\n", ikey, foo); 
+   }
+   printf ("hash count: %zu size: %zu\n", vx_hash_count(hash), vx_hash_size(hash));
+
+   for (ikey = 0; ikey < 256; ikey++)
+   {
+      foo = (char *) vx_hash_get (hash, &ikey);
+      printf ("vx_hash_get(uint32_t): %d -> %s\n", ikey, foo); 
+   }
+   printf ("hash count: %zu size: %zu\n", vx_hash_count(hash), vx_hash_size(hash));
+   
+   ptr = NULL;
+   while (vx_hash_get_next(hash, (void **) &ik, (void **) &v, &ptr))
+   {
+      printf ("vx_hash_get_next(uint32_t): %d -> %s\n", *ik, v); 
+   }
+
+   for (ikey = 0; ikey < 256; ikey++)
+   {
+      foo = (char *) vx_hash_delete (hash, &ikey);
+      printf ("vx_hash_delete(uint32_t): deleted %d -> %s\n", ikey, foo); 
+      free (foo);
+   }
+   printf ("hash count: %zu size: %zu\n", vx_hash_count(hash), vx_hash_size(hash));
+   vx_hash_destroy(hash);
+
+   vx_churn ();
+   vx_churn_long_keys ();
+   vx_rehash_midway ();
+
+   return(0);
+}
@@ -0,0 +1,238 @@
+/**
+ * vx_hash_typed.h Copyright Voxaris Inc, George Howitt 2008
+ */
+
+#ifndef _VX_HASH_TYPED_H_
+#define _VX_HASH_TYPED_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * link value marking a deleted entry
+ */
+#define VX_TYPED_DELETED UINT32_MAX
+
+/**
+ * vx_hash_u64: 64 bit integer key hash (the murmur3 finalizer)
+ */
+static inline uint32_t vx_hash_u64 (uint64_t key)
+{
+   key ^= key >> 33;
+   key *= 0xff51afd7ed558ccdULL;
+   key ^= key >> 33;
+   key *= 0xc4ceb9fe1a85ec53ULL;
+   key ^= key >> 33;
+   return ((uint32_t) key);
+}
+
+/**
+ *
+ */
+static inline uint32_t vx_hash_u32 (uint32_t key)
+{
+   return (vx_hash_u64 (key));
+}
+
+/**
+ *
+ */
+static inline int vx_hash_int_eq (uint64_t foo, uint64_t bar)
+{
+   return (foo == bar);
+}
+
+/**
+ * VX_HASH_TYPED: generate name_t, a table of ktype to vtype with both
+ * stored inline, and its functions as static inline name_create, _destroy,
+ * _put, _get, _delete, _get_next, _count, _size and _rehash. hash_func
+ * (ktype) returns a uint32_t and eq_func (ktype, ktype) non zero for equal
+ * keys; both may be macros and are expanded inline.
+ *
+ * Growth and iteration follow vx_hash_t: size is a power of two, it doubles
+ * once count passes it, and get_next walks entries in insertion order.
+ * Entries live in one array in that order, chained per bin by index; a
+ * delete leaves a hole that the next rebuild squeezes out. Pointers
+ * returned by put and get are good until the next put or delete.
+ *
+ *    VX_HASH_TYPED (vx_u64_map, uint64_t, struct foo, vx_hash_u64, vx_hash_int_eq)
+ */
+#define VX_HASH_TYPED(name, ktype, vtype, hash_func, eq_func)                       \
+                                                                                    \
+typedef struct name##_entry                                                         \
+{                                                                                   \
+   ktype key;                                                                       \
+   vtype value;                                                                     \
+   uint32_t hashval;                                                                \
+   uint32_t link;                                                                   \
+} name##_entry_t;                                                                   \
+                                                                                    \
+typedef struct name                                                                 \
+{                                                                                   \
+   size_t size;                                                                     \
+   size_t count;                                                                    \
+   uint32_t *bins;                                                                  \
+   name##_entry_t *entries;                                                         \
+   size_t nentries;                                                                 \
+   size_t entries_size;                                                             \
+} name##_t;                                                                         \
+                                                                                    \
+static inline name##_t * name##_create (size_t size)                                \
+{                                                                                   \
+   name##_t *hash = calloc (1, sizeof (name##_t));                                  \
+   assert (hash != NULL);                                                           \
+   for (hash->size = 1; hash->size < size; hash->size <<= 1)                        \
+      ;                                                                             \
+   hash->bins = calloc (hash->size, sizeof (uint32_t));                             \
+   assert (hash->bins != NULL);                                                     \
+   hash->entries_size = 16;                                                         \
+   hash->entries = malloc (hash->entries_size * sizeof (name##_entry_t));           \
+   assert (hash->entries != NULL);                                                  \
+   return (hash);                                                                   \
+}                                                                                   \
+                                                                                    \
+static inline void name##_destroy (name##_t *hash)                                  \
+{                                                                                   \
+   free (hash->bins);                                                               \
+   free (hash->entries);                                                            \
+   free (hash);                                                                     \
+}                                                                                   \
+                                                                                    \
+/* rebuild the bins for size, dropping deleted entries */                          \
+static inline void name##_resize (name##_t *hash, size_t size)                      \
+{                                                                                   \
+   uint32_t *bins = calloc (size, sizeof (uint32_t));                               \
+   size_t ndx, live, bindex;                                                        \
+                                                                                    \
+   assert (bins != NULL);                                                           \
+   for (ndx = 0, live = 0; ndx < hash->nentries; ndx++)                             \
+   {                                                                                \
+      if (hash->entries[ndx].link == VX_TYPED_DELETED)                              \
+         continue;                                                                  \
+      if (live != ndx)                                                              \
+         hash->entries[live] = hash->entries[ndx];                                  \
+      bindex = hash->entries[live].hashval & (size - 1);                            \
+      hash->entries[live].link = bins[bindex];                                      \
+      bins[bindex] = (uint32_t) ++live;                                             \
+   }                                                                                \
+   free (hash->bins);                                                               \
+   hash->bins = bins;                                                               \
+   hash->size = size;                                                               \
+   hash->nentries = live;                                                           \
+}                                                                                   \
+                                                                                    \
+static inline void name##_rehash (name##_t *hash)                                   \
+{                                                                                   \
+   name##_resize (hash, hash->size * 2);                                            \
+}                                                                                   \
+                                                                                    \
+/* the link (bin or entry) holding key's index plus one, or NULL */                \
+static inline uint32_t * name##_find (name##_t *hash, ktype key, uint32_t hash_value) \
+{                                                                                   \
+   uint32_t *link = &hash->bins[hash_value & (hash->size - 1)];                     \
+   name##_entry_t *entry;                                                           \
+                                                                                    \
+   for (; *link; link = &entry->link)                                               \
+   {                                                                                \
+      entry = &hash->entries[*link - 1];                                            \
+      if (entry->hashval == hash_value && eq_func (entry->key, key))                \
+         return (link);                                                             \
+   }                                                                                \
+   return (NULL);                                                                   \
+}                                                                                   \
+                                                                                    \
+static inline vtype * name##_get (name##_t *hash, ktype key)                        \
+{                                                                                   \
+   uint32_t *link = name##_find (hash, key, hash_func (key));                       \
+   return (link ? &hash->entries[*link - 1].value : NULL);                          \
+}                                                                                   \
+                                                                                    \
+static inline vtype * name##_put (name##_t *hash, ktype key, vtype value)           \
+{                                                                                   \
+   uint32_t hash_value = hash_func (key);                                           \
+   uint32_t *link = name##_find (hash, key, hash_value);                            \
+   name##_entry_t *entry;                                                           \
+                                                                                    \
+   if (link)                                                                        \
+   {                                                                                \
+      entry = &hash->entries[*link - 1];                                            \
+      entry->value = value;                                                         \
+      return (&entry->value);                                                       \
+   }                                                                                \
+                                                                                    \
+   if (hash->count > hash->size)                                                    \
+      name##_resize (hash, hash->size * 2);                                         \
+   else if (hash->nentries == hash->entries_size && hash->count < hash->nentries / 2) \
+      name##_resize (hash, hash->size);                                             \
+                                                                                    \
+   if (hash->nentries == hash->entries_size)                                        \
+   {                                                                                \
+      assert (hash->entries_size < VX_TYPED_DELETED / 2);                           \
+      hash->entries_size *= 2;                                                      \
+      hash->entries = realloc (hash->entries, hash->entries_size * sizeof (name##_entry_t)); \
+      assert (hash->entries != NULL);                                               \
+   }                                                                                \
+                                                                                    \
+   link = &hash->bins[hash_value & (hash->size - 1)];                               \
+   entry = &hash->entries[hash->nentries];                                          \
+   entry->key = key;                                                                \
+   entry->value = value;                                                            \
+   entry->hashval = hash_value;                                                     \
+   entry->link = *link;                                                             \
+   *link = (uint32_t) ++hash->nentries;                                             \
+   hash->count++;                                                                   \
+   return (&entry->value);                                                          \
+}                                                                                   \
+                                                                                    \
+/* copies the value out to *value unless that is NULL, 0 if key is absent */       \
+static inline int name##_delete (name##_t *hash, ktype key, vtype *value)           \
+{                                                                                   \
+   uint32_t *link = name##_find (hash, key, hash_func (key));                       \
+   name##_entry_t *entry;                                                           \
+                                                                                    \
+   if (link == NULL)                                                                \
+      return (0);                                                                   \
+   entry = &hash->entries[*link - 1];                                               \
+   if (value)                                                                       \
+      *value = entry->value;                                                        \
+   *link = entry->link;                                                             \
+   entry->link = VX_TYPED_DELETED;                                                  \
+   hash->count--;                                                                   \
+   return (1);                                                                      \
+}                                                                                   \
+                                                                                    \
+/* *ptr starts at 0 and holds the next entry index */                              \
+static inline int name##_get_next (name##_t *hash, ktype **key, vtype **value, size_t *ptr)   \
+{                                                                                   \
+   while (*ptr < hash->nentries && hash->entries[*ptr].link == VX_TYPED_DELETED)    \
+      (*ptr)++;                                                                     \
+   if (*ptr >= hash->nentries)                                                      \
+      return (0);                                                                   \
+   *key = &hash->entries[*ptr].key;                                                 \
+   *value = &hash->entries[*ptr].value;                                             \
+   (*ptr)++;                                                                        \
+   return (1);                                                                      \
+}                                                                                   \
+                                                                                    \
+static inline size_t name##_count (name##_t *hash)                                  \
+{                                                                                   \
+   return (hash->count);                                                            \
+}                                                                                   \
+                                                                                    \
+static inline size_t name##_size (name##_t *hash)                                   \
+{                                                                                   \
+   return (hash->size);                                                             \
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,328 @@
+/**
+ * Copyright 2008 - 2012 Ampersand, Inc.  All rights reserved.
+*/
+
+#include <vx_msgring.h>
+#include <vx_log.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#endif
+
+#define VX_MSGRING_CACHELINE 64
+
+#define THOUSAND 1000
+#define MILLION  1000000
+#define BILLION  1000000000
+
+/**
+ * vx_msgring_t: slots is size slots of stride bytes, each a
+ * vx_msgring_msg_t. A slot's seq is pos while it is free for the push at
+ * pos, pos + 1 once that push is committed and pos + size once it is
+ * released again.
+ */
+struct vx_msgring
+{
+   char *slots;
+   size_t mask;
+   size_t stride;
+   size_t max;
+   vx_sync_t *sync;
+   size_t waiters;
+   vx_sync_t *room;
+   size_t room_waiters;
+   char pad0[VX_MSGRING_CACHELINE];
+   size_t prod;
+   char pad1[VX_MSGRING_CACHELINE - sizeof (size_t)];
+   size_t cons;
+   char pad2[VX_MSGRING_CACHELINE - sizeof (size_t)];
+};
+
+static inline vx_msgring_msg_t * vx_msgring_slot (vx_msgring_t *ring, size_t pos)
+{
+   return ((vx_msgring_msg_t *) (ring->slots + (pos & ring->mask) * ring->stride));
+}
+
+static inline void vx_msgring_pause (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause ();
+#endif
+}
+
+static void vx_msgring_deadline (struct timespec *ts, uint32_t msec)
+{
+   clock_gettime (CLOCK_REALTIME, ts);
+   ts->tv_sec += (msec + ts->tv_nsec/MILLION)/THOUSAND;
+   msec = msec % THOUSAND;
+   ts->tv_nsec = (MILLION*msec + ts->tv_nsec) % BILLION;
+}
+
+/**
+ * The wakeup handshake is vx_ring's: with membarrier the side about to
+ * park pays for the fence, and commit and release only need a compiler
+ * barrier.
+ */
+static pthread_once_t vx_msgring_once = PTHREAD_ONCE_INIT;
+static int vx_msgring_asym = 0;
+
+static void vx_msgring_asym_init (void)
+{
+#if defined(__linux__) && defined(SYS_membarrier)
+   vx_msgring_asym = syscall (SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+#endif
+}
+
+static inline void vx_msgring_fence_fast (void)
+{
+   if (vx_msgring_asym)
+      __atomic_signal_fence (__ATOMIC_SEQ_CST);
+   else
+      __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+static void vx_msgring_fence_slow (void)
+{
+#if defined(__linux__) && defined(SYS_membarrier)
+   if (vx_msgring_asym && syscall (SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) == 0)
+      return;
+#endif
+   __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+/**
+ * vx_msgring_wake: every waiter wants the slot at the one position, and
+ * slots complete out of order, so a lone signal can go to a waiter that
+ * finds its slot still pending and parks again while the slot that did
+ * complete has nobody awake for it. With more than one parked, wake all.
+ */
+static inline void vx_msgring_wake (vx_sync_t *sync, size_t *waiters)
+{
+   size_t parked;
+
+   vx_msgring_fence_fast ();
+   if ((parked = __atomic_load_n (waiters, __ATOMIC_RELAXED)) != 0)
+   {
+      vx_sync_lock (sync);
+      if (parked > 1)
+         vx_sync_broadcast (sync);
+      else
+         vx_sync_signal (sync);
+      vx_sync_unlock (sync);
+   }
+}
+
+/**
+ * vx_msgring_ready: the slot at the producer's (consumer's) position has
+ * the seq its next push (pop) wants, off is 0 (1)
+ */
+static inline int vx_msgring_ready (vx_msgring_t *ring, size_t *pos, size_t off)
+{
+   size_t at = __atomic_load_n (pos, __ATOMIC_RELAXED);
+
+   return (__atomic_load_n (&vx_msgring_slot (ring, at)->seq, __ATOMIC_ACQUIRE) == at + off);
+}
+
+/**
+ * vx_msgring_wait: one round of waiting for ready, spinning for the first
+ * VX_RING_SPIN rounds and then parking on sync. ts is set up by the first
+ * park.
+ */
+static vx_status_t vx_msgring_wait (vx_msgring_t *ring, vx_sync_t *sync, size_t *waiters,
+                                    size_t *pos, size_t off, uint32_t round, uint32_t msec,
+                                    struct timespec *ts)
+{
+   vx_status_t rc = VX_SUCCESS;
+
+   if (round < VX_RING_SPIN)
+   {
+      vx_msgring_pause ();
+      return (VX_SUCCESS);
+   }
+   if (round == VX_RING_SPIN && msec != VX_RING_FOREVER)
+      vx_msgring_deadline (ts, msec);
+
+   vx_sync_lock (sync);
+   __atomic_add_fetch (waiters, 1, __ATOMIC_RELAXED);
+   vx_msgring_fence_slow ();
+   if (!vx_msgring_ready (ring, pos, off))
+   {
+      if (msec == VX_RING_FOREVER)
+         vx_sync_wait (sync);
+      else
+         rc = vx_sync_timedwait (sync, ts);
+   }
+   __atomic_sub_fetch (waiters, 1, __ATOMIC_RELAXED);
+   vx_sync_unlock (sync);
+   return (rc);
+}
+
+vx_status_t vx_msgring_create (vx_msgring_t **ring, size_t size, size_t max)
+{
+   vx_status_t rc;
+   size_t slots, pos;
+
+   pthread_once (&vx_msgring_once, vx_msgring_asym_init);
+
+   for (slots = 2; slots < size; slots <<= 1)
+      ;
+   if (posix_memalign ((void **) ring, VX_MSGRING_CACHELINE, sizeof (vx_msgring_t)))
+      return (VX_ENOMEM);
+   memset ((*ring), 0, sizeof (vx_msgring_t));
+   (*ring)->mask = slots - 1;
+   (*ring)->max = max;
+   (*ring)->stride = (sizeof (vx_msgring_msg_t) + max + VX_MSGRING_CACHELINE - 1) &
+                     ~(size_t) (VX_MSGRING_CACHELINE - 1);
+
+   if (posix_memalign ((void **) &(*ring)->slots, VX_MSGRING_CACHELINE, slots * (*ring)->stride))
+   {
+      vxlog (LOG_ERR, "{%s:%d} %zu slots of %zu bytes: no memory", __func__, __LINE__,
+         slots, (*ring)->stride);
+      free (*ring);
+      return (VX_ENOMEM);
+   }
+   for (pos = 0; pos < slots; pos++)
+      vx_msgring_slot (*ring, pos)->seq = pos;
+
+   if ((rc = vx_sync_create (&(*ring)->sync, NULL)) != VX_SUCCESS ||
+       (rc = vx_sync_create (&(*ring)->room, NULL)) != VX_SUCCESS)
+   {
+      vx_msgring_destroy (*ring);
+      return (rc);
+   }
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_msgring_destroy (vx_msgring_t *ring)
+{
+   vx_sync_destroy (ring->sync);
+   vx_sync_destroy (ring->room);
+   free (ring->slots);
+   free (ring);
+   return (VX_SUCCESS);
+}
+
+size_t vx_msgring_max (vx_msgring_t *ring)
+{
+   return (ring->max);
+}
+
+vx_status_t vx_msgring_reserve (vx_msgring_t *ring, size_t len, vx_msgring_msg_t **msg, uint32_t msec)
+{
+   struct timespec ts;
+   vx_status_t rc;
+   uint32_t round;
+   size_t pos, seq;
+   intptr_t diff;
+
+   if (len > ring->max)
+      return (VX_FAILURE);
+
+   pos = __atomic_load_n (&ring->prod, __ATOMIC_RELAXED);
+   for (round = 0; ; )
+   {
+      (*msg) = vx_msgring_slot (ring, pos);
+      seq = __atomic_load_n (&(*msg)->seq, __ATOMIC_ACQUIRE);
+      diff = (intptr_t) seq - (intptr_t) pos;
+      if (diff == 0)
+      {
+         if (__atomic_compare_exchange_n (&ring->prod, &pos, pos + 1, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+      }
+      else if (diff < 0)
+      {
+         /* full: the slot still holds the message from a lap ago */
+         if (msec == 0)
+            return (VX_EFULL);
+         if ((rc = vx_msgring_wait (ring, ring->room, &ring->room_waiters, &ring->prod, 0,
+                                    round++, msec, &ts)) != VX_SUCCESS)
+            return (rc);
+         pos = __atomic_load_n (&ring->prod, __ATOMIC_RELAXED);
+      }
+      else
+         pos = __atomic_load_n (&ring->prod, __ATOMIC_RELAXED);
+   }
+   (*msg)->len = len;
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_msgring_commit (vx_msgring_t *ring, vx_msgring_msg_t *msg, size_t len)
+{
+   if (len > msg->len)
+      return (VX_FAILURE);
+   msg->len = len;
+   __atomic_store_n (&msg->seq, msg->seq + 1, __ATOMIC_RELEASE);
+   vx_msgring_wake (ring->sync, &ring->waiters);
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_msgring_push (vx_msgring_t *ring, const void *data, size_t len, uint32_t msec)
+{
+   vx_msgring_msg_t *msg;
+   vx_status_t rc;
+
+   if ((rc = vx_msgring_reserve (ring, len, &msg, msec)) != VX_SUCCESS)
+      return (rc);
+   memcpy (msg->data, data, len);
+   return (vx_msgring_commit (ring, msg, len));
+}
+
+vx_status_t vx_msgring_peek (vx_msgring_t *ring, vx_msgring_msg_t **msg, uint32_t msec)
+{
+   struct timespec ts;
+   vx_status_t rc;
+   uint32_t round;
+   size_t pos, seq;
+   intptr_t diff;
+
+   pos = __atomic_load_n (&ring->cons, __ATOMIC_RELAXED);
+   for (round = 0; ; )
+   {
+      (*msg) = vx_msgring_slot (ring, pos);
+      seq = __atomic_load_n (&(*msg)->seq, __ATOMIC_ACQUIRE);
+      diff = (intptr_t) seq - (intptr_t) (pos + 1);
+      if (diff == 0)
+      {
+         if (__atomic_compare_exchange_n (&ring->cons, &pos, pos + 1, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return (VX_SUCCESS);
+      }
+      else if (diff < 0)
+      {
+         /* empty, or the oldest push is not committed yet */
+         if (msec == 0)
+            return (VX_EEMPTY);
+         if ((rc = vx_msgring_wait (ring, ring->sync, &ring->waiters, &ring->cons, 1,
+                                    round++, msec, &ts)) != VX_SUCCESS)
+            return (rc);
+         pos = __atomic_load_n (&ring->cons, __ATOMIC_RELAXED);
+      }
+      else
+         pos = __atomic_load_n (&ring->cons, __ATOMIC_RELAXED);
+   }
+}
+
+vx_status_t vx_msgring_release (vx_msgring_t *ring, vx_msgring_msg_t *msg)
+{
+   __atomic_store_n (&msg->seq, msg->seq + ring->mask, __ATOMIC_RELEASE);
+   vx_msgring_wake (ring->room, &ring->room_waiters);
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_msgring_pop (vx_msgring_t *ring, void *buf, size_t size, size_t *len, uint32_t msec)
+{
+   vx_msgring_msg_t *msg;
+   vx_status_t rc;
+
+   if (size < ring->max)
+      return (VX_FAILURE);
+   if ((rc = vx_msgring_peek (ring, &msg, msec)) != VX_SUCCESS)
+      return (rc);
+   (*len) = msg->len;
+   memcpy (buf, msg->data, msg->len);
+   return (vx_msgring_release (ring, msg));
+}
@@ -0,0 +1,61 @@
+/**
+ * Copyright 2008 - 2012 Ampersand, Inc.  All rights reserved.
+*/
+
+#ifndef _VX_MSGRING_H_
+#define _VX_MSGRING_H_
+
+#include <vx_ring.h>
+
+/**
+ * vx_msgring_msg_t: one slot of the ring. Between reserve and commit, or
+ * peek and release, data and len belong to the caller; seq is the ring's.
+ */
+typedef struct vx_msgring_msg
+{
+   size_t seq;
+   size_t len;
+   char data[];
+} vx_msgring_msg_t;
+
+/**
+ * vx_msgring_t: lock free ring of messages held inline, for any number of
+ * pushing and popping threads. Each slot holds up to max bytes, so a
+ * message costs no allocation and a consumer reads it from the slot the
+ * producer wrote. Producers reserve a slot, build the message in place
+ * and commit it; consumers peek at the oldest, read it in place and
+ * release it. Every reserve must be committed and every peek released,
+ * and until then later slots are held up behind it.
+ *
+ * The msec argument is 0 to fail at once (VX_EFULL, VX_EEMPTY),
+ * VX_RING_FOREVER to wait as long as it takes, and otherwise the longest
+ * wait before VX_TIMEOUT. Waiters spin VX_RING_SPIN pause rounds, then park.
+ */
+typedef struct vx_msgring vx_msgring_t;
+
+/**
+ * vx_msgring_create: size slots (rounded up to a power of 2) of max bytes
+ * each; slots are padded to cache lines
+ */
+vx_status_t vx_msgring_create (vx_msgring_t **ring, size_t size, size_t max);
+vx_status_t vx_msgring_destroy (vx_msgring_t *ring);
+size_t vx_msgring_max (vx_msgring_t *ring);
+
+/**
+ * producer side: reserve a slot for up to len bytes (at most max), write
+ * msg->data, then commit with the len actually used
+ */
+vx_status_t vx_msgring_reserve (vx_msgring_t *ring, size_t len, vx_msgring_msg_t **msg, uint32_t msec);
+vx_status_t vx_msgring_commit (vx_msgring_t *ring, vx_msgring_msg_t *msg, size_t len);
+vx_status_t vx_msgring_push (vx_msgring_t *ring, const void *data, size_t len, uint32_t msec);
+
+/**
+ * consumer side: peek hands out the oldest message, msg->len bytes at
+ * msg->data, until release. pop copies it out to buf, which must hold max
+ * bytes.
+ */
+vx_status_t vx_msgring_peek (vx_msgring_t *ring, vx_msgring_msg_t **msg, uint32_t msec);
+vx_status_t vx_msgring_release (vx_msgring_t *ring, vx_msgring_msg_t *msg);
+vx_status_t vx_msgring_pop (vx_msgring_t *ring, void *buf, size_t size, size_t *len, uint32_t msec);
+
+#endif
@@ -0,0 +1,247 @@
+/**
+ * Copyright 2008 - 2012 Ampersand, Inc.  All rights reserved.
+ *
+ * vx_msgring stress check. First, consumers that each take one message
+ * park on an empty ring and the messages are committed last slot first:
+ * every commit but the final one wakes a consumer whose slot is still
+ * pending, so unless the final commit wakes them all, consumers sleep on
+ * with their messages ready. Then producers reserve, fill and commit
+ * messages and consumers peek, check and release them on a ring of a few
+ * slots, every side waiting forever, with some threads pausing between the
+ * two halves so slots complete out of order. A lost wakeup hangs the run
+ * and the alarm turns that into a failure. Every message must arrive
+ * exactly once and intact.
+ *
+ *    vx_msgring_main [-p producers] [-c consumers] [-s slots] [-n messages] [-t secs]
+ */
+
+#include <vx_msgring.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+
+#define VX_MAIN_THREADS 16
+#define VX_MAIN_MAX     64
+
+typedef struct vx_main
+{
+   vx_msgring_t *ring;
+   size_t producers;
+   size_t messages;
+   uint8_t *seen;
+} vx_main_t;
+
+typedef struct vx_main_thread
+{
+   vx_main_t *run;
+   size_t index;
+   pthread_t thread;
+} vx_main_thread_t;
+
+static void vx_main_alarm (int sig)
+{
+   static const char msg[] = "vx_msgring_main: no progress, lost wakeup?\n";
+   ssize_t rc;
+
+   rc = write (STDERR_FILENO, msg, sizeof (msg) - 1);
+   _exit (rc < 0 ? 3 : 2);
+}
+
+/**
+ * a message is its number (producer * messages + n + 1, 0 for stop)
+ * followed by len - 8 bytes of that number's low byte
+ */
+static void * vx_main_producer (void *arg)
+{
+   vx_main_thread_t *self = (vx_main_thread_t *) arg;
+   vx_main_t *run = self->run;
+   vx_msgring_msg_t *msg;
+   uint64_t id;
+   size_t ndx, len;
+   vx_status_t rc;
+
+   for (ndx = 0; ndx < run->messages; ndx++)
+   {
+      id = self->index * run->messages + ndx + 1;
+      len = sizeof (id) + id % (VX_MAIN_MAX - sizeof (id) + 1);
+      rc = vx_msgring_reserve (run->ring, VX_MAIN_MAX, &msg, VX_RING_FOREVER);
+      assert (rc == VX_SUCCESS);
+      memcpy (msg->data, &id, sizeof (id));
+      memset (msg->data + sizeof (id), (int) (id & 0xff), len - sizeof (id));
+      if ((self->index + ndx) % 7 == 0)
+         sched_yield ();
+      rc = vx_msgring_commit (run->ring, msg, len);
+      assert (rc == VX_SUCCESS);
+   }
+   return (NULL);
+}
+
+static void * vx_main_consumer (void *arg)
+{
+   vx_main_thread_t *self = (vx_main_thread_t *) arg;
+   vx_main_t *run = self->run;
+   vx_msgring_msg_t *msg;
+   uint64_t id;
+   uint8_t seen;
+   size_t ndx, round;
+   vx_status_t rc;
+
+   for (round = 0; ; round++)
+   {
+      rc = vx_msgring_peek (run->ring, &msg, VX_RING_FOREVER);
+      assert (rc == VX_SUCCESS);
+      assert (msg->len >= sizeof (id));
+      memcpy (&id, msg->data, sizeof (id));
+      if (id == 0)
+      {
+         vx_msgring_release (run->ring, msg);
+         return (NULL);
+      }
+      assert (id <= run->producers * run->messages);
+      assert (msg->len == sizeof (id) + id % (VX_MAIN_MAX - sizeof (id) + 1));
+      for (ndx = sizeof (id); ndx < msg->len; ndx++)
+         assert ((uint8_t) msg->data[ndx] == (id & 0xff));
+      seen = __atomic_add_fetch (&run->seen[id - 1], 1, __ATOMIC_RELAXED);
+      assert (seen == 1);
+      if ((self->index + round) % 5 == 0)
+         sched_yield ();
+      vx_msgring_release (run->ring, msg);
+   }
+}
+
+static void * vx_main_once (void *arg)
+{
+   vx_main_t *run = (vx_main_t *) arg;
+   vx_msgring_msg_t *msg;
+   vx_status_t rc;
+   uint8_t seen;
+
+   rc = vx_msgring_peek (run->ring, &msg, VX_RING_FOREVER);
+   assert (rc == VX_SUCCESS && msg->len == 1);
+   seen = __atomic_add_fetch (&run->seen[(uint8_t) msg->data[0]], 1, __ATOMIC_RELAXED);
+   assert (seen == 1);
+   vx_msgring_release (run->ring, msg);
+   return (NULL);
+}
+
+/**
+ * vx_main_reverse: count one-shot consumers parked, count slots reserved
+ * and committed last first, a pause between commits for the woken
+ * consumer to find its slot pending and park again
+ */
+static void vx_main_reverse (size_t count)
+{
+   vx_msgring_msg_t *msgs[VX_MAIN_THREADS];
+   pthread_t threads[VX_MAIN_THREADS];
+   struct timespec pause = { 0, 20 * 1000 * 1000 };
+   vx_main_t run;
+   vx_status_t rc;
+   size_t ndx;
+
+   assert (count && count <= VX_MAIN_THREADS);
+   memset (&run, 0, sizeof (run));
+   run.seen = calloc (count, 1);
+   assert (run.seen != NULL);
+   rc = vx_msgring_create (&run.ring, count, 1);
+   assert (rc == VX_SUCCESS);
+
+   for (ndx = 0; ndx < count; ndx++)
+      pthread_create (&threads[ndx], NULL, vx_main_once, &run);
+   nanosleep (&pause, NULL);
+   for (ndx = 0; ndx < count; ndx++)
+   {
+      rc = vx_msgring_reserve (run.ring, 1, &msgs[ndx], 0);
+      assert (rc == VX_SUCCESS);
+      msgs[ndx]->data[0] = (char) ndx;
+   }
+   for (ndx = count; ndx-- > 0; )
+   {
+      rc = vx_msgring_commit (run.ring, msgs[ndx], 1);
+      assert (rc == VX_SUCCESS);
+      nanosleep (&pause, NULL);
+   }
+   for (ndx = 0; ndx < count; ndx++)
+      pthread_join (threads[ndx], NULL);
+
+   for (ndx = 0; ndx < count; ndx++)
+      assert (run.seen[ndx] == 1);
+   printf ("msgring: %zu parked consumers, commits in reverse: all woken\n", count);
+   vx_msgring_destroy (run.ring);
+   free (run.seen);
+}
+
+int main (int argc, char *argv[])
+{
+   vx_main_thread_t prod[VX_MAIN_THREADS], cons[VX_MAIN_THREADS];
+   size_t producers = 4, consumers = 4, slots = 4, ndx;
+   unsigned int secs = 120;
+   uint64_t stop = 0;
+   vx_main_t run;
+   vx_status_t rc;
+   int opt;
+
+   memset (&run, 0, sizeof (run));
+   run.messages = 20000;
+   while ((opt = getopt (argc, argv, "p:c:s:n:t:")) != -1)
+   {
+      switch (opt)
+      {
+      case 'p': producers = strtoul (optarg, NULL, 0); break;
+      case 'c': consumers = strtoul (optarg, NULL, 0); break;
+      case 's': slots = strtoul (optarg, NULL, 0); break;
+      case 'n': run.messages = strtoul (optarg, NULL, 0); break;
+      case 't': secs = strtoul (optarg, NULL, 0); break;
+      default:
+         fprintf (stderr, "usage: %s [-p producers] [-c consumers] [-s slots] "
+                  "[-n messages] [-t secs]\n", argv[0]);
+         return (1);
+      }
+   }
+   assert (producers && producers <= VX_MAIN_THREADS && consumers && consumers <= VX_MAIN_THREADS);
+
+   signal (SIGALRM, vx_main_alarm);
+   alarm (secs);
+
+   vx_main_reverse (consumers);
+
+   run.producers = producers;
+   run.seen = calloc (producers * run.messages, 1);
+   assert (run.seen != NULL);
+   rc = vx_msgring_create (&run.ring, slots, VX_MAIN_MAX);
+   assert (rc == VX_SUCCESS);
+
+   for (ndx = 0; ndx < consumers; ndx++)
+   {
+      cons[ndx].run = &run;
+      cons[ndx].index = ndx;
+      pthread_create (&cons[ndx].thread, NULL, vx_main_consumer, &cons[ndx]);
+   }
+   for (ndx = 0; ndx < producers; ndx++)
+   {
+      prod[ndx].run = &run;
+      prod[ndx].index = ndx;
+      pthread_create (&prod[ndx].thread, NULL, vx_main_producer, &prod[ndx]);
+   }
+   for (ndx = 0; ndx < producers; ndx++)
+      pthread_join (prod[ndx].thread, NULL);
+   for (ndx = 0; ndx < consumers; ndx++)
+   {
+      rc = vx_msgring_push (run.ring, &stop, sizeof (stop), VX_RING_FOREVER);
+      assert (rc == VX_SUCCESS);
+   }
+   for (ndx = 0; ndx < consumers; ndx++)
+      pthread_join (cons[ndx].thread, NULL);
+   alarm (0);
+
+   for (ndx = 0; ndx < producers * run.messages; ndx++)
+      assert (run.seen[ndx] == 1);
+   printf ("msgring: %zu producers, %zu consumers, %zu slots: %zu messages once each\n",
+           producers, consumers, slots, producers * run.messages);
+   vx_msgring_destroy (run.ring);
+   free (run.seen);
+   return (0);
+}
@@ -0,0 +1,472 @@
+/**
+ * Copyright 2008 - 2012 Ampersand, Inc.  All rights reserved.
+*/
+
+#include <vx_pool.h>
+#include <vx_log.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <assert.h>
+
+#define VX_POOL_CACHELINE 64
+/* empty scans a worker pauses between, then yields between, before parking */
+#define VX_POOL_SPIN   64
+#define VX_POOL_YIELD  4
+
+typedef struct vx_pool_task
+{
+   vx_pool_func_t func;
+   void *arg;
+} vx_pool_task_t;
+
+/**
+ * vx_pool_array_t: a deque's slots. Thieves may still be reading an array
+ * the owner has outgrown, so old arrays hang off next until destroy.
+ */
+typedef struct vx_pool_array
+{
+   int64_t mask;
+   struct vx_pool_array *next;
+   vx_pool_task_t tasks[];
+} vx_pool_array_t;
+
+/**
+ * vx_pool_worker_t: thieves CAS top, only the owner moves bottom, so the
+ * two live on separate lines. spawned and done count the tasks this
+ * worker submitted and ran; vx_pool_wait polls them, so they get a third
+ * line of their own and the struct is a whole number of lines.
+ */
+typedef struct vx_pool_worker
+{
+   int64_t top;
+   char pad0[VX_POOL_CACHELINE - sizeof (int64_t)];
+   int64_t bottom;
+   vx_pool_array_t *array;
+   uint64_t seed;
+   vx_pool_t *pool;
+   pthread_t thread;
+   char pad1[VX_POOL_CACHELINE - sizeof (int64_t) - sizeof (vx_pool_array_t *) -
+             sizeof (uint64_t) - sizeof (vx_pool_t *) - sizeof (pthread_t)];
+   uint64_t spawned;
+   uint64_t done;
+   char pad2[VX_POOL_CACHELINE - 2 * sizeof (uint64_t)];
+} vx_pool_worker_t;
+
+struct vx_pool
+{
+   size_t nthreads;
+   size_t started;
+   vx_pool_worker_t *workers;
+   vx_ring_t *inject;
+   vx_sync_t *sync;
+   vx_sync_t *quiet;
+   size_t sleepers;
+   size_t waiting;
+   int shutdown;
+   /* bumped by every outside submit, kept off the line workers read */
+   char pad0[VX_POOL_CACHELINE];
+   uint64_t submitted;
+   char pad1[VX_POOL_CACHELINE - sizeof (uint64_t)];
+};
+
+static __thread vx_pool_worker_t *vx_pool_self;
+
+static inline void vx_pool_pause (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause ();
+#endif
+}
+
+static inline uint64_t vx_pool_rand (vx_pool_worker_t *worker)
+{
+   uint64_t x = worker->seed;
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   worker->seed = x;
+   return (x * 0x2545f4914f6cdd1dULL);
+}
+
+static vx_pool_array_t * vx_deque_array (int64_t size)
+{
+   vx_pool_array_t *array = malloc (sizeof (vx_pool_array_t) + size * sizeof (vx_pool_task_t));
+
+   if (array == NULL)
+      return (NULL);
+   array->mask = size - 1;
+   array->next = NULL;
+   return (array);
+}
+
+/**
+ * vx_deque_push: owner only; slots are stored before bottom is released
+ */
+static vx_status_t vx_deque_push (vx_pool_worker_t *worker, vx_pool_func_t func, void *arg)
+{
+   int64_t b = worker->bottom, t = __atomic_load_n (&worker->top, __ATOMIC_ACQUIRE), ndx;
+   vx_pool_array_t *array = worker->array, *grown;
+
+   if (b - t > array->mask)
+   {
+      if ((grown = vx_deque_array ((array->mask + 1) * 2)) == NULL)
+         return (VX_ENOMEM);
+      for (ndx = t; ndx < b; ndx++)
+         grown->tasks[ndx & grown->mask] = array->tasks[ndx & array->mask];
+      grown->next = array;
+      __atomic_store_n (&worker->array, grown, __ATOMIC_RELEASE);
+      array = grown;
+   }
+   __atomic_store_n (&array->tasks[b & array->mask].func, func, __ATOMIC_RELAXED);
+   __atomic_store_n (&array->tasks[b & array->mask].arg, arg, __ATOMIC_RELAXED);
+   __atomic_store_n (&worker->bottom, b + 1, __ATOMIC_RELEASE);
+   return (VX_SUCCESS);
+}
+
+/**
+ * vx_deque_take: owner only, pops the newest task; the last one left is
+ * raced for with the thieves on top
+ */
+static int vx_deque_take (vx_pool_worker_t *worker, vx_pool_task_t *task)
+{
+   int64_t b = worker->bottom - 1, t;
+   vx_pool_array_t *array = worker->array;
+   int found = 1;
+
+   __atomic_store_n (&worker->bottom, b, __ATOMIC_RELAXED);
+   __atomic_thread_fence (__ATOMIC_SEQ_CST);
+   t = __atomic_load_n (&worker->top, __ATOMIC_RELAXED);
+   if (t > b)
+   {
+      __atomic_store_n (&worker->bottom, b + 1, __ATOMIC_RELAXED);
+      return (0);
+   }
+   task->func = __atomic_load_n (&array->tasks[b & array->mask].func, __ATOMIC_RELAXED);
+   task->arg = __atomic_load_n (&array->tasks[b & array->mask].arg, __ATOMIC_RELAXED);
+   if (t == b)
+   {
+      found = __atomic_compare_exchange_n (&worker->top, &t, t + 1, 0,
+                                           __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+      __atomic_store_n (&worker->bottom, b + 1, __ATOMIC_RELAXED);
+   }
+   return (found);
+}
+
+/**
+ * vx_deque_steal: any thread, takes the oldest task; a lost race with
+ * another thief or the owner just tries again while tasks remain
+ */
+static int vx_deque_steal (vx_pool_worker_t *worker, vx_pool_task_t *task)
+{
+   int64_t t, b;
+   vx_pool_array_t *array;
+
+   for (;;)
+   {
+      t = __atomic_load_n (&worker->top, __ATOMIC_ACQUIRE);
+      __atomic_thread_fence (__ATOMIC_SEQ_CST);
+      b = __atomic_load_n (&worker->bottom, __ATOMIC_ACQUIRE);
+      if (t >= b)
+         return (0);
+      array = __atomic_load_n (&worker->array, __ATOMIC_ACQUIRE);
+      task->func = __atomic_load_n (&array->tasks[t & array->mask].func, __ATOMIC_RELAXED);
+      task->arg = __atomic_load_n (&array->tasks[t & array->mask].arg, __ATOMIC_RELAXED);
+      if (__atomic_compare_exchange_n (&worker->top, &t, t + 1, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+         return (1);
+   }
+}
+
+static int vx_deque_empty (vx_pool_worker_t *worker)
+{
+   return (__atomic_load_n (&worker->top, __ATOMIC_ACQUIRE) >=
+           __atomic_load_n (&worker->bottom, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * vx_pool_wake: after queueing a task, wake a parked worker if there is
+ * one. Pairs with the fence in vx_pool_park: either the worker sees the
+ * task or we see the worker.
+ */
+static void vx_pool_wake (vx_pool_t *pool)
+{
+   __atomic_thread_fence (__ATOMIC_SEQ_CST);
+   if (__atomic_load_n (&pool->sleepers, __ATOMIC_RELAXED))
+   {
+      vx_sync_lock (pool->sync);
+      vx_sync_signal (pool->sync);
+      vx_sync_unlock (pool->sync);
+   }
+}
+
+/**
+ * vx_pool_quiet: every submitted task has run. done is read before
+ * spawned, and a task is counted as submitted before it can be counted as
+ * done, so equal sums mean nothing was pending once the done reads ended.
+ */
+static int vx_pool_quiet (vx_pool_t *pool)
+{
+   uint64_t done = 0, spawned;
+   size_t ndx;
+
+   for (ndx = 0; ndx < pool->nthreads; ndx++)
+      done += __atomic_load_n (&pool->workers[ndx].done, __ATOMIC_ACQUIRE);
+   spawned = __atomic_load_n (&pool->submitted, __ATOMIC_ACQUIRE);
+   for (ndx = 0; ndx < pool->nthreads; ndx++)
+      spawned += __atomic_load_n (&pool->workers[ndx].spawned, __ATOMIC_ACQUIRE);
+   return (done == spawned);
+}
+
+static int vx_pool_ready (vx_pool_t *pool)
+{
+   vx_ring_stats_t stats;
+   size_t ndx;
+
+   for (ndx = 0; ndx < pool->nthreads; ndx++)
+      if (!vx_deque_empty (&pool->workers[ndx]))
+         return (1);
+   vx_ring_stats (pool->inject, &stats);
+   return (stats.depth > 0);
+}
+
+/**
+ * vx_pool_find: own deque first, then a batch from the injection ring,
+ * then one pass over the other deques from a random victim
+ */
+static int vx_pool_find (vx_pool_worker_t *self, vx_pool_task_t *task)
+{
+   vx_pool_t *pool = self->pool;
+   vx_pool_task_t *batch[VX_POOL_BATCH];
+   size_t count, ndx, victim;
+
+   if (vx_deque_take (self, task))
+      return (1);
+
+   if (vx_ring_trypop_n (pool->inject, (void **) batch, VX_POOL_BATCH, &count) == VX_SUCCESS)
+   {
+      (*task) = *batch[0];
+      free (batch[0]);
+      /* our deque is empty and never smaller than VX_POOL_BATCH, no grow */
+      for (ndx = 1; ndx < count; ndx++)
+      {
+         vx_deque_push (self, batch[ndx]->func, batch[ndx]->arg);
+         free (batch[ndx]);
+      }
+      if (count > 1)
+         vx_pool_wake (pool);
+      return (1);
+   }
+
+   victim = (size_t) (vx_pool_rand (self) % pool->nthreads);
+   for (ndx = 0; ndx < pool->nthreads; ndx++)
+   {
+      if (&pool->workers[victim] != self && vx_deque_steal (&pool->workers[victim], task))
+         return (1);
+      if (++victim == pool->nthreads)
+         victim = 0;
+   }
+   return (0);
+}
+
+/**
+ * vx_pool_park: let a vx_pool_wait caller know if we went quiet, then
+ * sleep until a submit or destroy unless work showed up meanwhile
+ */
+static void vx_pool_park (vx_pool_t *pool)
+{
+   __atomic_thread_fence (__ATOMIC_SEQ_CST);
+   if (__atomic_load_n (&pool->waiting, __ATOMIC_RELAXED))
+   {
+      vx_sync_lock (pool->quiet);
+      if (vx_pool_quiet (pool))
+         vx_sync_broadcast (pool->quiet);
+      vx_sync_unlock (pool->quiet);
+   }
+
+   vx_sync_lock (pool->sync);
+   __atomic_add_fetch (&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+   __atomic_thread_fence (__ATOMIC_SEQ_CST);
+   if (!__atomic_load_n (&pool->shutdown, __ATOMIC_RELAXED) && !vx_pool_ready (pool))
+      vx_sync_wait (pool->sync);
+   __atomic_sub_fetch (&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+   vx_sync_unlock (pool->sync);
+}
+
+static void * vx_pool_main (void *arg)
+{
+   vx_pool_worker_t *self = (vx_pool_worker_t *) arg;
+   vx_pool_t *pool = self->pool;
+   vx_pool_task_t task;
+   uint32_t idle = 0;
+
+   vx_pool_self = self;
+   for (;;)
+   {
+      if (vx_pool_find (self, &task))
+      {
+         task.func (task.arg);
+         __atomic_store_n (&self->done, self->done + 1, __ATOMIC_RELEASE);
+         idle = 0;
+         continue;
+      }
+      if (idle < VX_POOL_SPIN)
+         vx_pool_pause ();
+      else if (idle < VX_POOL_SPIN + VX_POOL_YIELD)
+         sched_yield ();
+      else
+      {
+         if (__atomic_load_n (&pool->shutdown, __ATOMIC_ACQUIRE))
+            break;
+         vx_pool_park (pool);
+         idle = 0;
+         continue;
+      }
+      idle++;
+   }
+   vx_pool_self = NULL;
+   return (NULL);
+}
+
+vx_status_t vx_pool_create (vx_pool_t **pool, size_t nthreads)
+{
+   vx_status_t rc;
+   size_t ndx;
+   long ncpu;
+   int err;
+
+   if (nthreads == 0)
+   {
+      ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+      nthreads = ncpu > 0 ? (size_t) ncpu : 1;
+   }
+
+   if (posix_memalign ((void **) pool, VX_POOL_CACHELINE, sizeof (vx_pool_t)))
+      return (VX_ENOMEM);
+   memset ((*pool), 0, sizeof (vx_pool_t));
+
+   if (posix_memalign ((void **) &(*pool)->workers, VX_POOL_CACHELINE,
+         nthreads * sizeof (vx_pool_worker_t)))
+   {
+      free (*pool);
+      return (VX_ENOMEM);
+   }
+   memset ((*pool)->workers, 0, nthreads * sizeof (vx_pool_worker_t));
+   (*pool)->nthreads = nthreads;
+
+   if ((rc = vx_ring_create_ex (&(*pool)->inject, VX_RING_MPMC, VX_POOL_INJECT)) != VX_SUCCESS ||
+       (rc = vx_sync_create (&(*pool)->sync, NULL)) != VX_SUCCESS ||
+       (rc = vx_sync_create (&(*pool)->quiet, NULL)) != VX_SUCCESS)
+   {
+      vx_pool_destroy (*pool);
+      return (rc);
+   }
+
+   for (ndx = 0; ndx < nthreads; ndx++)
+   {
+      (*pool)->workers[ndx].pool = (*pool);
+      (*pool)->workers[ndx].seed = 0x9e3779b97f4a7c15ULL * (ndx + 1);
+      if (((*pool)->workers[ndx].array = vx_deque_array (VX_POOL_DEQUE)) == NULL)
+      {
+         vx_pool_destroy (*pool);
+         return (VX_ENOMEM);
+      }
+   }
+
+   for (ndx = 0; ndx < nthreads; ndx++)
+   {
+      if ((err = pthread_create (&(*pool)->workers[ndx].thread, NULL, vx_pool_main,
+                                 &(*pool)->workers[ndx])))
+      {
+         vxlog (LOG_ERR, "{%s:%d} pthread_create failed: %d", __func__, __LINE__, err);
+         vx_pool_destroy (*pool);
+         return (VX_FAILURE);
+      }
+      (*pool)->started++;
+   }
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_pool_destroy (vx_pool_t *pool)
+{
+   vx_pool_array_t *array, *next;
+   size_t ndx;
+
+   if (pool->sync)
+   {
+      vx_sync_lock (pool->sync);
+      __atomic_store_n (&pool->shutdown, 1, __ATOMIC_RELEASE);
+      vx_sync_broadcast (pool->sync);
+      vx_sync_unlock (pool->sync);
+   }
+   for (ndx = 0; ndx < pool->started; ndx++)
+      pthread_join (pool->workers[ndx].thread, NULL);
+
+   for (ndx = 0; ndx < pool->nthreads; ndx++)
+   {
+      for (array = pool->workers[ndx].array; array; array = next)
+      {
+         next = array->next;
+         free (array);
+      }
+   }
+   if (pool->inject)
+      vx_ring_destroy (pool->inject);
+   vx_sync_destroy (pool->sync);
+   vx_sync_destroy (pool->quiet);
+   free (pool->workers);
+   free (pool);
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_pool_submit (vx_pool_t *pool, vx_pool_func_t func, void *arg)
+{
+   vx_pool_worker_t *self = vx_pool_self;
+   vx_pool_task_t *task;
+   vx_status_t rc;
+
+   if (self != NULL && self->pool == pool)
+   {
+      /* counted before it can be stolen and run, see vx_pool_quiet */
+      __atomic_store_n (&self->spawned, self->spawned + 1, __ATOMIC_RELEASE);
+      if ((rc = vx_deque_push (self, func, arg)) != VX_SUCCESS)
+      {
+         __atomic_store_n (&self->spawned, self->spawned - 1, __ATOMIC_RELEASE);
+         return (rc);
+      }
+   }
+   else
+   {
+      if ((task = (vx_pool_task_t *) malloc (sizeof (vx_pool_task_t))) == NULL)
+         return (VX_ENOMEM);
+      task->func = func;
+      task->arg = arg;
+      __atomic_add_fetch (&pool->submitted, 1, __ATOMIC_RELEASE);
+      if ((rc = vx_ring_push (pool->inject, task)) != VX_SUCCESS)
+      {
+         __atomic_sub_fetch (&pool->submitted, 1, __ATOMIC_RELEASE);
+         free (task);
+         return (rc);
+      }
+   }
+   vx_pool_wake (pool);
+   return (VX_SUCCESS);
+}
+
+void vx_pool_wait (vx_pool_t *pool)
+{
+   assert (vx_pool_self == NULL || vx_pool_self->pool != pool);
+
+   vx_sync_lock (pool->quiet);
+   __atomic_add_fetch (&pool->waiting, 1, __ATOMIC_SEQ_CST);
+   __atomic_thread_fence (__ATOMIC_SEQ_CST);
+   while (!vx_pool_quiet (pool))
+      vx_sync_wait (pool->quiet);
+   __atomic_sub_fetch (&pool->waiting, 1, __ATOMIC_SEQ_CST);
+   vx_sync_unlock (pool->quiet);
+}
+
+size_t vx_pool_threads (vx_pool_t *pool)
+{
+   return (pool->nthreads);
+}
@@ -0,0 +1,57 @@
+/**
+ * Copyright 2008 - 2012 Ampersand, Inc.  All rights reserved.
+*/
+
+#ifndef _VX_POOL_H_
+#define _VX_POOL_H_
+
+#include <vx_ring.h>
+
+/* initial slots of a worker's deque, doubled whenever it fills */
+#define VX_POOL_DEQUE  1024
+/* slots of the injection ring; outside submitters block while it is full */
+#define VX_POOL_INJECT 4096
+/* tasks a worker moves from the injection ring to its deque at once */
+#define VX_POOL_BATCH  16
+
+typedef void (*vx_pool_func_t) (void *arg);
+
+/**
+ * vx_pool_t: work stealing thread pool. Every worker owns a Chase-Lev
+ * deque: it pushes and pops its own tasks at the bottom without locks,
+ * and a worker that runs dry steals from the top of the others', starting
+ * at a random victim. Tasks submitted from outside the pool go through a
+ * shared VX_RING_MPMC injection ring. Workers that find no work anywhere
+ * spin briefly, then park on a vx_sync condvar until a submit wakes them.
+ * Tasks run in no particular order.
+ */
+typedef struct vx_pool vx_pool_t;
+
+/**
+ * vx_pool_create: start nthreads workers, 0 for one per online cpu
+ */
+vx_status_t vx_pool_create (vx_pool_t **pool, size_t nthreads);
+
+/**
+ * vx_pool_destroy: run every task submitted so far, including the ones
+ * they submit, then stop and join the workers. Submits from outside the
+ * pool must not race with it.
+ */
+vx_status_t vx_pool_destroy (vx_pool_t *pool);
+
+/**
+ * vx_pool_submit: queue func (arg). From a task of this pool it goes on
+ * the running worker's deque, from any other thread through the injection
+ * ring, which costs a malloc.
+ */
+vx_status_t vx_pool_submit (vx_pool_t *pool, vx_pool_func_t func, void *arg);
+
+/**
+ * vx_pool_wait: block until every task submitted so far, and every task
+ * those submit, has run. Not to be called from a task of this pool.
+ */
+void vx_pool_wait (vx_pool_t *pool);
+
+size_t vx_pool_threads (vx_pool_t *pool);
+
+#endif
@@ -0,0 +1,101 @@
+/**
+ * Copyright 2008 - 2012 Ampersand, Inc.  All rights reserved.
+ *
+ * vx_pool stress check: outside submits, a spawn tree run from inside the
+ * pool and a tree left for vx_pool_destroy to drain. Every task must run
+ * exactly once; the run aborts on the first miscount.
+ *
+ *    vx_pool_main [-t threads] [-n submits] [-d depth] [-r rounds]
+ */
+
+#include <vx_pool.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+
+static vx_pool_t *vx_main_pool;
+static uint64_t vx_main_count;
+
+static void vx_main_leaf (void *arg)
+{
+   __atomic_add_fetch (&vx_main_count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * vx_main_tree: arg is the depth left; each node submits two children
+ * from inside the pool, so 2^(depth+1)-1 tasks run in all
+ */
+static void vx_main_tree (void *arg)
+{
+   uintptr_t depth = (uintptr_t) arg;
+
+   __atomic_add_fetch (&vx_main_count, 1, __ATOMIC_RELAXED);
+   if (depth == 0)
+      return;
+   vx_pool_submit (vx_main_pool, vx_main_tree, (void *) (depth - 1));
+   vx_pool_submit (vx_main_pool, vx_main_tree, (void *) (depth - 1));
+}
+
+static double vx_main_clock (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+int main (int argc, char *argv[])
+{
+   size_t threads = 4, submits = 1000000, rounds = 3, round, ndx;
+   uintptr_t depth = 18;
+   uint64_t expect;
+   vx_status_t rc;
+   double start;
+   int opt;
+
+   while ((opt = getopt (argc, argv, "t:n:d:r:")) != -1)
+   {
+      switch (opt)
+      {
+      case 't': threads = strtoul (optarg, NULL, 0); break;
+      case 'n': submits = strtoul (optarg, NULL, 0); break;
+      case 'd': depth = strtoul (optarg, NULL, 0); break;
+      case 'r': rounds = strtoul (optarg, NULL, 0); break;
+      default:
+         fprintf (stderr, "usage: %s [-t threads] [-n submits] [-d depth] [-r rounds]\n", argv[0]);
+         return (1);
+      }
+   }
+
+   for (round = 0; round < rounds; round++)
+   {
+      rc = vx_pool_create (&vx_main_pool, threads);
+      assert (rc == VX_SUCCESS);
+
+      vx_main_count = 0;
+      start = vx_main_clock ();
+      for (ndx = 0; ndx < submits && rc == VX_SUCCESS; ndx++)
+         rc = vx_pool_submit (vx_main_pool, vx_main_leaf, NULL);
+      assert (rc == VX_SUCCESS);
+      vx_pool_wait (vx_main_pool);
+      assert (vx_main_count == submits);
+      printf ("outside: %zu tasks on %zu threads, %.0f ns/task\n", submits,
+              vx_pool_threads (vx_main_pool), (vx_main_clock () - start) * 1e9 / submits);
+
+      vx_main_count = 0;
+      expect = ((uint64_t) 2 << depth) - 1;
+      start = vx_main_clock ();
+      vx_pool_submit (vx_main_pool, vx_main_tree, (void *) depth);
+      vx_pool_wait (vx_main_pool);
+      assert (vx_main_count == expect);
+      printf ("tree: %llu tasks, %.0f ns/task\n", (unsigned long long) expect,
+              (vx_main_clock () - start) * 1e9 / expect);
+
+      vx_main_count = 0;
+      vx_pool_submit (vx_main_pool, vx_main_tree, (void *) (depth / 2));
+      vx_pool_destroy (vx_main_pool);
+      assert (vx_main_count == ((uint64_t) 2 << (depth / 2)) - 1);
+      printf ("destroy: drained %llu tasks\n", (unsigned long long) vx_main_count);
+   }
+   return (0);
+}
@@ -0,0 +1,261 @@
+/**
+ * Copyright 2008 - 2012 Ampersand, Inc.  All rights reserved.
+*/
+
+#include <vx_prio.h>
+#include <vx_log.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#endif
+
+#define VX_PRIO_CACHELINE 64
+
+#define THOUSAND 1000
+#define MILLION  1000000
+#define BILLION  1000000000
+
+/**
+ * vx_prio_t: credit[level] is what is left of the level's weight this
+ * round, updated without a lock so shares are only approximate under
+ * concurrent pops
+ */
+struct vx_prio
+{
+   size_t levels;
+   vx_ring_t *rings[VX_PRIO_LEVELS];
+   int weighted;
+   uint32_t weights[VX_PRIO_LEVELS];
+   uint32_t spins;
+   vx_sync_t *sync;
+   size_t waiters;
+   char pad0[VX_PRIO_CACHELINE];
+   int64_t credit[VX_PRIO_LEVELS];
+};
+
+static inline void vx_prio_pause (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause ();
+#endif
+}
+
+static void vx_prio_deadline (struct timespec *ts, uint32_t msec)
+{
+   clock_gettime (CLOCK_REALTIME, ts);
+   ts->tv_sec += (msec + ts->tv_nsec/MILLION)/THOUSAND;
+   msec = msec % THOUSAND;
+   ts->tv_nsec = (MILLION*msec + ts->tv_nsec) % BILLION;
+}
+
+/**
+ * Pushes only pay for a compiler barrier before checking for parked pops
+ * when the kernel has membarrier; a pop about to park issues it instead.
+ */
+static pthread_once_t vx_prio_once = PTHREAD_ONCE_INIT;
+static int vx_prio_asym = 0;
+
+static void vx_prio_asym_init (void)
+{
+#if defined(__linux__) && defined(SYS_membarrier)
+   vx_prio_asym = syscall (SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+#endif
+}
+
+static inline void vx_prio_fence_fast (void)
+{
+   if (vx_prio_asym)
+      __atomic_signal_fence (__ATOMIC_SEQ_CST);
+   else
+      __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+static void vx_prio_fence_slow (void)
+{
+#if defined(__linux__) && defined(SYS_membarrier)
+   if (vx_prio_asym && syscall (SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) == 0)
+      return;
+#endif
+   __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+/**
+ * vx_prio_take: one pass over the levels, skipping empty ones without
+ * touching their locks or cells. Weighted, levels with credit left go
+ * first; if only levels without credit have items, the pop that finds
+ * one starts the next round.
+ */
+static int vx_prio_take (vx_prio_t *prio, void **data, size_t *level)
+{
+   size_t ndx, found;
+
+   if (prio->weighted)
+   {
+      for (ndx = 0; ndx < prio->levels; ndx++)
+      {
+         if (__atomic_load_n (&prio->credit[ndx], __ATOMIC_RELAXED) > 0 &&
+             vx_ring_depth (prio->rings[ndx]) &&
+             vx_ring_trypop (prio->rings[ndx], data) == VX_SUCCESS)
+         {
+            __atomic_sub_fetch (&prio->credit[ndx], 1, __ATOMIC_RELAXED);
+            break;
+         }
+      }
+      if (ndx < prio->levels)
+      {
+         if (level)
+            (*level) = ndx;
+         return (1);
+      }
+   }
+
+   for (found = 0; found < prio->levels; found++)
+      if (vx_ring_depth (prio->rings[found]) &&
+          vx_ring_trypop (prio->rings[found], data) == VX_SUCCESS)
+         break;
+   if (found == prio->levels)
+      return (0);
+
+   if (prio->weighted)
+   {
+      for (ndx = 0; ndx < prio->levels; ndx++)
+         __atomic_store_n (&prio->credit[ndx], (int64_t) prio->weights[ndx], __ATOMIC_RELAXED);
+      __atomic_sub_fetch (&prio->credit[found], 1, __ATOMIC_RELAXED);
+   }
+   if (level)
+      (*level) = found;
+   return (1);
+}
+
+static vx_status_t vx_prio_pop_wait (vx_prio_t *prio, void **data, size_t *level,
+                                     const struct timespec *ts)
+{
+   vx_status_t rc = VX_SUCCESS;
+   uint32_t round;
+
+   for (round = 0; round < prio->spins; round++)
+   {
+      if (vx_prio_take (prio, data, level))
+         return (VX_SUCCESS);
+      vx_prio_pause ();
+   }
+
+   vx_sync_lock (prio->sync);
+   __atomic_add_fetch (&prio->waiters, 1, __ATOMIC_RELAXED);
+   vx_prio_fence_slow ();
+   while (!vx_prio_take (prio, data, level))
+   {
+      if (ts == NULL)
+         vx_sync_wait (prio->sync);
+      else if ((rc = vx_sync_timedwait (prio->sync, ts)) != VX_SUCCESS)
+         break;
+   }
+   __atomic_sub_fetch (&prio->waiters, 1, __ATOMIC_RELAXED);
+   vx_sync_unlock (prio->sync);
+   return (rc);
+}
+
+vx_status_t vx_prio_create (vx_prio_t **prio, size_t levels, vx_ring_type_t type, size_t size)
+{
+   vx_status_t rc;
+   size_t ndx;
+
+   if (levels == 0 || levels > VX_PRIO_LEVELS || (type != VX_RING_LOCKED && type != VX_RING_MPMC))
+      return (VX_FAILURE);
+
+   pthread_once (&vx_prio_once, vx_prio_asym_init);
+
+   if (posix_memalign ((void **) prio, VX_PRIO_CACHELINE, sizeof (vx_prio_t)))
+      return (VX_ENOMEM);
+   memset ((*prio), 0, sizeof (vx_prio_t));
+   (*prio)->spins = type == VX_RING_LOCKED ? 0 : VX_RING_SPIN;
+
+   if ((rc = vx_sync_create (&(*prio)->sync, NULL)) != VX_SUCCESS)
+   {
+      vx_prio_destroy (*prio);
+      return (rc);
+   }
+   for (ndx = 0; ndx < levels; ndx++)
+   {
+      if ((rc = vx_ring_create_ex (&(*prio)->rings[ndx], type, size)) != VX_SUCCESS)
+      {
+         vx_prio_destroy (*prio);
+         return (rc);
+      }
+      (*prio)->levels++;
+   }
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_prio_destroy (vx_prio_t *prio)
+{
+   size_t ndx;
+
+   for (ndx = 0; ndx < prio->levels; ndx++)
+      vx_ring_destroy (prio->rings[ndx]);
+   vx_sync_destroy (prio->sync);
+   free (prio);
+   return (VX_SUCCESS);
+}
+
+vx_ring_t * vx_prio_ring (vx_prio_t *prio, size_t level)
+{
+   return (level < prio->levels ? prio->rings[level] : NULL);
+}
+
+vx_status_t vx_prio_set_weights (vx_prio_t *prio, const uint32_t *weights)
+{
+   size_t ndx;
+
+   prio->weighted = weights != NULL;
+   for (ndx = 0; ndx < prio->levels; ndx++)
+   {
+      prio->weights[ndx] = weights ? weights[ndx] : 0;
+      prio->credit[ndx] = prio->weights[ndx];
+   }
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_prio_push (vx_prio_t *prio, size_t level, void *data)
+{
+   vx_status_t rc;
+
+   if (level >= prio->levels)
+      return (VX_FAILURE);
+   if ((rc = vx_ring_push (prio->rings[level], data)) != VX_SUCCESS)
+      return (rc);
+
+   vx_prio_fence_fast ();
+   if (__atomic_load_n (&prio->waiters, __ATOMIC_RELAXED))
+   {
+      vx_sync_lock (prio->sync);
+      vx_sync_signal (prio->sync);
+      vx_sync_unlock (prio->sync);
+   }
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_prio_pop (vx_prio_t *prio, void **data, size_t *level)
+{
+   if (vx_prio_take (prio, data, level))
+      return (VX_SUCCESS);
+   return (vx_prio_pop_wait (prio, data, level, NULL));
+}
+
+vx_status_t vx_prio_pop_timed (vx_prio_t *prio, void **data, size_t *level, uint32_t msec)
+{
+   struct timespec ts;
+
+   if (vx_prio_take (prio, data, level))
+      return (VX_SUCCESS);
+   vx_prio_deadline (&ts, msec);
+   return (vx_prio_pop_wait (prio, data, level, &ts));
+}
+
+vx_status_t vx_prio_trypop (vx_prio_t *prio, void **data, size_t *level)
+{
+   return (vx_prio_take (prio, data, level) ? VX_SUCCESS : VX_EEMPTY);
+}
@@ -0,0 +1,49 @@
+/**
+ * Copyright 2008 - 2012 Ampersand, Inc.  All rights reserved.
+*/
+
+#ifndef _VX_PRIO_H_
+#define _VX_PRIO_H_
+
+#include <vx_ring.h>
+
+#define VX_PRIO_LEVELS 16
+
+/**
+ * vx_prio_t: a queue of levels vx_rings, level 0 first. Push goes to one
+ * level's ring; pop takes from the first level that has an item, so a
+ * control message pushed at level 0 overtakes any backlog below it. By
+ * default that is strict priority; vx_prio_set_weights shares pops out
+ * by weight instead so low levels are not starved. Any number of threads
+ * may push and pop.
+ */
+typedef struct vx_prio vx_prio_t;
+
+/**
+ * vx_prio_create: levels rings (at most VX_PRIO_LEVELS) of type
+ * VX_RING_LOCKED or VX_RING_MPMC and size, with vx_ring_create_ex's
+ * defaults; vx_prio_ring gives a level's ring for vx_ring_set_full and
+ * vx_ring_stats. A waiting pop spins like the level rings do, then parks.
+ */
+vx_status_t vx_prio_create (vx_prio_t **prio, size_t levels, vx_ring_type_t type, size_t size);
+vx_status_t vx_prio_destroy (vx_prio_t *prio);
+vx_ring_t * vx_prio_ring (vx_prio_t *prio, size_t level);
+
+/**
+ * vx_prio_set_weights: weights[level] pops per round; a level that used
+ * up its share is only served again once every level with items has, or
+ * when nothing else is queued. NULL goes back to strict priority. Call it
+ * before other threads use the queue.
+ */
+vx_status_t vx_prio_set_weights (vx_prio_t *prio, const uint32_t *weights);
+
+/**
+ * push and pop as for vx_ring_t; pop stores the level it served in
+ * *level unless that is NULL
+ */
+vx_status_t vx_prio_push (vx_prio_t *prio, size_t level, void *data);
+vx_status_t vx_prio_pop (vx_prio_t *prio, void **data, size_t *level);
+vx_status_t vx_prio_pop_timed (vx_prio_t *prio, void **data, size_t *level, uint32_t msec);
+vx_status_t vx_prio_trypop (vx_prio_t *prio, void **data, size_t *level);
+
+#endif
@@ -4,8 +4,552 @@
 
 #include <vx_ring.h>
 #include <vx_log.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/membarrier.h>
+#endif
+
+#define THOUSAND 1000
+#define MILLION  1000000
+#define BILLION  1000000000
+
+static void vx_ring_deadline (struct timespec *ts, uint32_t msec)
+{
+   clock_gettime (CLOCK_REALTIME, ts);
+   ts->tv_sec += (msec + ts->tv_nsec/MILLION)/THOUSAND;
+   msec = msec % THOUSAND;
+   ts->tv_nsec = (MILLION*msec + ts->tv_nsec) % BILLION;
+}
+
+static inline void vx_ring_pause (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause ();
+#endif
+}
+
+static int vx_ring_expired (const struct timespec *ts)
+{
+   struct timespec now;
+
+   clock_gettime (CLOCK_REALTIME, &now);
+   return (now.tv_sec > ts->tv_sec || (now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec));
+}
+
+/**
+ * vx_ring_backoff: one round of waiting before parking. The first
+ * ring->spins rounds pause, the next ring->yields give up the cpu; 0 once
+ * both are used up (or ts has passed) and the caller should park.
+ */
+static inline int vx_ring_backoff (vx_ring_t *ring, uint64_t round, const struct timespec *ts)
+{
+   if (ts && (round & 255) == 255 && vx_ring_expired (ts))
+      return (0);
+   if (ring->spins == VX_RING_FOREVER || round < ring->spins)
+      vx_ring_pause ();
+   else if (ring->yields == VX_RING_FOREVER || round < (uint64_t) ring->spins + ring->yields)
+      sched_yield ();
+   else
+      return (0);
+   return (1);
+}
+
+static inline uint64_t vx_ring_clock (void)
+{
+#ifndef VX_RING_NO_STATS
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+#else
+   return (0);
+#endif
+}
+
+/**
+ * vx_ring_count: add n to a counter only written under the ring lock, a
+ * plain store that other threads can still read safely
+ */
+static inline void vx_ring_count (uint64_t *counter, uint64_t n)
+{
+#ifndef VX_RING_NO_STATS
+   __atomic_store_n (counter, *counter + n, __ATOMIC_RELAXED);
+#endif
+}
+
+/**
+ * vx_ring_peak: raise the peak depth to depth
+ */
+static inline void vx_ring_peak (vx_ring_t *ring, size_t depth)
+{
+#ifndef VX_RING_NO_STATS
+   size_t peak = __atomic_load_n (&ring->stats.peak, __ATOMIC_RELAXED);
+
+   while (depth > peak &&
+          !__atomic_compare_exchange_n (&ring->stats.peak, &peak, depth, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+#endif
+}
+
+/**
+ * vx_ring_parked: charge a park that began at start, a consumer waiting
+ * for items or a producer waiting for room
+ */
+static void vx_ring_parked (vx_ring_t *ring, int consumer, uint64_t start)
+{
+#ifndef VX_RING_NO_STATS
+   uint64_t ns = vx_ring_clock () - start, us = ns / 1000;
+   int bucket = 0;
+
+   if (!consumer)
+   {
+      __atomic_add_fetch (&ring->stats.full_parks, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch (&ring->stats.full_park_ns, ns, __ATOMIC_RELAXED);
+      return;
+   }
+   while (us && bucket < VX_RING_HIST - 1)
+   {
+      us >>= 1;
+      bucket++;
+   }
+   __atomic_add_fetch (&ring->stats.parks, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch (&ring->stats.park_ns, ns, __ATOMIC_RELAXED);
+   __atomic_add_fetch (&ring->stats.park_hist[bucket], 1, __ATOMIC_RELAXED);
+#endif
+}
+
+/**
+ * vx_ring_lock: lock the locked ring, timing the wait when contended
+ */
+static inline void vx_ring_lock (vx_ring_t *ring)
+{
+#ifndef VX_RING_NO_STATS
+   uint64_t start;
+
+   if (vx_sync_trylock (ring->sync) == VX_SUCCESS)
+      return;
+   start = vx_ring_clock ();
+   vx_sync_lock (ring->sync);
+   vx_ring_count (&ring->stats.lock_waits, 1);
+   vx_ring_count (&ring->stats.lock_wait_ns, vx_ring_clock () - start);
+#else
+   vx_sync_lock (ring->sync);
+#endif
+}
+
+/**
+ * Waking a parked consumer is a Dekker handshake: the producer stores prod
+ * then loads waiters, the consumer stores waiters then loads prod, and one
+ * of them must see the other's store. Rather than a full fence on every
+ * push, when the kernel has membarrier the consumer pays for both sides on
+ * its way to sleep and the producer only needs a compiler barrier.
+ */
+static pthread_once_t vx_ring_once = PTHREAD_ONCE_INIT;
+static int vx_ring_asym = 0;
+
+static void vx_ring_asym_init (void)
+{
+#if defined(__linux__) && defined(SYS_membarrier)
+   vx_ring_asym = syscall (SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+#endif
+}
+
+static inline void vx_ring_fence_fast (void)
+{
+   if (vx_ring_asym)
+      __atomic_signal_fence (__ATOMIC_SEQ_CST);
+   else
+      __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+static void vx_ring_fence_slow (void)
+{
+#if defined(__linux__) && defined(SYS_membarrier)
+   if (vx_ring_asym && syscall (SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) == 0)
+      return;
+#endif
+   /* without membarrier vx_ring_fence_fast is a full fence already */
+   __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+/**
+ * vx_ring_wake: after publishing n items (or freeing n slots), wake the
+ * threads parked on the other side, if there are any
+ */
+static inline void vx_ring_wake (vx_sync_t *sync, size_t *waiters, size_t n)
+{
+   vx_ring_fence_fast ();
+   if (__atomic_load_n (waiters, __ATOMIC_RELAXED))
+   {
+      vx_sync_lock (sync);
+      if (n > 1)
+         vx_sync_broadcast (sync);
+      else
+         vx_sync_signal (sync);
+      vx_sync_unlock (sync);
+   }
+}
+
+/**
+ * vx_ring_notify: make the notify fd readable if the consumer armed it,
+ * so one write covers every push until the ring is drained again. For
+ * the lock free types the caller has fenced already in vx_ring_wake.
+ */
+static inline void vx_ring_notify (vx_ring_t *ring)
+{
+   uint64_t one = 1;
+
+   if (ring->efd >= 0 && __atomic_load_n (&ring->armed, __ATOMIC_RELAXED) &&
+       __atomic_exchange_n (&ring->armed, 0, __ATOMIC_RELAXED))
+   {
+      if (write (ring->efd, &one, sizeof (one)) != sizeof (one))
+         vxlog (LOG_ERR, "{%s:%d} eventfd write failed: %d", __func__, __LINE__, errno);
+   }
+}
+
+/**
+ * vx_ring_rearm: the consumer found the ring empty, clear the fd and arm
+ * it for the next push
+ */
+static inline void vx_ring_rearm (vx_ring_t *ring)
+{
+   uint64_t value;
+
+   if (read (ring->efd, &value, sizeof (value)) < 0 && errno != EAGAIN)
+      vxlog (LOG_ERR, "{%s:%d} eventfd read failed: %d", __func__, __LINE__, errno);
+   __atomic_store_n (&ring->armed, 1, __ATOMIC_RELAXED);
+}
+
+typedef int (*vx_ring_try_t) (vx_ring_t *ring, void **data);
+
+/**
+ * vx_ring_wait: retry a push or pop that found the ring full or empty,
+ * backing off first and then sleeping on sync until woken or ts (if not
+ * NULL) passes
+ */
+static vx_status_t vx_ring_wait (vx_ring_t *ring, vx_sync_t *sync, size_t *waiters,
+                                 vx_ring_try_t try, void **data, const struct timespec *ts)
+{
+   vx_status_t rc = VX_SUCCESS;
+   uint64_t round, start = 0;
+
+   for (round = 0; vx_ring_backoff (ring, round, ts); round++)
+   {
+      if (try (ring, data))
+         return (VX_SUCCESS);
+   }
+
+   vx_sync_lock (sync);
+   __atomic_add_fetch (waiters, 1, __ATOMIC_RELAXED);
+   vx_ring_fence_slow ();
+   while (!try (ring, data))
+   {
+      if (start == 0)
+         start = vx_ring_clock ();
+      if (ts == NULL)
+         vx_sync_wait (sync);
+      else if (vx_sync_timedwait (sync, ts) == VX_TIMEOUT)
+      {
+         rc = VX_TIMEOUT;
+         break;
+      }
+   }
+   __atomic_sub_fetch (waiters, 1, __ATOMIC_RELAXED);
+   vx_sync_unlock (sync);
+   if (start)
+      vx_ring_parked (ring, waiters == &ring->waiters, start);
+   return (rc);
+}
+
+/**
+ * vx_spsc_trypush_n: push up to n items with one release of prod, returns
+ * how many fit; with all set it is n or nothing
+ */
+static inline size_t vx_spsc_trypush_n (vx_ring_t *ring, void **data, size_t n, int all)
+{
+   size_t prod = __atomic_load_n (&ring->prod, __ATOMIC_RELAXED), index;
+
+   if (prod - ring->cons_cache + n > ring->size)
+   {
+      ring->cons_cache = __atomic_load_n (&ring->cons, __ATOMIC_ACQUIRE);
+      if (prod - ring->cons_cache + n > ring->size)
+         n = all ? 0 : ring->size - (prod - ring->cons_cache);
+   }
+   for (index = 0; index < n; index++)
+      ring->slots[(prod + index) & ring->mask] = data[index];
+   if (n)
+   {
+      __atomic_store_n (&ring->prod, prod + n, __ATOMIC_RELEASE);
+#ifndef VX_RING_NO_STATS
+      /* cons_cache only overstates the depth, so check before loading cons */
+      if (prod + n - ring->cons_cache > ring->stats.peak)
+         vx_ring_peak (ring, prod + n - __atomic_load_n (&ring->cons, __ATOMIC_RELAXED));
+#endif
+   }
+   return (n);
+}
+
+static inline size_t vx_spsc_trypop_n (vx_ring_t *ring, void **data, size_t n)
+{
+   size_t cons = __atomic_load_n (&ring->cons, __ATOMIC_RELAXED), index;
+
+   if (ring->prod_cache - cons < n)
+   {
+      ring->prod_cache = __atomic_load_n (&ring->prod, __ATOMIC_ACQUIRE);
+      if (ring->prod_cache - cons < n)
+         n = ring->prod_cache - cons;
+   }
+   for (index = 0; index < n; index++)
+      data[index] = ring->slots[(cons + index) & ring->mask];
+   if (n)
+      __atomic_store_n (&ring->cons, cons + n, __ATOMIC_RELEASE);
+   return (n);
+}
+
+/**
+ * vx_mpmc_trypush_n: Vyukov's bounded queue. A cell whose seq equals pos is
+ * free for the producer that claims pos; seq pos + 1 marks it full for the
+ * consumer of pos, which hands it back as pos + size. A batch claims the
+ * run of free cells at prod with one CAS.
+ */
+static inline size_t vx_mpmc_trypush_n (vx_ring_t *ring, void **data, size_t n, int all)
+{
+   vx_ring_cell_t *cell;
+   size_t pos = __atomic_load_n (&ring->prod, __ATOMIC_RELAXED), seq, count, index;
+   intptr_t dif = 0;
+
+   for (;;)
+   {
+      for (count = 0; count < n; count++)
+      {
+         seq = __atomic_load_n (&ring->cells[(pos + count) & ring->mask].seq, __ATOMIC_ACQUIRE);
+         if ((dif = (intptr_t) seq - (intptr_t) (pos + count)) != 0)
+            break;
+      }
+      if (count && all && count < n && dif < 0)
+         return (0);
+      if (count)
+      {
+         if (__atomic_compare_exchange_n (&ring->prod, &pos, pos + count, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+      }
+      else if (dif < 0)
+         return (0);
+      else
+         pos = __atomic_load_n (&ring->prod, __ATOMIC_RELAXED);
+   }
+   for (index = 0; index < count; index++)
+   {
+      cell = &ring->cells[(pos + index) & ring->mask];
+      cell->data = data[index];
+      __atomic_store_n (&cell->seq, pos + index + 1, __ATOMIC_RELEASE);
+   }
+#ifndef VX_RING_NO_STATS
+   /* cons is the consumers' hot line, so only look at it every 16 slots */
+   if (((pos + count) & ~(size_t) 15) != (pos & ~(size_t) 15))
+      vx_ring_peak (ring, pos + count - __atomic_load_n (&ring->cons, __ATOMIC_RELAXED));
+#endif
+   return (count);
+}
+
+static inline size_t vx_mpmc_trypop_n (vx_ring_t *ring, void **data, size_t n)
+{
+   vx_ring_cell_t *cell;
+   size_t pos = __atomic_load_n (&ring->cons, __ATOMIC_RELAXED), seq, count, index;
+   intptr_t dif = 0;
+
+   for (;;)
+   {
+      for (count = 0; count < n; count++)
+      {
+         seq = __atomic_load_n (&ring->cells[(pos + count) & ring->mask].seq, __ATOMIC_ACQUIRE);
+         if ((dif = (intptr_t) seq - (intptr_t) (pos + count + 1)) != 0)
+            break;
+      }
+      if (count)
+      {
+         if (__atomic_compare_exchange_n (&ring->cons, &pos, pos + count, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+      }
+      else if (dif < 0)
+         return (0);
+      else
+         pos = __atomic_load_n (&ring->cons, __ATOMIC_RELAXED);
+   }
+   for (index = 0; index < count; index++)
+   {
+      cell = &ring->cells[(pos + index) & ring->mask];
+      data[index] = cell->data;
+      __atomic_store_n (&cell->seq, pos + index + ring->mask + 1, __ATOMIC_RELEASE);
+   }
+   return (count);
+}
+
+static inline size_t vx_lf_trypush_n (vx_ring_t *ring, void **data, size_t n, int all)
+{
+   if (ring->type == VX_RING_SPSC)
+      return (vx_spsc_trypush_n (ring, data, n, all));
+   return (vx_mpmc_trypush_n (ring, data, n, all));
+}
+
+static inline size_t vx_lf_trypop_n (vx_ring_t *ring, void **data, size_t n)
+{
+   if (ring->type == VX_RING_SPSC)
+      return (vx_spsc_trypop_n (ring, data, n));
+   return (vx_mpmc_trypop_n (ring, data, n));
+}
+
+static int vx_lf_trypush (vx_ring_t *ring, void **data)
+{
+   return (vx_lf_trypush_n (ring, data, 1, 0) != 0);
+}
+
+static int vx_lf_trypop (vx_ring_t *ring, void **data)
+{
+   return (vx_lf_trypop_n (ring, data, 1) != 0);
+}
+
+/**
+ * vx_ring_drop: hand items the full policy discarded to the drop func
+ */
+static void vx_ring_drop (vx_ring_t *ring, void **data, size_t n)
+{
+   size_t index;
+
+   if (ring->drop_func)
+   {
+      for (index = 0; index < n; index++)
+         ring->drop_func (data[index], ring->drop_arg);
+   }
+   __atomic_add_fetch (&ring->dropped, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * vx_lf_push_n: push for the lock free types, a full ring is handled by
+ * ring->policy. Consumers are woken once per run of items that fit, so a
+ * batch larger than the free space wakes them before waiting for them to
+ * make room.
+ */
+static vx_status_t vx_lf_push_n (vx_ring_t *ring, void **data, size_t n)
+{
+   vx_status_t rc = VX_SUCCESS;
+   struct timespec ts, *deadline = NULL;
+   size_t count;
+   void *old;
+
+   if (ring->policy == VX_RING_FAIL)
+   {
+      if (n && vx_lf_trypush_n (ring, data, n, 1) == 0)
+         return (VX_EFULL);
+      vx_ring_wake (ring->sync, &ring->waiters, n);
+      vx_ring_notify (ring);
+      return (VX_SUCCESS);
+   }
+   if (ring->policy == VX_RING_BLOCK && ring->full_msec != VX_RING_FOREVER)
+   {
+      vx_ring_deadline (&ts, ring->full_msec);
+      deadline = &ts;
+   }
+
+   while (n)
+   {
+      if ((count = vx_lf_trypush_n (ring, data, n, 0)) == 0)
+      {
+         if (ring->policy == VX_RING_DROP_NEWEST)
+         {
+            vx_ring_drop (ring, data, n);
+            break;
+         }
+         if (ring->policy == VX_RING_DROP_OLDEST)
+         {
+            /* only set for VX_RING_MPMC, where anyone may pop */
+            if (vx_mpmc_trypop_n (ring, &old, 1))
+               vx_ring_drop (ring, &old, 1);
+            continue;
+         }
+         if ((rc = vx_ring_wait (ring, ring->room, &ring->room_waiters,
+                                 vx_lf_trypush, data, deadline)) != VX_SUCCESS)
+            break;
+         count = 1;
+      }
+      data += count;
+      n -= count;
+      vx_ring_wake (ring->sync, &ring->waiters, count);
+      vx_ring_notify (ring);
+   }
+   return (rc);
+}
+
+/**
+ * vx_lf_pop_n: pop for the lock free types, waits for the first item
+ */
+static vx_status_t vx_lf_pop_n (vx_ring_t *ring, void **data, size_t n, size_t *count,
+                                const struct timespec *ts)
+{
+   vx_status_t rc;
+
+   if (((*count) = vx_lf_trypop_n (ring, data, n)) == 0)
+   {
+      if ((rc = vx_ring_wait (ring, ring->sync, &ring->waiters, vx_lf_trypop, data, ts)) != VX_SUCCESS)
+         return (rc);
+      (*count) = 1;
+      if (n > 1)
+         (*count) += vx_lf_trypop_n (ring, data + 1, n - 1);
+   }
+   vx_ring_wake (ring->room, &ring->room_waiters, (*count));
+   return (VX_SUCCESS);
+}
+
+/**
+ * vx_ring_grow: add VX_RING_INCR free nodes after tail, called with the
+ * ring locked. It warns on the first growth and then only each time the
+ * ring has doubled since the last warning; vx_ring_stats counts them all.
+ */
+static vx_status_t vx_ring_grow (vx_ring_t *ring)
+{
+   size_t index;
+   vx_ring_ele_t *tmp, *link, *next = ring->tail->next;
+
+   if (ring->size >= 2 * ring->grow_logged)
+   {
+      vxlog (LOG_WARNING, "{%s:%d} ring is full [%zu:%zu], adding nodes",
+         __func__, __LINE__, ring->size, ring->count);
+      ring->grow_logged = ring->size;
+   }
+   link = (vx_ring_ele_t *) malloc (sizeof (vx_ring_ele_t));
+
+   if (link == NULL)
+      return (VX_ENOMEM);
+
+   ring->tail->next = link;
+   for (index = 1; index < VX_RING_INCR; index++)
+   {
+      tmp = (vx_ring_ele_t *) malloc (sizeof (vx_ring_ele_t));
+
+      if (tmp == NULL)
+         return (VX_ENOMEM);
+
+      link->next = tmp;
+      link = tmp;
+   }
+   link->next = next;
+   ring->size += VX_RING_INCR;
+   vx_ring_count (&ring->stats.grows, 1);
+   return (VX_SUCCESS);
+}
 
 vx_status_t vx_ring_create  (vx_ring_t **ring)
+{
+   return (vx_ring_create_ex (ring, VX_RING_LOCKED, VX_RING_INIT));
+}
+
+vx_status_t vx_ring_create_ex (vx_ring_t **ring, vx_ring_type_t type, size_t size)
 {
    vx_status_t rc;
    size_t index;
@@ -14,20 +558,57 @@ vx_status_t vx_ring_create  (vx_ring_t **ring)
 
    if ( (*ring) == NULL)
       return (VX_ENOMEM);
+   memset (*ring, 0, sizeof (vx_ring_t));
+   (*ring)->type = type;
+   (*ring)->spins = type == VX_RING_LOCKED ? 0 : VX_RING_SPIN;
+   (*ring)->efd = -1;
+   (*ring)->policy = type == VX_RING_LOCKED ? VX_RING_GROW : VX_RING_BLOCK;
+   (*ring)->full_msec = VX_RING_FOREVER;
+   pthread_once (&vx_ring_once, vx_ring_asym_init);
 
    if ((rc = vx_sync_create (&(*ring)->sync, NULL)) != VX_SUCCESS)
    {
       free (*ring);
       return (rc);
    }
-      
+
+   if (type != VX_RING_LOCKED)
+   {
+      for ((*ring)->size = 2; (*ring)->size < size; (*ring)->size <<= 1)
+         ;
+      (*ring)->mask = (*ring)->size - 1;
+      if (type == VX_RING_SPSC)
+         (*ring)->slots = malloc ((*ring)->size * sizeof (void *));
+      else if (((*ring)->cells = malloc ((*ring)->size * sizeof (vx_ring_cell_t))) != NULL)
+      {
+         for (index = 0; index < (*ring)->size; index++)
+            (*ring)->cells[index].seq = index;
+      }
+      if ((*ring)->slots == NULL && (*ring)->cells == NULL)
+      {
+         vx_sync_destroy ((*ring)->sync);
+         free (*ring);
+         return (VX_ENOMEM);
+      }
+      if ((rc = vx_sync_create (&(*ring)->room, NULL)) != VX_SUCCESS)
+      {
+         vx_ring_destroy (*ring);
+         return (rc);
+      }
+      return (VX_SUCCESS);
+   }
+
+   /* one node always stays free between tail and head */
+   if (size < 1)
+      size = 1;
+   size++;
    (*ring)->head = malloc (sizeof (vx_ring_ele_t));
 
    if ((*ring)->head == NULL)
       return (VX_ENOMEM);
 
    tmp = (*ring)->head;
-   for (index = 1; index < VX_RING_INIT; index++)
+   for (index = 1; index < size; index++)
    {
       (*ring)->tail = malloc (sizeof (vx_ring_ele_t));
 
@@ -41,7 +622,7 @@ vx_status_t vx_ring_create  (vx_ring_t **ring)
    (*ring)->tail = (*ring)->head;
    (*ring)->count = 0;
    (*ring)->waiters = 0;
-   (*ring)->size = VX_RING_INIT;
+   (*ring)->size = size;
    return (VX_SUCCESS);
 }
 
@@ -51,7 +632,7 @@ vx_status_t vx_ring_destroy (vx_ring_t *ring)
    vx_ring_ele_t *tmp;
    vx_ring_ele_t *link = ring->head;
    vx_sync_lock (ring->sync);
-   for (index = 0; index < ring->size; index++)
+   for (index = 0; link && index < ring->size; index++)
    {
       tmp = link->next;
       free (link);
@@ -60,7 +641,12 @@ vx_status_t vx_ring_destroy (vx_ring_t *ring)
    vx_sync_unlock (ring->sync);
 
    vx_sync_destroy (ring->sync);
+   vx_sync_destroy (ring->room);
 
+   if (ring->efd >= 0)
+      close (ring->efd);
+   free (ring->slots);
+   free (ring->cells);
    free (ring);
 
    return (VX_SUCCESS);
@@ -68,84 +654,338 @@ vx_status_t vx_ring_destroy (vx_ring_t *ring)
 
 vx_status_t vx_ring_push    (vx_ring_t *ring, void *data)
 {
-   size_t index;
-   vx_ring_ele_t *tmp, *link;
-   vx_sync_lock (ring->sync);
-   if (ring->count == (ring->size - 1))
+   return (vx_ring_push_n (ring, &data, 1));
+}
+
+/**
+ * vx_ring_take: move up to n items off the locked ring, called locked
+ */
+static void vx_ring_take (vx_ring_t *ring, void **data, size_t n, size_t *count)
+{
+   for ((*count) = 0; (*count) < n && (*count) < ring->count; (*count)++)
    {
-      vxlog (LOG_WARNING, "{%s:%d} ring is full [%d:%d], adding nodes", 
-         __func__, __LINE__, ring->size, ring->count);
-      link = (vx_ring_ele_t *) malloc (sizeof (vx_ring_ele_t));
+      data[(*count)] = ring->head->data;
+      ring->head = ring->head->next;
+   }
+   __atomic_store_n (&ring->count, ring->count - (*count), __ATOMIC_RELAXED);
+   if ((*count) && ring->room_waiters)
+      vx_sync_broadcast (ring->sync);
+}
 
-      if (link == NULL)
-         return (VX_ENOMEM);
+/**
+ * vx_ring_wake_locked: wake consumers after n items went in; producers
+ * blocked on a full ring share the condvar, so when there are any we
+ * broadcast
+ */
+static void vx_ring_wake_locked (vx_ring_t *ring, size_t n)
+{
+   if (ring->waiters)
+   {
+      if (n > 1 || ring->room_waiters)
+         vx_sync_broadcast (ring->sync);
+      else
+         vx_sync_signal (ring->sync);
+   }
+   vx_ring_notify (ring);
+}
 
-      ring->tail->next = link;
-      for (index = 1; index < VX_RING_INCR; index++)
-      {
-         tmp = (vx_ring_ele_t *) malloc (sizeof (vx_ring_ele_t));
+/**
+ * vx_ring_push_n: push n items under one lock with at most one wakeup
+ * unless the policy makes it wait for room part way
+ */
+vx_status_t vx_ring_push_n (vx_ring_t *ring, void **data, size_t n)
+{
+   vx_status_t rc = VX_SUCCESS;
+   struct timespec ts;
+   size_t index, count;
+   uint64_t start;
+   void *old;
+
+   if (ring->type != VX_RING_LOCKED)
+      return (vx_lf_push_n (ring, data, n));
 
-         if (tmp == NULL)
-            return (VX_ENOMEM);
+   if (ring->policy == VX_RING_BLOCK && ring->full_msec != VX_RING_FOREVER)
+      vx_ring_deadline (&ts, ring->full_msec);
+
+   vx_ring_lock (ring);
+   if (ring->policy == VX_RING_GROW)
+   {
+      while (ring->count + n > ring->size - 1)
+      {
+         if ((rc = vx_ring_grow (ring)) != VX_SUCCESS)
+         {
+            vx_sync_unlock (ring->sync);
+            return (rc);
+         }
+      }
+   }
+   else if (ring->policy == VX_RING_FAIL && ring->count + n > ring->size - 1)
+   {
+      vx_sync_unlock (ring->sync);
+      return (VX_EFULL);
+   }
 
-         link->next = tmp;
-         link = tmp;
+   while (n)
+   {
+      if (ring->count == ring->size - 1)
+      {
+         if (ring->policy == VX_RING_DROP_NEWEST)
+         {
+            vx_ring_drop (ring, data, n);
+            break;
+         }
+         if (ring->policy == VX_RING_DROP_OLDEST)
+         {
+            vx_ring_take (ring, &old, 1, &count);
+            vx_ring_drop (ring, &old, 1);
+         }
+         else
+         {
+            start = vx_ring_clock ();
+            ring->room_waiters++;
+            if (ring->full_msec == VX_RING_FOREVER)
+               rc = vx_sync_wait (ring->sync);
+            else
+               rc = vx_sync_timedwait (ring->sync, &ts);
+            ring->room_waiters--;
+            vx_ring_parked (ring, 0, start);
+            if (rc == VX_TIMEOUT)
+               break;
+            rc = VX_SUCCESS;
+            continue;
+         }
+      }
+      count = ring->size - 1 - ring->count;
+      if (count > n)
+         count = n;
+      for (index = 0; index < count; index++)
+      {
+         ring->tail->data = data[index];
+         ring->tail = ring->tail->next;
       }
-      link->next = ring->head;
-      ring->size += VX_RING_INCR;
+      /* atomic so popping threads can poll it without the lock */
+      __atomic_store_n (&ring->count, ring->count + count, __ATOMIC_RELAXED);
+      vx_ring_count (&ring->stats.pushes, count);
+      if (ring->count > ring->stats.peak)
+         vx_ring_peak (ring, ring->count);
+      data += count;
+      n -= count;
+      vx_ring_wake_locked (ring, count);
    }
-   ring->tail->data = data;
-   ring->count++;
-   ring->tail = ring->tail->next;
-   vx_sync_signal (ring->sync);
    vx_sync_unlock (ring->sync);
-   return (VX_SUCCESS);
+   return (rc);
 }
 
-vx_status_t vx_ring_pop (vx_ring_t *ring, void **data)
+/**
+ * vx_ring_pop_n_wait: wait for the first item, then take up to n items
+ * under the same lock
+ */
+static vx_status_t vx_ring_pop_n_wait (vx_ring_t *ring, void **data, size_t n, size_t *count,
+                                       const struct timespec *ts)
 {
-   vx_sync_lock (ring->sync);
+   vx_status_t rc;
+   uint64_t round, start = 0;
+
+   (*count) = 0;
+   if (n == 0)
+      return (VX_SUCCESS);
+   if (ring->type != VX_RING_LOCKED)
+      return (vx_lf_pop_n (ring, data, n, count, ts));
+
+   for (round = 0; __atomic_load_n (&ring->count, __ATOMIC_RELAXED) == 0; round++)
+   {
+      if (!vx_ring_backoff (ring, round, ts))
+         break;
+   }
+
+   vx_ring_lock (ring);
    while (ring->count == 0)
    {
+      if (start == 0)
+         start = vx_ring_clock ();
       ring->waiters++;
-      vx_sync_wait (ring->sync);
+      rc = ts ? vx_sync_timedwait (ring->sync, ts) : vx_sync_wait (ring->sync);
       ring->waiters--;
+      if (rc == VX_TIMEOUT)
+         break;
+   }
+   if (ring->count)
+   {
+      vx_ring_take (ring, data, n, count);
+      vx_ring_count (&ring->stats.pops, (*count));
    }
-   (*data) = ring->head->data;
-   ring->head = ring->head->next;
-   ring->count--;
    vx_sync_unlock (ring->sync);
-   return (VX_SUCCESS);
+   if (start)
+      vx_ring_parked (ring, 1, start);
+   return ((*count) ? VX_SUCCESS : VX_TIMEOUT);
+}
+
+vx_status_t vx_ring_pop_n (vx_ring_t *ring, void **data, size_t n, size_t *count)
+{
+   return (vx_ring_pop_n_wait (ring, data, n, count, NULL));
+}
+
+vx_status_t vx_ring_pop_n_timed (vx_ring_t *ring, void **data, size_t n, size_t *count,
+                                 uint32_t msec)
+{
+   struct timespec ts;
+
+   vx_ring_deadline (&ts, msec);
+   return (vx_ring_pop_n_wait (ring, data, n, count, &ts));
+}
+
+vx_status_t vx_ring_pop (vx_ring_t *ring, void **data)
+{
+   size_t count;
+
+   return (vx_ring_pop_n_wait (ring, data, 1, &count, NULL));
 }
 
-#define THOUSAND 1000
-#define MILLION  1000000
-#define BILLION  1000000000
 vx_status_t vx_ring_pop_timed (vx_ring_t *ring, void **data, uint32_t msec)
 {
-   vx_status_t rc;
    struct timespec ts;
+   size_t count;
 
-   clock_gettime (CLOCK_REALTIME, &ts);
-   ts.tv_sec += (msec + ts.tv_nsec/MILLION)/THOUSAND;
-   msec = msec % THOUSAND;
-   ts.tv_nsec = (MILLION*msec + ts.tv_nsec) % BILLION;
+   vx_ring_deadline (&ts, msec);
+   return (vx_ring_pop_n_wait (ring, data, 1, &count, &ts));
+}
 
-   vx_sync_lock (ring->sync);
-   while (ring->count == 0)
+void vx_ring_set_wait (vx_ring_t *ring, uint32_t spins, uint32_t yields)
+{
+   ring->spins = spins;
+   ring->yields = yields;
+}
+
+/**
+ * vx_ring_trypop_n: take up to n items without waiting; an empty ring
+ * re-arms the notify fd
+ */
+vx_status_t vx_ring_trypop_n (vx_ring_t *ring, void **data, size_t n, size_t *count)
+{
+   (*count) = 0;
+   if (n == 0)
+      return (VX_SUCCESS);
+
+   if (ring->type == VX_RING_LOCKED)
    {
-      ring->waiters++;
-      rc = vx_sync_timedwait (ring->sync, &ts);
-      ring->waiters--;
-      if (rc == VX_TIMEOUT)
+      vx_ring_lock (ring);
+      vx_ring_take (ring, data, n, count);
+      vx_ring_count (&ring->stats.pops, (*count));
+      if ((*count) == 0 && ring->efd >= 0)
+         vx_ring_rearm (ring);
+      vx_sync_unlock (ring->sync);
+   }
+   else
+   {
+      if (((*count) = vx_lf_trypop_n (ring, data, n)) == 0 && ring->efd >= 0)
       {
-         vx_sync_unlock (ring->sync);
-         return (rc);
+         /* a push between the failed pop and arming would go unseen */
+         vx_ring_rearm (ring);
+         vx_ring_fence_slow ();
+         (*count) = vx_lf_trypop_n (ring, data, n);
       }
+      if ((*count))
+         vx_ring_wake (ring->room, &ring->room_waiters, (*count));
    }
-   (*data) = ring->head->data;
-   ring->head = ring->head->next;
-   ring->count--;
-   vx_sync_unlock (ring->sync);
+   return ((*count) ? VX_SUCCESS : VX_EEMPTY);
+}
+
+vx_status_t vx_ring_trypop (vx_ring_t *ring, void **data)
+{
+   size_t count;
+
+   return (vx_ring_trypop_n (ring, data, 1, &count));
+}
+
+vx_status_t vx_ring_notify_fd (vx_ring_t *ring, int *fd)
+{
+#ifdef __linux__
+   if (ring->efd < 0)
+   {
+      if ((ring->efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+      {
+         vxlog (LOG_ERR, "{%s:%d} eventfd failed: %d", __func__, __LINE__, errno);
+         return (VX_FAILURE);
+      }
+      ring->armed = 1;
+   }
+   (*fd) = ring->efd;
    return (VX_SUCCESS);
+#else
+   return (VX_FAILURE);
+#endif
+}
+
+vx_status_t vx_ring_set_full (vx_ring_t *ring, vx_ring_policy_t policy, uint32_t msec)
+{
+   if ((policy == VX_RING_GROW && ring->type != VX_RING_LOCKED) ||
+       (policy == VX_RING_DROP_OLDEST && ring->type == VX_RING_SPSC))
+      return (VX_FAILURE);
+   ring->policy = policy;
+   ring->full_msec = msec;
+   return (VX_SUCCESS);
+}
+
+void vx_ring_set_drop_func (vx_ring_t *ring, vx_ring_drop_func_t drop_func, void *arg)
+{
+   ring->drop_func = drop_func;
+   ring->drop_arg = arg;
+}
+
+uint64_t vx_ring_dropped (vx_ring_t *ring)
+{
+   return (__atomic_load_n (&ring->dropped, __ATOMIC_RELAXED));
+}
+
+size_t vx_ring_depth (vx_ring_t *ring)
+{
+   size_t cons;
+
+   if (ring->type == VX_RING_LOCKED)
+      return (__atomic_load_n (&ring->count, __ATOMIC_RELAXED));
+   cons = __atomic_load_n (&ring->cons, __ATOMIC_ACQUIRE);
+   return (__atomic_load_n (&ring->prod, __ATOMIC_ACQUIRE) - cons);
+}
+
+void vx_ring_stats (vx_ring_t *ring, vx_ring_stats_t *stats)
+{
+   size_t cons, prod;
+   int index;
+
+   stats->pushes = __atomic_load_n (&ring->stats.pushes, __ATOMIC_RELAXED);
+   stats->pops = __atomic_load_n (&ring->stats.pops, __ATOMIC_RELAXED);
+   if (ring->type == VX_RING_LOCKED)
+      stats->depth = __atomic_load_n (&ring->count, __ATOMIC_RELAXED);
+   else
+   {
+      /* the lock free indices are the push and pop totals */
+      cons = __atomic_load_n (&ring->cons, __ATOMIC_ACQUIRE);
+      prod = __atomic_load_n (&ring->prod, __ATOMIC_ACQUIRE);
+      stats->depth = prod - cons;
+      stats->pushes = prod - stats->pushes;
+      stats->pops = cons - stats->pops;
+   }
+   stats->peak = __atomic_load_n (&ring->stats.peak, __ATOMIC_RELAXED);
+   stats->size = ring->size;
+   stats->grows = __atomic_load_n (&ring->stats.grows, __ATOMIC_RELAXED);
+   stats->dropped = __atomic_load_n (&ring->dropped, __ATOMIC_RELAXED);
+   stats->lock_waits = __atomic_load_n (&ring->stats.lock_waits, __ATOMIC_RELAXED);
+   stats->lock_wait_ns = __atomic_load_n (&ring->stats.lock_wait_ns, __ATOMIC_RELAXED);
+   stats->parks = __atomic_load_n (&ring->stats.parks, __ATOMIC_RELAXED);
+   stats->park_ns = __atomic_load_n (&ring->stats.park_ns, __ATOMIC_RELAXED);
+   for (index = 0; index < VX_RING_HIST; index++)
+      stats->park_hist[index] = __atomic_load_n (&ring->stats.park_hist[index], __ATOMIC_RELAXED);
+   stats->full_parks = __atomic_load_n (&ring->stats.full_parks, __ATOMIC_RELAXED);
+   stats->full_park_ns = __atomic_load_n (&ring->stats.full_park_ns, __ATOMIC_RELAXED);
+}
+
+void vx_ring_stats_reset (vx_ring_t *ring)
+{
+   memset (&ring->stats, 0, sizeof (ring->stats));
+   if (ring->type != VX_RING_LOCKED)
+   {
+      /* totals restart from the current indices */
+      ring->stats.pushes = __atomic_load_n (&ring->prod, __ATOMIC_RELAXED);
+      ring->stats.pops = __atomic_load_n (&ring->cons, __ATOMIC_RELAXED);
+   }
 }
@@ -10,12 +10,82 @@
 #define VX_RING_INIT   256
 #define VX_RING_INCR   32
 
+/* default pause rounds before a lock free ring parks a waiting thread */
+#define VX_RING_SPIN   1024
+/* spins or yields value that never moves on to the next stage */
+#define VX_RING_FOREVER UINT32_MAX
+#define VX_RING_CACHELINE 64
+
+/**
+ * VX_RING_LOCKED: mutex protected linked ring, grows when full
+ * VX_RING_SPSC:   lock free power of 2 slot array for exactly one pushing
+ *                 and one popping thread; push waits for room when full
+ * VX_RING_MPMC:   lock free power of 2 array of sequenced cells for any
+ *                 number of pushing and popping threads, same waiting
+ */
+typedef enum vx_ring_type
+{
+   VX_RING_LOCKED = 0,
+   VX_RING_SPSC,
+   VX_RING_MPMC
+} vx_ring_type_t;
+
+/**
+ * what push does when the ring is full:
+ * VX_RING_GROW:        add VX_RING_INCR nodes (VX_RING_LOCKED only, its default),
+ *                      warning once the ring has doubled since the last warning
+ * VX_RING_BLOCK:       wait for room up to the policy's msec, then VX_TIMEOUT
+ * VX_RING_FAIL:        VX_EFULL at once, push_n pushes all n or nothing
+ * VX_RING_DROP_NEWEST: drop the items being pushed
+ * VX_RING_DROP_OLDEST: drop the oldest items to make room (not VX_RING_SPSC)
+ * dropped items go to the drop func, if set, and are counted
+ */
+typedef enum vx_ring_policy
+{
+   VX_RING_GROW = 0,
+   VX_RING_BLOCK,
+   VX_RING_FAIL,
+   VX_RING_DROP_NEWEST,
+   VX_RING_DROP_OLDEST
+} vx_ring_policy_t;
+
+typedef void (*vx_ring_drop_func_t) (void *data, void *arg);
+
+#define VX_RING_HIST   16
+
+/**
+ * vx_ring_stats_t: see vx_ring_stats
+ */
+typedef struct vx_ring_stats
+{
+   uint64_t pushes;
+   uint64_t pops;
+   size_t depth;
+   size_t peak;
+   size_t size;
+   uint64_t grows;
+   uint64_t dropped;
+   uint64_t lock_waits;
+   uint64_t lock_wait_ns;
+   uint64_t parks;
+   uint64_t park_ns;
+   uint64_t park_hist[VX_RING_HIST];
+   uint64_t full_parks;
+   uint64_t full_park_ns;
+} vx_ring_stats_t;
+
 typedef struct vx_ring_ele
 {
    void *data;
    struct vx_ring_ele *next;
 } vx_ring_ele_t;
 
+typedef struct vx_ring_cell
+{
+   size_t seq;
+   void *data;
+} vx_ring_cell_t;
+
 typedef struct vx_ring
 {
    vx_ring_ele_t *head;
@@ -24,13 +94,117 @@ typedef struct vx_ring
    size_t size;
    size_t count;
    size_t waiters;
+   vx_ring_type_t type;
+   void **slots;
+   vx_ring_cell_t *cells;
+   size_t mask;
+   vx_sync_t *room;
+   size_t room_waiters;
+   uint32_t spins;
+   uint32_t yields;
+   int efd;
+   int armed;
+   vx_ring_policy_t policy;
+   uint32_t full_msec;
+   size_t grow_logged;
+   vx_ring_drop_func_t drop_func;
+   void *drop_arg;
+   uint64_t dropped;
+   /* producer and consumer indices each own a cache line */
+   char pad0[VX_RING_CACHELINE];
+   size_t prod;
+   size_t cons_cache;
+   char pad1[VX_RING_CACHELINE - 2 * sizeof (size_t)];
+   size_t cons;
+   size_t prod_cache;
+   char pad2[VX_RING_CACHELINE - 2 * sizeof (size_t)];
+   vx_ring_stats_t stats;
 } vx_ring_t;
 
 vx_status_t vx_ring_create  (vx_ring_t **ring);
+vx_status_t vx_ring_create_ex (vx_ring_t **ring, vx_ring_type_t type, size_t size);
 vx_status_t vx_ring_destroy (vx_ring_t *ring);
 vx_status_t vx_ring_push    (vx_ring_t *ring, void *data);
 vx_status_t vx_ring_pop     (vx_ring_t *ring, void **data);
 vx_status_t vx_ring_pop_timed (vx_ring_t *ring, void **data, uint32_t sec);
 
-#endif
+/**
+ * batched push and pop: push_n moves all n items; pop_n waits for one
+ * item and then takes up to n, storing how many in *count
+ */
+vx_status_t vx_ring_push_n  (vx_ring_t *ring, void **data, size_t n);
+vx_status_t vx_ring_pop_n   (vx_ring_t *ring, void **data, size_t n, size_t *count);
+vx_status_t vx_ring_pop_n_timed (vx_ring_t *ring, void **data, size_t n, size_t *count,
+                                 uint32_t msec);
 
+/**
+ * vx_ring_set_wait: how a thread waits on an empty (or, lock free, full)
+ * ring: spins pause rounds, then yields sched_yield rounds, then it parks
+ * on the condvar. VX_RING_FOREVER stays in that stage. Defaults are 0, 0
+ * for VX_RING_LOCKED and VX_RING_SPIN, 0 for the lock free types.
+ */
+void vx_ring_set_wait (vx_ring_t *ring, uint32_t spins, uint32_t yields);
+
+/**
+ * vx_ring_trypop: pop without waiting, VX_EEMPTY if there is nothing
+ */
+vx_status_t vx_ring_trypop  (vx_ring_t *ring, void **data);
+vx_status_t vx_ring_trypop_n (vx_ring_t *ring, void **data, size_t n, size_t *count);
+
+/**
+ * vx_ring_notify_fd: an eventfd for poll/epoll that turns readable when
+ * items arrive. It stays readable until a trypop finds the ring empty,
+ * which clears and re-arms it, so consumers drain with trypop until
+ * VX_EEMPTY and then poll again; pushes in between cost no syscall. Call
+ * it before other threads use the ring; the ring owns the fd.
+ */
+vx_status_t vx_ring_notify_fd (vx_ring_t *ring, int *fd);
+
+/**
+ * vx_ring_set_full: the full ring policy; msec bounds VX_RING_BLOCK waits
+ * (VX_RING_FOREVER for none). The lock free types default to
+ * VX_RING_BLOCK forever. A VX_RING_BLOCK push_n that times out may have
+ * pushed part of the batch.
+ */
+vx_status_t vx_ring_set_full (vx_ring_t *ring, vx_ring_policy_t policy, uint32_t msec);
+
+/**
+ * vx_ring_set_drop_func: called for each dropped item, on VX_RING_LOCKED
+ * with the ring locked
+ */
+void vx_ring_set_drop_func (vx_ring_t *ring, vx_ring_drop_func_t drop_func, void *arg);
+uint64_t vx_ring_dropped (vx_ring_t *ring);
+
+/**
+ * vx_ring_depth: items in the ring, without taking its lock; on the lock
+ * free types it counts pushes still in progress
+ */
+size_t vx_ring_depth (vx_ring_t *ring);
+
+/**
+ * vx_ring_stats: snapshot of the ring's counters, safe to take from any
+ * thread while the ring is in use.
+ *    pushes, pops     items in and out since create or the last reset
+ *    depth, peak      items in the ring now and at most so far (sampled
+ *                     every 16 pushes on VX_RING_MPMC)
+ *    grows            VX_RING_GROW extensions
+ *    lock_waits       contended locks of a VX_RING_LOCKED ring, and the
+ *    lock_wait_ns     time spent getting them
+ *    parks, park_ns   consumers put to sleep on an empty ring, and for how
+ *    park_hist        long: park_hist[n] counts parks of under 2^n us
+ *                     (n = 0 is under 1us, the last bucket takes the rest)
+ *    full_parks       producers put to sleep on a full ring, and for how
+ *    full_park_ns     long
+ * Spinning and yielding before a park are not counted. VX_RING_NO_STATS
+ * compiles the counters out; depth and, for the lock free types, pushes
+ * and pops still work.
+ */
+void vx_ring_stats (vx_ring_t *ring, vx_ring_stats_t *stats);
+
+/**
+ * vx_ring_stats_reset: restart the counters and peak, not thread safe
+ * against concurrent pushes and pops
+ */
+void vx_ring_stats_reset (vx_ring_t *ring);
+
+#endif
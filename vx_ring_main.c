@@ -0,0 +1,205 @@
+/**
+ * Copyright 2008 - 2012 Ampersand, Inc.  All rights reserved.
+ *
+ * vx_ring stress check: producers push numbered items through a small
+ * ring to consumers mixing pop, pop_timed and pop_n. Every item must come
+ * out exactly once, and each consumer must see every producer's items in
+ * the order they were pushed; the run aborts on the first violation.
+ *
+ *    vx_ring_main                      locked, spsc and mpmc with defaults
+ *    vx_ring_main -y mpmc -p 4 -c 4 -s 8 -n 200000
+ */
+
+#include <vx_ring.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+
+#define VX_MAIN_THREADS 16
+#define VX_MAIN_BATCH   4
+
+typedef struct vx_main
+{
+   vx_ring_t *ring;
+   size_t producers;
+   size_t consumers;
+   size_t items;
+   uint8_t *seen;
+} vx_main_t;
+
+typedef struct vx_main_thread
+{
+   vx_main_t *run;
+   size_t index;
+   pthread_t thread;
+} vx_main_thread_t;
+
+/**
+ * items are producer * items + n + 1 for the producer's nth push, so 0
+ * (NULL) is free to tell consumers to stop
+ */
+static void * vx_main_producer (void *arg)
+{
+   vx_main_thread_t *self = (vx_main_thread_t *) arg;
+   vx_main_t *run = self->run;
+   void *batch[VX_MAIN_BATCH];
+   size_t base = self->index * run->items, ndx, fill;
+   vx_status_t rc;
+
+   for (ndx = 0; ndx < run->items; )
+   {
+      if (self->index % 2 == 0 || run->items - ndx < VX_MAIN_BATCH)
+      {
+         rc = vx_ring_push (run->ring, (void *) (uintptr_t) (base + ++ndx));
+         assert (rc == VX_SUCCESS);
+         continue;
+      }
+      for (fill = 0; fill < VX_MAIN_BATCH; fill++)
+         batch[fill] = (void *) (uintptr_t) (base + ++ndx);
+      rc = vx_ring_push_n (run->ring, batch, VX_MAIN_BATCH);
+      assert (rc == VX_SUCCESS);
+   }
+   return (NULL);
+}
+
+static int vx_main_take (vx_main_t *run, size_t *last, void *data)
+{
+   size_t item = (uintptr_t) data - 1, producer;
+   uint8_t seen;
+
+   if (data == NULL)
+      return (0);
+   producer = item / run->items;
+   assert (producer < run->producers);
+   seen = __atomic_add_fetch (&run->seen[item], 1, __ATOMIC_RELAXED);
+   assert (seen == 1);
+   /* last holds the producer's previous item plus one, 0 for none yet */
+   assert (item + 1 > last[producer]);
+   last[producer] = item + 1;
+   return (1);
+}
+
+static void * vx_main_consumer (void *arg)
+{
+   vx_main_thread_t *self = (vx_main_thread_t *) arg;
+   vx_main_t *run = self->run;
+   size_t last[VX_MAIN_THREADS] = { 0 };
+   void *batch[VX_MAIN_BATCH];
+   size_t count, ndx, stops;
+   void *data;
+
+   for (;;)
+   {
+      switch (self->index % 3)
+      {
+      case 0:
+         vx_ring_pop (run->ring, &data);
+         if (!vx_main_take (run, last, data))
+            return (NULL);
+         break;
+      case 1:
+         if (vx_ring_pop_timed (run->ring, &data, 1) != VX_SUCCESS)
+            break;
+         if (!vx_main_take (run, last, data))
+            return (NULL);
+         break;
+      default:
+         vx_ring_pop_n (run->ring, batch, VX_MAIN_BATCH, &count);
+         for (ndx = 0, stops = 0; ndx < count; ndx++)
+            if (!vx_main_take (run, last, batch[ndx]))
+               stops++;
+         /* only stops follow a stop, hand the extra ones back */
+         for (; stops > 1; stops--)
+            vx_ring_push (run->ring, NULL);
+         if (stops)
+            return (NULL);
+      }
+   }
+}
+
+static void vx_main_run (vx_ring_type_t type, const char *name, size_t producers,
+                         size_t consumers, size_t size, size_t items)
+{
+   vx_main_thread_t prod[VX_MAIN_THREADS], cons[VX_MAIN_THREADS];
+   struct timespec start, end;
+   vx_ring_stats_t stats;
+   vx_main_t run;
+   vx_status_t rc;
+   size_t ndx;
+
+   assert (producers && producers <= VX_MAIN_THREADS && consumers && consumers <= VX_MAIN_THREADS);
+   memset (&run, 0, sizeof (run));
+   run.producers = producers;
+   run.consumers = consumers;
+   run.items = items;
+   run.seen = calloc (producers * items, 1);
+   assert (run.seen != NULL);
+   rc = vx_ring_create_ex (&run.ring, type, size);
+   assert (rc == VX_SUCCESS);
+   if (type == VX_RING_LOCKED)
+      vx_ring_set_full (run.ring, VX_RING_BLOCK, VX_RING_FOREVER);
+
+   clock_gettime (CLOCK_MONOTONIC, &start);
+   for (ndx = 0; ndx < consumers; ndx++)
+   {
+      cons[ndx].run = &run;
+      cons[ndx].index = ndx;
+      pthread_create (&cons[ndx].thread, NULL, vx_main_consumer, &cons[ndx]);
+   }
+   for (ndx = 0; ndx < producers; ndx++)
+   {
+      prod[ndx].run = &run;
+      prod[ndx].index = ndx;
+      pthread_create (&prod[ndx].thread, NULL, vx_main_producer, &prod[ndx]);
+   }
+   for (ndx = 0; ndx < producers; ndx++)
+      pthread_join (prod[ndx].thread, NULL);
+   for (ndx = 0; ndx < consumers; ndx++)
+      vx_ring_push (run.ring, NULL);
+   for (ndx = 0; ndx < consumers; ndx++)
+      pthread_join (cons[ndx].thread, NULL);
+   clock_gettime (CLOCK_MONOTONIC, &end);
+
+   for (ndx = 0; ndx < producers * items; ndx++)
+      assert (run.seen[ndx] == 1);
+   vx_ring_stats (run.ring, &stats);
+   printf ("%s: %zu producers, %zu consumers, %zu slots: %zu items once each, "
+           "%.0f ns/item, %llu parks\n", name, producers, consumers, size, producers * items,
+           ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / (producers * items),
+           (unsigned long long) stats.parks);
+   vx_ring_destroy (run.ring);
+   free (run.seen);
+}
+
+int main (int argc, char *argv[])
+{
+   size_t producers = 4, consumers = 4, size = 8, items = 200000;
+   const char *type = NULL;
+   int opt;
+
+   while ((opt = getopt (argc, argv, "y:p:c:s:n:")) != -1)
+   {
+      switch (opt)
+      {
+      case 'y': type = optarg; break;
+      case 'p': producers = strtoul (optarg, NULL, 0); break;
+      case 'c': consumers = strtoul (optarg, NULL, 0); break;
+      case 's': size = strtoul (optarg, NULL, 0); break;
+      case 'n': items = strtoul (optarg, NULL, 0); break;
+      default:
+         fprintf (stderr, "usage: %s [-y locked|spsc|mpmc] [-p producers] [-c consumers] "
+                  "[-s size] [-n items]\n", argv[0]);
+         return (1);
+      }
+   }
+
+   if (type == NULL || strcmp (type, "locked") == 0)
+      vx_main_run (VX_RING_LOCKED, "locked", producers, consumers, size, items);
+   if (type == NULL || strcmp (type, "spsc") == 0)
+      vx_main_run (VX_RING_SPSC, "spsc", 1, 1, size, items);
+   if (type == NULL || strcmp (type, "mpmc") == 0)
+      vx_main_run (VX_RING_MPMC, "mpmc", producers, consumers, size, items);
+   return (0);
+}
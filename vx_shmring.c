@@ -0,0 +1,527 @@
+/**
+ * Copyright 2008 - 2012 Ampersand, Inc.  All rights reserved.
+*/
+
+#include <vx_shmring.h>
+#include <vx_log.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+#endif
+
+#define VX_SHMRING_MAGIC   0x76787372
+#define VX_SHMRING_VERSION 1
+#define VX_SHMRING_MIN     64
+/* record length marking the unused tail skipped on wrap */
+#define VX_SHMRING_SKIP    UINT32_MAX
+#define VX_SHMRING_CACHELINE 64
+
+#define BILLION  1000000000
+
+/**
+ * vx_shmring_hdr_t: the start of the mapping. The producer's and the
+ * consumer's positions count bytes since create and each own a line; the
+ * futex word and waiting flag next to a position are the ones its
+ * writer wakes.
+ */
+typedef struct vx_shmring_hdr
+{
+   uint32_t magic;
+   uint32_t version;
+   uint64_t size;
+   char pad0[VX_SHMRING_CACHELINE - 16];
+   uint64_t prod;
+   uint32_t data_seq;
+   uint32_t cons_waiting;
+   char pad1[VX_SHMRING_CACHELINE - 16];
+   uint64_t cons;
+   uint32_t room_seq;
+   uint32_t prod_waiting;
+   char pad2[VX_SHMRING_CACHELINE - 16];
+} vx_shmring_hdr_t;
+
+/**
+ * vx_shmring_rec_t: each record starts 8 byte aligned with its length
+ */
+typedef struct vx_shmring_rec
+{
+   uint32_t len;
+   uint32_t unused;
+} vx_shmring_rec_t;
+
+/**
+ * vx_shmring_t: this process's handle; the cached positions and the
+ * pending reservation or peek belong to its side only
+ */
+struct vx_shmring
+{
+   vx_shmring_hdr_t *hdr;
+   char *data;
+   uint64_t size;
+   uint64_t mask;
+   size_t map_size;
+   int fd;
+   char *name;
+   uint64_t prod;
+   uint64_t cons_cache;
+   uint64_t resv;
+   size_t resv_len;
+   uint64_t cons;
+   uint64_t prod_cache;
+   size_t peek_need;
+};
+
+static inline size_t vx_shmring_need (size_t len)
+{
+   return ((len + sizeof (vx_shmring_rec_t) + 7) & ~(size_t) 7);
+}
+
+static inline void vx_shmring_pause (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause ();
+#endif
+}
+
+static void vx_shmring_deadline (struct timespec *ts, uint32_t msec)
+{
+   clock_gettime (CLOCK_MONOTONIC, ts);
+   ts->tv_sec += msec / 1000;
+   ts->tv_nsec += (long) (msec % 1000) * 1000000;
+   if (ts->tv_nsec >= BILLION)
+   {
+      ts->tv_sec++;
+      ts->tv_nsec -= BILLION;
+   }
+}
+
+/**
+ * vx_shmring_left: time to the deadline in rel, 0 once it has passed
+ */
+static int vx_shmring_left (const struct timespec *ts, struct timespec *rel)
+{
+   struct timespec now;
+
+   clock_gettime (CLOCK_MONOTONIC, &now);
+   rel->tv_sec = ts->tv_sec - now.tv_sec;
+   rel->tv_nsec = ts->tv_nsec - now.tv_nsec;
+   if (rel->tv_nsec < 0)
+   {
+      rel->tv_sec--;
+      rel->tv_nsec += BILLION;
+   }
+   return (rel->tv_sec >= 0);
+}
+
+static void vx_shmring_futex_wait (uint32_t *word, uint32_t val, const struct timespec *rel)
+{
+#ifdef __linux__
+   syscall (SYS_futex, word, FUTEX_WAIT, val, rel, NULL, 0);
+#else
+   (void) word;
+   (void) val;
+   (void) rel;
+   sched_yield ();
+#endif
+}
+
+/**
+ * The same Dekker handshake as vx_ring's, across processes: a process
+ * registered for global expedited membarrier gets by with a compiler
+ * barrier after moving a position, and a side on its way to sleep issues
+ * the membarrier for both.
+ */
+static pthread_once_t vx_shmring_once = PTHREAD_ONCE_INIT;
+static int vx_shmring_asym = 0;
+
+static void vx_shmring_asym_init (void)
+{
+#if defined(__linux__) && defined(SYS_membarrier)
+   vx_shmring_asym = syscall (SYS_membarrier, MEMBARRIER_CMD_REGISTER_GLOBAL_EXPEDITED, 0) == 0;
+#endif
+}
+
+static inline void vx_shmring_fence_fast (void)
+{
+   if (vx_shmring_asym)
+      __atomic_signal_fence (__ATOMIC_SEQ_CST);
+   else
+      __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+static void vx_shmring_fence_slow (void)
+{
+#if defined(__linux__) && defined(SYS_membarrier)
+   /* issued even if we are not registered, the other process may be */
+   if (syscall (SYS_membarrier, MEMBARRIER_CMD_GLOBAL_EXPEDITED, 0) == 0)
+      return;
+#endif
+   __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+/**
+ * vx_shmring_wake: after moving a position, wake the other side if it
+ * parked: either the waiter sees the new position or we see its flag.
+ * Taking the flag leaves later moves syscall free until the waiter runs
+ * and raises it again.
+ */
+static void vx_shmring_wake (uint32_t *seq, uint32_t *waiting)
+{
+   vx_shmring_fence_fast ();
+   if (__atomic_load_n (waiting, __ATOMIC_RELAXED) &&
+       __atomic_exchange_n (waiting, 0, __ATOMIC_RELAXED))
+   {
+      __atomic_add_fetch (seq, 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+      syscall (SYS_futex, seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+   }
+}
+
+/**
+ * vx_shmring_wait: until *pos moves off seen; spin first, then park on
+ * seq with waiting raised. ts is the deadline, set up by the first call.
+ */
+static vx_status_t vx_shmring_wait (uint64_t *pos, uint64_t seen, uint32_t *seq, uint32_t *waiting,
+                                    uint32_t msec, struct timespec *ts, int *armed)
+{
+   struct timespec rel;
+   uint32_t round, val;
+
+   for (round = 0; round < VX_RING_SPIN; round++)
+   {
+      if (__atomic_load_n (pos, __ATOMIC_ACQUIRE) != seen)
+         return (VX_SUCCESS);
+      vx_shmring_pause ();
+   }
+
+   if (msec != VX_RING_FOREVER && !(*armed))
+   {
+      vx_shmring_deadline (ts, msec);
+      (*armed) = 1;
+   }
+   for (;;)
+   {
+      val = __atomic_load_n (seq, __ATOMIC_ACQUIRE);
+      __atomic_store_n (waiting, 1, __ATOMIC_RELAXED);
+      vx_shmring_fence_slow ();
+      if (__atomic_load_n (pos, __ATOMIC_ACQUIRE) != seen)
+         break;
+      if (msec == VX_RING_FOREVER)
+         vx_shmring_futex_wait (seq, val, NULL);
+      else if (vx_shmring_left (ts, &rel))
+         vx_shmring_futex_wait (seq, val, &rel);
+      else
+      {
+         __atomic_store_n (waiting, 0, __ATOMIC_RELAXED);
+         return (VX_TIMEOUT);
+      }
+   }
+   __atomic_store_n (waiting, 0, __ATOMIC_RELAXED);
+   return (VX_SUCCESS);
+}
+
+static vx_status_t vx_shmring_map (vx_shmring_t **ring, int fd, uint64_t size)
+{
+   pthread_once (&vx_shmring_once, vx_shmring_asym_init);
+   (*ring) = (vx_shmring_t *) calloc (1, sizeof (vx_shmring_t));
+   if ((*ring) == NULL)
+   {
+      close (fd);
+      return (VX_ENOMEM);
+   }
+   (*ring)->fd = fd;
+   (*ring)->resv_len = SIZE_MAX;
+   (*ring)->size = size;
+   (*ring)->mask = size - 1;
+   (*ring)->map_size = sizeof (vx_shmring_hdr_t) + size;
+   (*ring)->hdr = mmap (NULL, (*ring)->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if ((*ring)->hdr == MAP_FAILED)
+   {
+      vxlog (LOG_ERR, "{%s:%d} mmap failed: %d", __func__, __LINE__, errno);
+      (*ring)->hdr = NULL;
+      vx_shmring_close (*ring);
+      return (VX_FAILURE);
+   }
+   (*ring)->data = (char *) ((*ring)->hdr + 1);
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_shmring_create (vx_shmring_t **ring, const char *name, size_t size)
+{
+   vx_status_t rc;
+   uint64_t bytes;
+   int fd;
+
+   for (bytes = VX_SHMRING_MIN; bytes < size; bytes <<= 1)
+      ;
+   if (name)
+      fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+   else
+   {
+#ifdef __linux__
+      fd = memfd_create ("vx_shmring", MFD_CLOEXEC);
+#else
+      fd = -1;
+      errno = ENOSYS;
+#endif
+   }
+   if (fd < 0)
+   {
+      vxlog (LOG_ERR, "{%s:%d} shm_open/memfd_create failed: %d", __func__, __LINE__, errno);
+      return (VX_FAILURE);
+   }
+   if (ftruncate (fd, sizeof (vx_shmring_hdr_t) + bytes) < 0)
+   {
+      vxlog (LOG_ERR, "{%s:%d} ftruncate failed: %d", __func__, __LINE__, errno);
+      close (fd);
+      if (name)
+         shm_unlink (name);
+      return (VX_FAILURE);
+   }
+   if ((rc = vx_shmring_map (ring, fd, bytes)) != VX_SUCCESS)
+   {
+      if (name)
+         shm_unlink (name);
+      return (rc);
+   }
+   if (name && ((*ring)->name = strdup (name)) == NULL)
+   {
+      shm_unlink (name);
+      vx_shmring_close (*ring);
+      return (VX_ENOMEM);
+   }
+
+   /* the new object reads as zeros; magic goes in last for openers */
+   (*ring)->hdr->version = VX_SHMRING_VERSION;
+   (*ring)->hdr->size = bytes;
+   __atomic_store_n (&(*ring)->hdr->magic, VX_SHMRING_MAGIC, __ATOMIC_RELEASE);
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_shmring_open_fd (vx_shmring_t **ring, int fd)
+{
+   vx_shmring_hdr_t *hdr;
+   struct stat st;
+   uint64_t size;
+
+   if (fstat (fd, &st) < 0 || (size_t) st.st_size < sizeof (vx_shmring_hdr_t))
+   {
+      vxlog (LOG_ERR, "{%s:%d} not a vx_shmring", __func__, __LINE__);
+      close (fd);
+      return (VX_FAILURE);
+   }
+   hdr = mmap (NULL, sizeof (vx_shmring_hdr_t), PROT_READ, MAP_SHARED, fd, 0);
+   if (hdr == MAP_FAILED)
+   {
+      vxlog (LOG_ERR, "{%s:%d} mmap failed: %d", __func__, __LINE__, errno);
+      close (fd);
+      return (VX_FAILURE);
+   }
+   /* create stores magic last: version and size are only settled after it */
+   if (__atomic_load_n (&hdr->magic, __ATOMIC_ACQUIRE) != VX_SHMRING_MAGIC ||
+       hdr->version != VX_SHMRING_VERSION || (size = hdr->size) < VX_SHMRING_MIN ||
+       (size & (size - 1)) ||
+       (uint64_t) st.st_size < sizeof (vx_shmring_hdr_t) + size)
+   {
+      vxlog (LOG_ERR, "{%s:%d} not a vx_shmring", __func__, __LINE__);
+      munmap (hdr, sizeof (vx_shmring_hdr_t));
+      close (fd);
+      return (VX_FAILURE);
+   }
+   munmap (hdr, sizeof (vx_shmring_hdr_t));
+   if (vx_shmring_map (ring, fd, size) != VX_SUCCESS)
+      return (VX_FAILURE);
+
+   /* pick up where the last holder of either side left off */
+   (*ring)->prod = (*ring)->prod_cache = __atomic_load_n (&(*ring)->hdr->prod, __ATOMIC_ACQUIRE);
+   (*ring)->cons = (*ring)->cons_cache = __atomic_load_n (&(*ring)->hdr->cons, __ATOMIC_ACQUIRE);
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_shmring_open (vx_shmring_t **ring, const char *name)
+{
+   int fd;
+
+   if ((fd = shm_open (name, O_RDWR, 0)) < 0)
+   {
+      vxlog (LOG_ERR, "{%s:%d} shm_open failed: %d", __func__, __LINE__, errno);
+      return (VX_FAILURE);
+   }
+   return (vx_shmring_open_fd (ring, fd));
+}
+
+vx_status_t vx_shmring_close (vx_shmring_t *ring)
+{
+   if (ring->hdr)
+      munmap (ring->hdr, ring->map_size);
+   if (ring->fd >= 0)
+      close (ring->fd);
+   if (ring->name)
+   {
+      shm_unlink (ring->name);
+      free (ring->name);
+   }
+   free (ring);
+   return (VX_SUCCESS);
+}
+
+int vx_shmring_fd (vx_shmring_t *ring)
+{
+   return (ring->fd);
+}
+
+size_t vx_shmring_max (vx_shmring_t *ring)
+{
+   uint64_t max = ring->size / 2 - sizeof (vx_shmring_rec_t);
+
+   /* lengths travel as uint32_t, and VX_SHMRING_SKIP is taken */
+   return ((size_t) (max < VX_SHMRING_SKIP ? max : VX_SHMRING_SKIP - 1));
+}
+
+vx_status_t vx_shmring_reserve (vx_shmring_t *ring, size_t len, void **ptr, uint32_t msec)
+{
+   uint64_t prod = ring->prod, off = prod & ring->mask, skip = 0, seen;
+   size_t need;
+   struct timespec ts;
+   vx_status_t rc;
+   int armed = 0;
+
+   if (len > vx_shmring_max (ring))
+      return (VX_FAILURE);
+   need = vx_shmring_need (len);
+   /* a record never wraps, the tail it does not fit in is skipped */
+   if (ring->size - off < need)
+      skip = ring->size - off;
+
+   while (prod + skip + need - ring->cons_cache > ring->size)
+   {
+      seen = ring->cons_cache;
+      ring->cons_cache = __atomic_load_n (&ring->hdr->cons, __ATOMIC_ACQUIRE);
+      if (ring->cons_cache != seen)
+         continue;
+      if (msec == 0)
+         return (VX_EFULL);
+      if ((rc = vx_shmring_wait (&ring->hdr->cons, seen, &ring->hdr->room_seq,
+                                 &ring->hdr->prod_waiting, msec, &ts, &armed)) != VX_SUCCESS)
+         return (rc);
+   }
+
+   if (skip)
+   {
+      ((vx_shmring_rec_t *) (ring->data + off))->len = VX_SHMRING_SKIP;
+      prod += skip;
+   }
+   ring->resv = prod;
+   ring->resv_len = len;
+   (*ptr) = ring->data + (prod & ring->mask) + sizeof (vx_shmring_rec_t);
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_shmring_commit (vx_shmring_t *ring, size_t len)
+{
+   if (ring->resv_len == SIZE_MAX || len > ring->resv_len)
+      return (VX_FAILURE);
+
+   ((vx_shmring_rec_t *) (ring->data + (ring->resv & ring->mask)))->len = (uint32_t) len;
+   ring->prod = ring->resv + vx_shmring_need (len);
+   ring->resv_len = SIZE_MAX;
+   __atomic_store_n (&ring->hdr->prod, ring->prod, __ATOMIC_RELEASE);
+   vx_shmring_wake (&ring->hdr->data_seq, &ring->hdr->cons_waiting);
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_shmring_push (vx_shmring_t *ring, const void *data, size_t len, uint32_t msec)
+{
+   vx_status_t rc;
+   void *ptr;
+
+   if ((rc = vx_shmring_reserve (ring, len, &ptr, msec)) != VX_SUCCESS)
+      return (rc);
+   memcpy (ptr, data, len);
+   return (vx_shmring_commit (ring, len));
+}
+
+vx_status_t vx_shmring_peek (vx_shmring_t *ring, void **ptr, size_t *len, uint32_t msec)
+{
+   uint64_t cons = ring->cons;
+   vx_shmring_rec_t *rec;
+   struct timespec ts;
+   vx_status_t rc;
+   uint32_t rlen;
+   size_t need;
+   int armed = 0;
+
+   for (;;)
+   {
+      if (cons == ring->prod_cache)
+      {
+         ring->prod_cache = __atomic_load_n (&ring->hdr->prod, __ATOMIC_ACQUIRE);
+         if (cons == ring->prod_cache)
+         {
+            if (msec == 0)
+               return (VX_EEMPTY);
+            if ((rc = vx_shmring_wait (&ring->hdr->prod, cons, &ring->hdr->data_seq,
+                                       &ring->hdr->cons_waiting, msec, &ts, &armed)) != VX_SUCCESS)
+               return (rc);
+            continue;
+         }
+      }
+      rec = (vx_shmring_rec_t *) (ring->data + (cons & ring->mask));
+      rlen = __atomic_load_n (&rec->len, __ATOMIC_RELAXED);
+      if (rlen != VX_SHMRING_SKIP)
+         break;
+      cons += ring->size - (cons & ring->mask);
+      if (cons > ring->prod_cache)
+         return (VX_FAILURE);
+   }
+
+   /* the length comes from the other process: it must fit what was published */
+   need = vx_shmring_need (rlen);
+   if (rlen > vx_shmring_max (ring) || (cons & ring->mask) + need > ring->size ||
+       cons + need > ring->prod_cache)
+   {
+      vxlog (LOG_ERR, "{%s:%d} bad record length %u at %llu", __func__, __LINE__,
+         rlen, (unsigned long long) cons);
+      return (VX_FAILURE);
+   }
+
+   ring->cons = cons;
+   ring->peek_need = need;
+   (*ptr) = rec + 1;
+   (*len) = rlen;
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_shmring_release (vx_shmring_t *ring)
+{
+   if (ring->peek_need == 0)
+      return (VX_FAILURE);
+
+   ring->cons += ring->peek_need;
+   ring->peek_need = 0;
+   __atomic_store_n (&ring->hdr->cons, ring->cons, __ATOMIC_RELEASE);
+   vx_shmring_wake (&ring->hdr->room_seq, &ring->hdr->prod_waiting);
+   return (VX_SUCCESS);
+}
+
+vx_status_t vx_shmring_pop (vx_shmring_t *ring, void *buf, size_t size, size_t *len, uint32_t msec)
+{
+   vx_status_t rc;
+   void *ptr;
+
+   if ((rc = vx_shmring_peek (ring, &ptr, len, msec)) != VX_SUCCESS)
+      return (rc);
+   if ((*len) > size)
+      return (VX_FAILURE);
+   memcpy (buf, ptr, (*len));
+   return (vx_shmring_release (ring));
+}
@@ -0,0 +1,68 @@
+/**
+ * Copyright 2008 - 2012 Ampersand, Inc.  All rights reserved.
+*/
+
+#ifndef _VX_SHMRING_H_
+#define _VX_SHMRING_H_
+
+#include <vx_ring.h>
+
+/**
+ * vx_shmring_t: single producer, single consumer ring of variable length
+ * records kept inline in a shared memory mapping, so the producer and the
+ * consumer may be different processes. Records are written and read in
+ * place: reserve hands out room in the ring, commit publishes it, peek
+ * hands out the oldest record and release gives its room back. Neither
+ * side makes a syscall unless the other is parked on a full or empty ring,
+ * which it does on a process shared futex after VX_RING_SPIN pause rounds.
+ *
+ * The msec argument of the waiting calls is 0 to fail at once (VX_EFULL,
+ * VX_EEMPTY), VX_RING_FOREVER to wait as long as it takes, and otherwise
+ * the longest wait before VX_TIMEOUT.
+ */
+typedef struct vx_shmring vx_shmring_t;
+
+/**
+ * vx_shmring_create: a new ring of size bytes (rounded up to a power of
+ * 2) in the POSIX shared memory object name, which must not exist yet, or
+ * with a NULL name in an anonymous memfd to hand to the other process
+ * with vx_shmring_fd. The creator's close unlinks name.
+ */
+vx_status_t vx_shmring_create (vx_shmring_t **ring, const char *name, size_t size);
+
+/**
+ * vx_shmring_open: map a ring created by another process, by name or by
+ * a descriptor of its memfd or shared memory object; the ring owns fd
+ */
+vx_status_t vx_shmring_open (vx_shmring_t **ring, const char *name);
+vx_status_t vx_shmring_open_fd (vx_shmring_t **ring, int fd);
+vx_status_t vx_shmring_close (vx_shmring_t *ring);
+int vx_shmring_fd (vx_shmring_t *ring);
+
+/**
+ * vx_shmring_max: the longest record the ring takes, half its size less
+ * the record header, and below UINT32_MAX
+ */
+size_t vx_shmring_max (vx_shmring_t *ring);
+
+/**
+ * producer side: reserve room for a record of up to len bytes at *ptr,
+ * fill it in, then commit the len actually used. A second reserve before
+ * the commit replaces the first. push copies a record in.
+ */
+vx_status_t vx_shmring_reserve (vx_shmring_t *ring, size_t len, void **ptr, uint32_t msec);
+vx_status_t vx_shmring_commit (vx_shmring_t *ring, size_t len);
+vx_status_t vx_shmring_push (vx_shmring_t *ring, const void *data, size_t len, uint32_t msec);
+
+/**
+ * consumer side: peek at the oldest record, read it in place, then
+ * release it. pop copies a record out to buf; a record longer than size
+ * stays in the ring, pop fails and sets *len to its length. A record whose
+ * length runs past max, the ring or what the producer published fails
+ * with VX_FAILURE.
+ */
+vx_status_t vx_shmring_peek (vx_shmring_t *ring, void **ptr, size_t *len, uint32_t msec);
+vx_status_t vx_shmring_release (vx_shmring_t *ring);
+vx_status_t vx_shmring_pop (vx_shmring_t *ring, void *buf, size_t size, size_t *len, uint32_t msec);
+
+#endif
@@ -0,0 +1,193 @@
+/**
+ * Copyright 2008 - 2012 Ampersand, Inc.  All rights reserved.
+ *
+ * vx_shmring cross-process check. A forked consumer opens the ring by
+ * name and reads records of varying length, some close to max so the
+ * ring wraps and skips, while the parent produces with push and with
+ * reserve/commit. The ring is small so both sides keep parking on the
+ * shared futexes; a lost wakeup hangs the run and the alarm turns that
+ * into a failure. Every record must arrive in order and intact. Then a
+ * forked consumer must reject records whose length was corrupted by the
+ * producer's side: longer than max, and longer than what was published.
+ *
+ *    vx_shmring_main [-s size] [-n records] [-t secs]
+ */
+
+#include <vx_shmring.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/* alarms are not inherited, each forked child sets its own */
+static unsigned int vx_main_secs = 120;
+
+static void vx_main_alarm (int sig)
+{
+   static const char msg[] = "vx_shmring_main: no progress, lost wakeup?\n";
+   ssize_t rc;
+
+   rc = write (STDERR_FILENO, msg, sizeof (msg) - 1);
+   _exit (rc < 0 ? 3 : 2);
+}
+
+/**
+ * record n is n as a uint64_t followed by bytes of n's low byte, its
+ * length cycling from 8 up to max
+ */
+static size_t vx_main_len (uint64_t n, size_t max)
+{
+   if (n % 17 == 0)
+      return (max);
+   return (sizeof (n) + (n * 7919) % (max - sizeof (n) + 1));
+}
+
+static int vx_main_consume (const char *name, size_t records)
+{
+   vx_shmring_t *ring;
+   char *buf;
+   uint64_t n, got;
+   size_t len, max, ndx;
+
+   if (vx_shmring_open (&ring, name) != VX_SUCCESS)
+      return (1);
+   max = vx_shmring_max (ring);
+   if ((buf = malloc (max)) == NULL)
+      return (1);
+   for (n = 0; n < records; n++)
+   {
+      if (vx_shmring_pop (ring, buf, max, &len, VX_RING_FOREVER) != VX_SUCCESS)
+         return (1);
+      memcpy (&got, buf, sizeof (got));
+      if (got != n || len != vx_main_len (n, max))
+      {
+         fprintf (stderr, "record %llu: got %llu of %zu bytes\n", (unsigned long long) n,
+                  (unsigned long long) got, len);
+         return (1);
+      }
+      for (ndx = sizeof (n); ndx < len; ndx++)
+         if ((uint8_t) buf[ndx] != (n & 0xff))
+            return (1);
+   }
+   free (buf);
+   vx_shmring_close (ring);
+   return (0);
+}
+
+static void vx_main_stream (size_t size, size_t records)
+{
+   vx_shmring_t *ring;
+   char name[64], *buf;
+   size_t len, max;
+   vx_status_t rc;
+   uint64_t n;
+   void *ptr;
+   pid_t pid;
+   int status;
+
+   snprintf (name, sizeof (name), "/vx_shmring_main.%d", (int) getpid ());
+   rc = vx_shmring_create (&ring, name, size);
+   assert (rc == VX_SUCCESS);
+   max = vx_shmring_max (ring);
+   buf = malloc (max);
+   assert (buf != NULL);
+
+   if ((pid = fork ()) == 0)
+   {
+      alarm (vx_main_secs);
+      _exit (vx_main_consume (name, records));
+   }
+   assert (pid > 0);
+
+   for (n = 0; n < records; n++)
+   {
+      len = vx_main_len (n, max);
+      if (n % 2)
+      {
+         memcpy (buf, &n, sizeof (n));
+         memset (buf + sizeof (n), (int) (n & 0xff), len - sizeof (n));
+         rc = vx_shmring_push (ring, buf, len, VX_RING_FOREVER);
+      }
+      else if ((rc = vx_shmring_reserve (ring, max, &ptr, VX_RING_FOREVER)) == VX_SUCCESS)
+      {
+         memcpy (ptr, &n, sizeof (n));
+         memset ((char *) ptr + sizeof (n), (int) (n & 0xff), len - sizeof (n));
+         rc = vx_shmring_commit (ring, len);
+      }
+      assert (rc == VX_SUCCESS);
+   }
+
+   while (waitpid (pid, &status, 0) < 0)
+      ;
+   assert (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+   printf ("shmring: %zu records of up to %zu bytes through %zu bytes across fork\n",
+           records, max, size);
+   free (buf);
+   vx_shmring_close (ring);
+}
+
+/**
+ * vx_main_reject: the child opens the memfd and must fail the peek. The
+ * record header sits just before the payload reserve hands out; its first
+ * 32 bits are the length.
+ */
+static void vx_main_reject (uint32_t bad, const char *what)
+{
+   vx_shmring_t *ring, *peer;
+   vx_status_t rc;
+   size_t len;
+   void *ptr;
+   pid_t pid;
+   int status;
+
+   rc = vx_shmring_create (&ring, NULL, 4096);
+   assert (rc == VX_SUCCESS);
+   rc = vx_shmring_reserve (ring, 16, &ptr, 0);
+   assert (rc == VX_SUCCESS);
+   memset (ptr, 0, 16);
+   rc = vx_shmring_commit (ring, 16);
+   assert (rc == VX_SUCCESS);
+   *(uint32_t *) ((char *) ptr - 2 * sizeof (uint32_t)) = bad;
+
+   if ((pid = fork ()) == 0)
+   {
+      if (vx_shmring_open_fd (&peer, dup (vx_shmring_fd (ring))) != VX_SUCCESS)
+         _exit (1);
+      _exit (vx_shmring_peek (peer, &ptr, &len, 0) == VX_FAILURE ? 0 : 1);
+   }
+   assert (pid > 0);
+   while (waitpid (pid, &status, 0) < 0)
+      ;
+   assert (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+   printf ("shmring: length %u (%s) rejected by the peer\n", bad, what);
+   vx_shmring_close (ring);
+}
+
+int main (int argc, char *argv[])
+{
+   size_t size = 4096, records = 200000;
+   int opt;
+
+   while ((opt = getopt (argc, argv, "s:n:t:")) != -1)
+   {
+      switch (opt)
+      {
+      case 's': size = strtoul (optarg, NULL, 0); break;
+      case 'n': records = strtoul (optarg, NULL, 0); break;
+      case 't': vx_main_secs = strtoul (optarg, NULL, 0); break;
+      default:
+         fprintf (stderr, "usage: %s [-s size] [-n records] [-t secs]\n", argv[0]);
+         return (1);
+      }
+   }
+
+   signal (SIGALRM, vx_main_alarm);
+   alarm (vx_main_secs);
+   vx_main_stream (size, records);
+   vx_main_reject (100000, "over max");
+   vx_main_reject (64, "past the published end");
+   alarm (0);
+   return (0);
+}
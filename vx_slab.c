@@ -0,0 +1,215 @@
+/**
+ * vx_slab.c Copyright Voxaris Inc, George Howitt 2008
+ */
+
+#include <vx_slab.h>
+
+#define VX_SLAB_ALIGN   8
+#define VX_SLAB_ROUND(s) (((s) + VX_SLAB_ALIGN - 1) & ~((size_t) VX_SLAB_ALIGN - 1))
+#define VX_ARENA_CLASSES (VX_ARENA_MAX / VX_SLAB_ALIGN)
+
+typedef struct vx_chunk
+{
+   struct vx_chunk *next;
+   size_t size;
+} vx_chunk_t;
+
+struct vx_slab
+{
+   size_t size;
+   size_t chunk;
+   void *free;
+   char *bump;
+   char *end;
+   vx_chunk_t *chunks;
+   size_t used;
+   size_t reserved;
+};
+
+/**
+ * vx_block_t: header of a block over VX_ARENA_MAX, malloc'd on its own and
+ * linked both ways so vx_arena_free can hand it straight back
+ */
+typedef struct vx_block
+{
+   struct vx_block *next;
+   struct vx_block *prev;
+   size_t size;
+} vx_block_t;
+
+struct vx_arena
+{
+   void *free[VX_ARENA_CLASSES];
+   char *bump;
+   char *end;
+   vx_chunk_t *chunks;
+   vx_block_t *blocks;
+   size_t used;
+   size_t reserved;
+};
+
+/**
+ * vx_chunk_new: a chunk of size usable bytes pushed onto list
+ */
+static char * vx_chunk_new (vx_chunk_t **list, size_t size, size_t *reserved)
+{
+   vx_chunk_t *chunk;
+   chunk = malloc (sizeof (vx_chunk_t) + size);
+   assert (chunk != NULL);
+   chunk->size = size;
+   chunk->next = *list;
+   *list = chunk;
+   *reserved += sizeof (vx_chunk_t) + size;
+   return ((char *) (chunk + 1));
+}
+
+static void vx_chunk_free (vx_chunk_t *list)
+{
+   vx_chunk_t *next;
+   for (; list; list = next)
+   {
+      next = list->next;
+      free (list);
+   }
+}
+
+vx_slab_t * vx_slab_create (size_t size)
+{
+   vx_slab_t *slab;
+   slab = calloc (1, sizeof (vx_slab_t));
+   assert (slab != NULL);
+   slab->size = VX_SLAB_ROUND(size < sizeof (void *) ? sizeof (void *) : size);
+   /* objects bigger than a chunk get chunks of one object each */
+   slab->chunk = slab->size > VX_SLAB_CHUNK ? slab->size : VX_SLAB_CHUNK;
+   return (slab);
+}
+
+void vx_slab_destroy (vx_slab_t *slab)
+{
+   vx_chunk_free (slab->chunks);
+   free (slab);
+}
+
+void * vx_slab_alloc (vx_slab_t *slab)
+{
+   void *ptr;
+
+   slab->used += slab->size;
+   if ((ptr = slab->free) != NULL)
+   {
+      slab->free = *(void **) ptr;
+      return (ptr);
+   }
+   if (slab->bump + slab->size > slab->end)
+   {
+      slab->bump = vx_chunk_new (&slab->chunks, slab->chunk, &slab->reserved);
+      slab->end = slab->bump + slab->chunk;
+   }
+   ptr = slab->bump;
+   slab->bump += slab->size;
+   return (ptr);
+}
+
+void vx_slab_free (vx_slab_t *slab, void *ptr)
+{
+   slab->used -= slab->size;
+   *(void **) ptr = slab->free;
+   slab->free = ptr;
+}
+
+void vx_slab_stats (vx_slab_t *slab, size_t *used, size_t *reserved)
+{
+   *used = slab->used;
+   *reserved = slab->reserved;
+}
+
+vx_arena_t * vx_arena_create (void)
+{
+   vx_arena_t *arena;
+   arena = calloc (1, sizeof (vx_arena_t));
+   assert (arena != NULL);
+   return (arena);
+}
+
+void vx_arena_destroy (vx_arena_t *arena)
+{
+   vx_block_t *block, *next;
+
+   for (block = arena->blocks; block; block = next)
+   {
+      next = block->next;
+      free (block);
+   }
+   vx_chunk_free (arena->chunks);
+   free (arena);
+}
+
+void * vx_arena_alloc (vx_arena_t *arena, size_t size)
+{
+   vx_block_t *block;
+   void *ptr;
+   size_t cls;
+
+   size = VX_SLAB_ROUND(size ? size : 1);
+   arena->used += size;
+   if (size > VX_ARENA_MAX)
+   {
+      /* no size class to recycle it through, so it goes back on free */
+      block = malloc (sizeof (vx_block_t) + size);
+      assert (block != NULL);
+      block->size = size;
+      block->prev = NULL;
+      if ((block->next = arena->blocks) != NULL)
+         block->next->prev = block;
+      arena->blocks = block;
+      arena->reserved += sizeof (vx_block_t) + size;
+      return (block + 1);
+   }
+
+   cls = size / VX_SLAB_ALIGN - 1;
+   if ((ptr = arena->free[cls]) != NULL)
+   {
+      arena->free[cls] = *(void **) ptr;
+      return (ptr);
+   }
+
+   if (arena->bump + size > arena->end)
+   {
+      arena->bump = vx_chunk_new (&arena->chunks, VX_SLAB_CHUNK, &arena->reserved);
+      arena->end = arena->bump + VX_SLAB_CHUNK;
+   }
+   ptr = arena->bump;
+   arena->bump += size;
+   return (ptr);
+}
+
+void vx_arena_free (vx_arena_t *arena, void *ptr, size_t size)
+{
+   vx_block_t *block;
+   size_t cls;
+
+   size = VX_SLAB_ROUND(size ? size : 1);
+   arena->used -= size;
+   if (size > VX_ARENA_MAX)
+   {
+      block = (vx_block_t *) ptr - 1;
+      if (block->prev)
+         block->prev->next = block->next;
+      else
+         arena->blocks = block->next;
+      if (block->next)
+         block->next->prev = block->prev;
+      arena->reserved -= sizeof (vx_block_t) + block->size;
+      free (block);
+      return;
+   }
+   cls = size / VX_SLAB_ALIGN - 1;
+   *(void **) ptr = arena->free[cls];
+   arena->free[cls] = ptr;
+}
+
+void vx_arena_stats (vx_arena_t *arena, size_t *used, size_t *reserved)
+{
+   *used = arena->used;
+   *reserved = arena->reserved;
+}
@@ -0,0 +1,98 @@
+/**
+ * vx_slab.h Copyright Voxaris Inc, George Howitt 2008
+ */
+
+#ifndef _VX_SLAB_H_
+#define _VX_SLAB_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * memory is reserved from malloc in chunks of this many bytes, or of one
+ * object for slabs of larger objects
+ */
+#define VX_SLAB_CHUNK (64 * 1024)
+
+/**
+ * arena blocks up to this size are recycled through size class free lists
+ */
+#define VX_ARENA_MAX  256
+
+struct vx_slab;
+/**
+ * vx_slab_t: fixed size objects carved out of chunks, freed objects are
+ * kept on a free list. Not thread safe.
+ */
+typedef struct vx_slab vx_slab_t;
+
+struct vx_arena;
+/**
+ * vx_arena_t: bump allocator for variable sized blocks. Blocks up to
+ * VX_ARENA_MAX are reused by size class once freed, larger ones are
+ * malloc'd one by one and freed by vx_arena_free. Not thread safe.
+ */
+typedef struct vx_arena vx_arena_t;
+
+/**
+ *
+ */
+vx_slab_t * vx_slab_create (size_t size);
+
+/**
+ * vx_slab_destroy: releases every chunk, O(number of chunks)
+ */
+void vx_slab_destroy (vx_slab_t *slab);
+
+/**
+ *
+ */
+void * vx_slab_alloc (vx_slab_t *slab);
+
+/**
+ *
+ */
+void vx_slab_free (vx_slab_t *slab, void *ptr);
+
+/**
+ * vx_slab_stats: bytes in live objects and bytes reserved in chunks
+ */
+void vx_slab_stats (vx_slab_t *slab, size_t *used, size_t *reserved);
+
+/**
+ *
+ */
+vx_arena_t * vx_arena_create (void);
+
+/**
+ *
+ */
+void vx_arena_destroy (vx_arena_t *arena);
+
+/**
+ *
+ */
+void * vx_arena_alloc (vx_arena_t *arena, size_t size);
+
+/**
+ * vx_arena_free: size must be the size given to vx_arena_alloc
+ */
+void vx_arena_free (vx_arena_t *arena, void *ptr, size_t size);
+
+/**
+ *
+ */
+void vx_arena_stats (vx_arena_t *arena, size_t *used, size_t *reserved);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -54,6 +54,22 @@ vx_status_t vx_sync_lock (vx_sync_t *sync)
    return (VX_SUCCESS);
 }
 
+/**
+ * vx_sync_trylock: VX_SUCCESS if we got the lock, VX_FAILURE if it is held
+ */
+vx_status_t vx_sync_trylock (vx_sync_t *sync)
+{
+   int rc;
+   if ((rc = pthread_mutex_trylock (&sync->mutex)))
+   {
+      if (rc != EBUSY)
+         vxlog (LOG_ERR, "{%s:%d} pthread_mutex_trylock failed: %d",
+            __func__, __LINE__, rc);
+      return (VX_FAILURE);
+   }
+   return (VX_SUCCESS);
+}
+
 vx_status_t vx_sync_unlock (vx_sync_t *sync)
 {
    int rc;
@@ -110,7 +126,7 @@ vx_status_t vx_sync_signal (vx_sync_t *sync)
 vx_status_t vx_sync_broadcast (vx_sync_t *sync)
 {
    int rc;
-   if ((rc = pthread_cond_signal (&sync->cond)))
+   if ((rc = pthread_cond_broadcast (&sync->cond)))
    {
       vxlog (LOG_ERR, "{%s:%d} pthread_cond_broadcast failed: %d",
          __func__, __LINE__, rc);
@@ -16,6 +16,8 @@ typedef enum vx_status
    VX_TIMEOUT,
    VX_FAILURE,
    VX_ENOMEM,
+   VX_EEMPTY,
+   VX_EFULL,
 } vx_status_t;
 
 typedef struct vx_sync
@@ -28,6 +30,7 @@ typedef struct vx_sync
 vx_status_t vx_sync_create (vx_sync_t **sync, pthread_mutexattr_t *attr);
 vx_status_t vx_sync_destroy (vx_sync_t *sync);
 vx_status_t vx_sync_lock (vx_sync_t *sync);
+vx_status_t vx_sync_trylock (vx_sync_t *sync);
 vx_status_t vx_sync_unlock (vx_sync_t *sync);
 vx_status_t vx_sync_wait (vx_sync_t *sync);
 vx_status_t vx_sync_timedwait (vx_sync_t *sync, const struct timespec *ts);